@@ -0,0 +1,117 @@
+#pragma once
+#include "stdlib.h"
+
+//Bump allocator for short-lived memory. Regions of whole pages are taken from the firmware with AllocatePages
+//and handed out by moving a pointer, nothing is returned to the firmware until the arena is reset or disposed.
+
+//Alignment of allocations that do not ask for one.
+#define ARENA_ALIGNMENT 16
+
+//Pages in the first region of an arena that does not ask for a size.
+#define ARENA_PAGES 16
+
+//Region of pages of an arena, the header is at the start of the pages and the rest is handed out.
+typedef struct ArenaRegion
+{
+	struct ArenaRegion* Previous;
+	UINTN Pages;
+} ArenaRegion;
+
+//Current is the newest region, allocations come from Current between Next and End.
+typedef struct
+{
+	ArenaRegion* Current;
+	UINT8* Next;
+	UINT8* End;
+	UINTN Pages;
+} Arena;
+
+//Create an arena whose regions hold at least the specified number of bytes, no memory is taken until the first allocation.
+Arena New_Arena(UINTN size)
+{
+	Arena result;
+	result.Current = NULL;
+	result.Next = NULL;
+	result.End = NULL;
+	result.Pages = size == 0 ? ARENA_PAGES : EFI_SIZE_TO_PAGES(size + sizeof(ArenaRegion));
+	return result;
+}
+
+//Take a new region that can hold an allocation of the specified size and alignment, returns 0 if the firmware is out of pages.
+int Arena_Grow(Arena* arena, UINTN size, UINTN alignment)
+{
+	UINTN needed = EFI_SIZE_TO_PAGES(sizeof(ArenaRegion) + alignment + size);
+
+	//Regions double so that an arena that keeps growing takes few regions.
+	UINTN pages = arena->Current == NULL ? arena->Pages : arena->Current->Pages * 2;
+	if (pages < needed) pages = needed;
+
+	EFI_PHYSICAL_ADDRESS address;
+	EFI_STATUS status = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages, EfiLoaderData, pages, &address);
+	if (EFI_ERROR(status)) return 0;
+
+	ArenaRegion* region = (ArenaRegion*)(UINTN)address;
+	region->Previous = arena->Current;
+	region->Pages = pages;
+
+	arena->Current = region;
+	arena->Next = (UINT8*)(region + 1);
+	arena->End = (UINT8*)region + (pages * EFI_PAGE_SIZE);
+	return 1;
+}
+
+//Allocate a block from an arena aligned to the specified power of two, or to ARENA_ALIGNMENT if it is 0.
+//The block lives until the arena is reset or disposed, it is never freed on its own.
+MemBlock Arena_Alloc(Arena* arena, UINTN size, UINTN alignment)
+{
+	MemBlock result;
+	result.Start = NULL;
+	result.Size = 0;
+
+	if (size == 0) return result;
+	if (alignment == 0) alignment = ARENA_ALIGNMENT;
+
+	UINT8* start = (UINT8*)(((UINTN)arena->Next + alignment - 1) & ~(alignment - 1));
+
+	if (arena->Current == NULL || start > arena->End || size > (UINTN)(arena->End - start))
+	{
+		if (!Arena_Grow(arena, size, alignment)) return result;
+		start = (UINT8*)(((UINTN)arena->Next + alignment - 1) & ~(alignment - 1));
+	}
+
+	arena->Next = start + size;
+
+	result.Start = start;
+	result.Size = size;
+	return result;
+}
+
+//Release every block allocated from an arena. The newest region, which is the largest, is kept for later allocations.
+void Arena_Reset(Arena* arena)
+{
+	if (arena->Current == NULL) return;
+
+	ArenaRegion* region = arena->Current->Previous;
+
+	while (region != NULL)
+	{
+		ArenaRegion* previous = region->Previous;
+		uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)(UINTN)region, region->Pages);
+		region = previous;
+	}
+
+	arena->Current->Previous = NULL;
+	arena->Next = (UINT8*)(arena->Current + 1);
+}
+
+//Destroy an arena, returning all of its pages to the firmware.
+void Dispose_Arena(Arena* arena)
+{
+	Arena_Reset(arena);
+
+	if (arena->Current != NULL) uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)(UINTN)arena->Current, arena->Current->Pages);
+
+	arena->Current = NULL;
+	arena->Next = NULL;
+	arena->End = NULL;
+}
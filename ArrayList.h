@@ -1,7 +1,10 @@
 #pragma once
-#include "stdlib.h"
+#include "Slab.h"
 
-//Object that represents an array list.
+//Elements a new array list has room for, lists never shrink below it.
+#define ARRAYLIST_CAPACITY 1024
+
+//Object that represents an array list. Capacity is the number of elements that fit in the usable size of Data.
 typedef struct
 {
 	MemBlock Data;
@@ -14,8 +17,8 @@ ArrayList New_ArrayList()
 {
 	ArrayList list;
 	list.Length = 0;
-	list.Capacity = 1024;
-	list.Data = malloc(sizeof(void*) * list.Capacity);
+	list.Data = Slab_AllocBlock(sizeof(void*) * ARRAYLIST_CAPACITY);
+	list.Capacity = list.Data.Size / sizeof(void*);
 	return list;
 }
 
@@ -24,7 +27,19 @@ void Dispose_ArrayList(ArrayList* list)
 {
 	list->Length = 0;
 	list->Capacity = 0;
-	free(&list->Data);
+	Slab_FreeBlock(&list->Data);
+}
+
+//Resize the storage of an array list to hold at least the specified number of elements, never fewer than it holds.
+//Returns FALSE if there is not enough memory, in which case the list is left as it was.
+BOOLEAN ArrayList_Resize(ArrayList* list, UINTN capacity)
+{
+	if (capacity < list->Length) capacity = list->Length;
+
+	if (!Slab_Resize(&list->Data, capacity * sizeof(void*), list->Length * sizeof(void*))) return FALSE;
+
+	list->Capacity = list->Data.Size / sizeof(void*);
+	return TRUE;
 }
 
 //Get an element from an array list.
@@ -39,29 +54,26 @@ void ArrayList_Set(ArrayList* list, UINTN index, void* element)
 	((void**)list->Data.Start)[index] = element;
 }
 
-//Add an element to an array list.
-void ArrayList_Add(ArrayList* list, void* element)
+//Add an element to an array list, returns FALSE if there is not enough memory to grow it.
+BOOLEAN ArrayList_Add(ArrayList* list, void* element)
 {
-	if (list->Length >= list->Capacity)
-	{
-		list->Data = realloc(&list->Data, list->Capacity * 2);
-	}
+	if (list->Length >= list->Capacity && !ArrayList_Resize(list, list->Capacity * 2)) return FALSE;
 
 	((void**)list->Data.Start)[list->Length] = element;
 	list->Length += 1;
+	return TRUE;
 }
 
-//Insert an element into an array list.
-void ArrayList_Insert(ArrayList* list, void* element, UINTN index)
+//Insert an element into an array list, returns FALSE if there is not enough memory to grow it.
+BOOLEAN ArrayList_Insert(ArrayList* list, void* element, UINTN index)
 {
-	ArrayList_Add(list, element);
+	if (index > list->Length) return FALSE;
+	if (!ArrayList_Add(list, element)) return FALSE;
 
-	for (UINTN i = index; i < list->Length - 1; i++)
-	{
-		((void**)list->Data.Start)[i + 1] = ((void**)list->Data.Start)[i];
-	}
-
-	((void**)list->Data.Start)[index] = element;
+	void** data = (void**)list->Data.Start;
+	movemem(&data[index + 1], &data[index], (list->Length - 1 - index) * sizeof(void*));
+	data[index] = element;
+	return TRUE;
 }
 
 //Remove an element at the specified index from an array list.
@@ -69,18 +81,16 @@ void* ArrayList_RemoveAt(ArrayList* list, UINTN index)
 {
 	if (index < 0 || index >= list->Length) return 0;
 
-	void* result = ((void**)list->Data.Start)[index];
-
-	for (UINTN i = index; i < list->Length - 1; i++)
-	{
-		((void**)list->Data.Start)[i] = ((void**)list->Data.Start)[i + 1];
-	}
+	void** data = (void**)list->Data.Start;
+	void* result = data[index];
 
+	movemem(&data[index], &data[index + 1], (list->Length - 1 - index) * sizeof(void*));
 	list->Length -= 1;
-	
-	if (list->Capacity > 1024 && list->Length < (list->Capacity / 2))
+
+	//Shrinking only below a quarter keeps a list that alternates between adding and removing from moving every time.
+	if (list->Capacity > ARRAYLIST_CAPACITY && list->Length < (list->Capacity / 4))
 	{
-		list->Data = realloc(&list->Data, list->Capacity / 2);
+		ArrayList_Resize(list, list->Capacity / 2);
 	}
 
 	return result;
@@ -91,27 +101,23 @@ BOOLEAN ArrayList_Remove(ArrayList* list, void* element)
 {
 	BOOLEAN result = FALSE;
 
+	void** data = (void**)list->Data.Start;
+
 	for (UINTN i = 0; i < list->Length; i++)
 	{
-		void* current = ((void**)list->Data.Start)[i];
-
-		if (current == element)
+		if (data[i] == element)
 		{
 			result = TRUE;
 
-			for (UINTN j = i; j < list->Length - 1; j++)
-			{
-				((void**)list->Data.Start)[j] = ((void**)list->Data.Start)[j + 1];
-			}
-
+			movemem(&data[i], &data[i + 1], (list->Length - 1 - i) * sizeof(void*));
 			list->Length -= 1;
 			break;
 		}
 	}
 
-	if (result && list->Capacity > 1024 && (list->Length < (list->Capacity / 2)))
+	if (result && list->Capacity > ARRAYLIST_CAPACITY && (list->Length < (list->Capacity / 4)))
 	{
-		list->Data = realloc(&list->Data, list->Capacity / 2);
+		ArrayList_Resize(list, list->Capacity / 2);
 	}
 
 	return result;
@@ -0,0 +1,182 @@
+#pragma once
+#include "VMIL.h"
+#include "Fusion.h"
+
+//Cache of a program that passed the verifier, saved next to the program so that later boots skip loading,
+//widening and fusion. It holds the memory of the VM with the fused code and is keyed by a hash of the image
+//it was made from. Native code and IR point into buffers that move between boots, so they are rebuilt from
+//the cache instead of being saved. The CRC32C of a cache only catches damage: anyone who can write the image
+//can write its cache, so the code in a cache is verified again, superinstructions included, before it runs.
+
+//"LUCIDVC" followed by a zero byte.
+#define VM_CACHE_MAGIC 0x004356444943554C
+
+//Changes whenever the encoding of code or superinstructions change.
+#define VM_CACHE_VERSION 2
+
+//Appended to the name of a program to get the name of its cache.
+#define VM_CACHE_SUFFIX L".vmc"
+
+//Start and Error are offsets into the memory of the VM.
+typedef struct
+{
+	UINT64 Magic;
+	UINT32 Version;
+	UINT32 Checksum;
+	UINT64 Key;
+	UINT64 MemorySize;
+	UINT64 VarCount;
+	UINT64 Start;
+	UINT64 Error;
+	UINT64 StackLimit;
+} VMCacheHeader;
+
+//Hash an image for use as the key of its cache, the size of the file in the high half and a CRC32C in the low half.
+//Images in the format of Image.h only hash their header, whose checksum already covers the rest of the file.
+//Other images are read through a buffer from the scratch arena if one is specified.
+EFI_STATUS VMCache_Key(EFI_FILE* source, Arena* scratch, UINT64* result)
+{
+	VMImageHeader header;
+	UINT64 size;
+
+	EFI_STATUS status = VMImage_Read(source, 0, sizeof(header), &header);
+
+	if (!EFI_ERROR(status) && header.Magic == VM_IMAGE_MAGIC)
+	{
+		status = VMIL_Remaining(source, &size);
+		if (EFI_ERROR(status)) return status;
+
+		*result = ((size + sizeof(header)) << 32) ^ VMImage_Crc(0, &header, sizeof(header));
+		return EFI_SUCCESS;
+	}
+	else if (EFI_ERROR(status) && status != EFI_END_OF_FILE) return status;
+
+	MemBlock buffer = scratch != NULL ? Arena_Alloc(scratch, VMIL_READ_AHEAD, 0) : malloc(VMIL_READ_AHEAD);
+	if (buffer.Start == NULL) return EFI_OUT_OF_RESOURCES;
+
+	UINT32 crc = 0;
+	size = 0;
+	status = source->SetPosition(source, 0);
+
+	while (!EFI_ERROR(status))
+	{
+		UINTN length = VMIL_READ_AHEAD;
+		status = source->Read(source, &length, buffer.Start);
+		if (EFI_ERROR(status) || length == 0) break;
+
+		crc = VMImage_Crc(crc, buffer.Start, length);
+		size += length;
+	}
+
+	if (scratch == NULL) free(&buffer);
+
+	if (EFI_ERROR(status)) return status;
+
+	*result = (size << 32) ^ crc;
+	return EFI_SUCCESS;
+}
+
+//Load a VM from the cache with the specified name in a directory. Fails if there is no cache, if it was made
+//from another image than the one with the key, if it is damaged or if its code does not pass the verifier,
+//in which case the program is loaded normally.
+EFI_STATUS VMCache_Load(EFI_FILE* directory, CHAR16* name, UINT64 key, UINTN id, VM* result)
+{
+	EFI_FILE* file;
+	VMCacheHeader header;
+
+	EFI_STATUS status = directory->Open(directory, &file, name, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
+	if (EFI_ERROR(status)) return status;
+
+	status = VMImage_Read(file, 0, sizeof(header), &header);
+
+	if (!EFI_ERROR(status))
+	{
+		if (header.Magic != VM_CACHE_MAGIC || header.Version != VM_CACHE_VERSION) status = EFI_INCOMPATIBLE_VERSION;
+		else if (header.Key != key) status = EFI_NOT_FOUND;
+		else if (header.VarCount > header.Start / sizeof(UINT64) || header.Start >= header.MemorySize) status = EFI_LOAD_ERROR;
+		else if (header.Error >= header.MemorySize) status = EFI_LOAD_ERROR;
+	}
+
+	MemBlock mem = { NULL, 0 };
+
+	if (!EFI_ERROR(status))
+	{
+		mem = malloc(header.MemorySize);
+		status = mem.Start == NULL ? EFI_OUT_OF_RESOURCES : VMImage_Read(file, sizeof(header), mem.Size, mem.Start);
+	}
+
+	file->Close(file);
+
+	if (!EFI_ERROR(status))
+	{
+		UINT32 expected = header.Checksum;
+		header.Checksum = 0;
+
+		UINT32 crc = VMImage_Crc(0, &header, sizeof(header));
+		if (VMImage_Crc(crc, mem.Start, mem.Size) != expected) status = EFI_CRC_ERROR;
+	}
+
+	if (EFI_ERROR(status))
+	{
+		if (mem.Start != NULL) free(&mem);
+		return status;
+	}
+
+	UINT8* memStart = (UINT8*)mem.Start;
+
+	*result = New_VM(mem, id, 1, (UINT64*)memStart, header.VarCount, memStart + header.Start, memStart + header.Error);
+	VM_SetStackLimit(result, header.StackLimit);
+
+	status = VM_Verify(result);
+	if (!EFI_ERROR(status)) status = VM_FuseCheck(result);
+
+	if (EFI_ERROR(status))
+	{
+		Dispose_VM(result);
+		return EFI_LOAD_ERROR;
+	}
+
+	return EFI_SUCCESS;
+}
+
+//Save a verified VM that has not run yet as the cache with the specified name in a directory, replacing the cache if it exists.
+EFI_STATUS VMCache_Save(EFI_FILE* directory, CHAR16* name, UINT64 key, VM* vm)
+{
+	EFI_FILE* file;
+	VMCacheHeader header;
+	VMVerification* info = &vm->Verification;
+
+	if (info->Status != Verified || vm->Current != vm->Start || vm->StackTop != 0) return EFI_NOT_READY;
+
+	MemBlock* memory = VM_CodeMemory(vm);
+	UINT8* memStart = (UINT8*)memory->Start;
+
+	header.Magic = VM_CACHE_MAGIC;
+	header.Version = VM_CACHE_VERSION;
+	header.Checksum = 0;
+	header.Key = key;
+	header.MemorySize = memory->Size;
+	header.VarCount = vm->VarCount;
+	header.Start = vm->Start - memStart;
+	header.Error = vm->Error - memStart;
+	header.StackLimit = vm->StackLimit;
+
+	UINT32 crc = VMImage_Crc(0, &header, sizeof(header));
+	header.Checksum = VMImage_Crc(crc, memStart, memory->Size);
+
+	//Opening an existing file keeps its contents, so it is deleted first.
+	EFI_STATUS status = directory->Open(directory, &file, name, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+	if (!EFI_ERROR(status)) file->Delete(file);
+
+	status = directory->Open(directory, &file, name, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+	if (EFI_ERROR(status)) return status;
+
+	status = VMImage_Write(file, sizeof(header), &header);
+	if (!EFI_ERROR(status)) status = VMImage_Write(file, memory->Size, memStart);
+
+	//A cache that was only partly written is removed, Delete also closes the file.
+	if (EFI_ERROR(status)) file->Delete(file);
+	else file->Close(file);
+
+	return status;
+}
@@ -6,6 +6,7 @@ typedef struct
 	UINT8* Start;
 	UINT8* Position;
 	UINT64 Length;
+	EFI_STATUS Status;
 } Emitter;
 
 //Create a new emitter.
@@ -15,6 +16,7 @@ Emitter New_Emitter(void* ptr, UINTN length)
 	result.Start = ptr;
 	result.Position = ptr;
 	result.Length = length;
+	result.Status = EFI_SUCCESS;
 	return result;
 }
 
@@ -24,30 +26,82 @@ void Emitter_Execute(Emitter emit)
 	((void (*)(void))emit.Start)();
 }
 
-//Emit the specified bytes.
-EFI_STATUS Emitter_EmitBytes(Emitter emit, UINT8* value, UINTN length)
+//Get the offset of the next byte that will be emitted.
+UINTN Emitter_Offset(Emitter* emit)
 {
-	if ((emit.Position + length) >= (emit.Start + emit.Length) && emit.Position >= emit.Start)
+	return emit->Position - emit->Start;
+}
+
+//Emit the specified bytes, the first failure is kept in the emitter status.
+EFI_STATUS Emitter_EmitBytes(Emitter* emit, UINT8* value, UINTN length)
+{
+	if (emit->Position < emit->Start || (emit->Position + length) > (emit->Start + emit->Length))
 	{
+		emit->Status = EFI_OUT_OF_RESOURCES;
 		return EFI_OUT_OF_RESOURCES;
 	}
 	else
 	{
 		for (UINTN i = 0; i < length; i++)
 		{
-			emit.Position[i] = value[i];
+			emit->Position[i] = value[i];
 		}
 
-		emit.Position += length;
+		emit->Position += length;
 
 		return EFI_SUCCESS;
 	}
 }
 
+//Emit a single byte.
+EFI_STATUS Emitter_EmitByte(Emitter* emit, UINT8 value)
+{
+	return Emitter_EmitBytes(emit, &value, 1);
+}
+
+//Emit a little endian 32-bit value.
+EFI_STATUS Emitter_EmitUInt32(Emitter* emit, UINT32 value)
+{
+	UINT8 buffer[4] = { (UINT8)value, (UINT8)(value >> 8), (UINT8)(value >> 16), (UINT8)(value >> 24) };
+
+	return Emitter_EmitBytes(emit, buffer, 4);
+}
+
+//Emit a little endian 64-bit value.
+EFI_STATUS Emitter_EmitUInt64(Emitter* emit, UINT64 value)
+{
+	EFI_STATUS status = Emitter_EmitUInt32(emit, (UINT32)value);
+
+	if (EFI_ERROR(status)) return status;
+
+	return Emitter_EmitUInt32(emit, (UINT32)(value >> 32));
+}
+
 //Emit a short relative jump.
-EFI_STATUS Emitter_EmitShortRelativeJump(Emitter emit, INT8 rel)
+EFI_STATUS Emitter_EmitShortRelativeJump(Emitter* emit, INT8 rel)
 {
 	UINT8 buffer[2] = { 0xEB, (UINT8)rel };
 
 	return Emitter_EmitBytes(emit, buffer, 2);
-}
\ No newline at end of file
+}
+
+//Emit a near relative jump to the specified offset.
+EFI_STATUS Emitter_EmitRelativeJump(Emitter* emit, UINTN target)
+{
+	EFI_STATUS status = Emitter_EmitByte(emit, 0xE9);
+
+	if (EFI_ERROR(status)) return status;
+
+	return Emitter_EmitUInt32(emit, (UINT32)(target - (Emitter_Offset(emit) + 4)));
+}
+
+//Point the 32-bit relative displacement at the specified offset to a target offset.
+void Emitter_PatchRelative32(Emitter* emit, UINTN at, UINTN target)
+{
+	UINT32 rel = (UINT32)(target - (at + 4));
+
+	emit->Start[at] = (UINT8)rel;
+	emit->Start[at + 1] = (UINT8)(rel >> 8);
+	emit->Start[at + 2] = (UINT8)(rel >> 16);
+	emit->Start[at + 3] = (UINT8)(rel >> 24);
+}
@@ -1,49 +1,60 @@
 #pragma once
 #include <efi.h>
 #include "ArrayList.h"
+#include "Arena.h"
+#include "Slab.h"
 
-//Get all entries in a directory.
-ArrayList GetEntries(EFI_FILE* directory)
+//Size of the block of an entry that is not allocated from an arena.
+#define FILE_ENTRY_SIZE 1024
+
+//Free an entry that was not allocated from an arena.
+void Dispose_Entry(EFI_FILE_INFO* entry)
+{
+	Slab_Free(entry, FILE_ENTRY_SIZE);
+}
+
+//Get all entries in a directory. Entries are allocated from the arena if one is specified and live until it
+//is reset, otherwise every entry is a FILE_ENTRY_SIZE block of its own that is freed with Dispose_Entry.
+ArrayList GetEntries(EFI_FILE* directory, Arena* arena)
 {
 	ArrayList result = New_ArrayList();
+	UINT64 scratch[FILE_ENTRY_SIZE / sizeof(UINT64)];
 	MemBlock buffer;
 	UINTN size;
 	EFI_STATUS status;
 
-	UINTN i = 0;
-
 	while (1)
 	{
-		size = 1024;
-		buffer = zmalloc(size);
-		status = directory->Read(directory, &size, buffer.Start);
+		size = sizeof(scratch);
+		status = directory->Read(directory, &size, scratch);
 
-		if (EFI_ERROR(status) || size == 0)
-		{
-			free(&buffer);
-			break;
-		}
+		if (EFI_ERROR(status) || size == 0) break;
+
+		EFI_FILE_INFO* file = (EFI_FILE_INFO*)scratch;
 
-		EFI_FILE_INFO* file = (EFI_FILE_INFO*)buffer.Start;
+		if (file->FileName[0] == L'.') continue;
 
-		if (file->FileName[0] == L'.')
+		buffer = arena != NULL ? Arena_Alloc(arena, size, 0) : Slab_ZAlloc(FILE_ENTRY_SIZE);
+		if (buffer.Start == NULL) break;
+
+		copymem(buffer.Start, scratch, size);
+
+		if (!ArrayList_Add(&result, buffer.Start))
 		{
-			free(&buffer);
-			continue;
+			if (arena == NULL) Dispose_Entry((EFI_FILE_INFO*)buffer.Start);
+			break;
 		}
-
-		ArrayList_Add(&result, buffer.Start);
 	}
 
 	return result;
 }
 
-//Get all entries with a specified attribute.
-ArrayList GetEntriesWithType(EFI_FILE* directory, UINTN type, int invert)
+//Get all entries with a specified attribute, allocated like the entries of GetEntries.
+ArrayList GetEntriesWithType(EFI_FILE* directory, UINTN type, int invert, Arena* arena)
 {
 	ArrayList result = New_ArrayList();
 
-	ArrayList all = GetEntries(directory);
+	ArrayList all = GetEntries(directory, arena);
 
 	for (UINTN i = 0; i < all.Length; i++)
 	{
@@ -51,14 +62,10 @@ ArrayList GetEntriesWithType(EFI_FILE* directory, UINTN type, int invert)
 
 		UINTN isType = ((EFI_FILE_INFO*)elem)->Attribute & type;
 
-		if (invert ? !isType : isType)
-		{
-			ArrayList_Add(&result, elem);
-		}
-		else
-		{
-			freeany(elem);
-		}
+		if ((invert ? !isType : isType) && ArrayList_Add(&result, elem)) continue;
+
+		//Entries that are left out or that the list had no room for are freed, unless they belong to the arena.
+		if (arena == NULL) Dispose_Entry((EFI_FILE_INFO*)elem);
 	}
 
 	Dispose_ArrayList(&all);
@@ -67,15 +74,15 @@ ArrayList GetEntriesWithType(EFI_FILE* directory, UINTN type, int invert)
 }
 
 //Get all files in a directory.
-ArrayList GetFiles(EFI_FILE* directory)
+ArrayList GetFiles(EFI_FILE* directory, Arena* arena)
 {
-	return GetEntriesWithType(directory, EFI_FILE_DIRECTORY, 1);
+	return GetEntriesWithType(directory, EFI_FILE_DIRECTORY, 1, arena);
 }
 
 //Get all subdirectories in a directory.
-ArrayList GetDirectories(EFI_FILE* directory)
+ArrayList GetDirectories(EFI_FILE* directory, Arena* arena)
 {
-	return GetEntriesWithType(directory, EFI_FILE_DIRECTORY, 0);
+	return GetEntriesWithType(directory, EFI_FILE_DIRECTORY, 0, arena);
 }
 
 //Open a file in a directory.
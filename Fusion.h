@@ -0,0 +1,96 @@
+#pragma once
+#include "Verifier.h"
+
+//Returns 1 if a verified instruction with the specified opcode starts at the offset.
+int VM_FuseMatch(VM* vm, UINTN offset, UINT8 op)
+{
+	VMVerification* info = &vm->Verification;
+
+	return offset < info->CodeLength && (info->Flags[offset] & VM_CODE_INSTRUCTION) && VM_BaseOpcode(vm->Start[offset]) == op;
+}
+
+//Get the superinstruction that a compare, PUSH, JIF sequence fuses to.
+UINT8 VM_FuseCompare(UINT8 op)
+{
+	switch (op)
+	{
+		case EQU: return EQU_JIF;
+		case NEQ: return NEQ_JIF;
+		case ABV: return ABV_JIF;
+		case BEL: return BEL_JIF;
+		case GTR: return GTR_JIF;
+		case LES: return LES_JIF;
+	}
+
+	return 0;
+}
+
+//Get the superinstruction that the verified instruction at the offset starts, or 0 if it starts none.
+UINT8 VM_FuseAt(VM* vm, UINTN offset)
+{
+	UINT8 op = VM_BaseOpcode(vm->Start[offset]);
+
+	if (op == LDVAR && VM_FuseMatch(vm, offset + 9, PUSH) && VM_FuseMatch(vm, offset + 19, STVAR))
+	{
+		//LDVAR a; PUSH k; ADD; STVAR b
+		if (VM_FuseMatch(vm, offset + 18, ADD)) return LDVAR_ADD_STVAR;
+		if (VM_FuseMatch(vm, offset + 18, SUB)) return LDVAR_SUB_STVAR;
+	}
+	else if (op == PUSH)
+	{
+		//PUSH offset; JMP and PUSH offset; JIF
+		if (VM_FuseMatch(vm, offset + 9, JMP)) return PUSH_JMP;
+		if (VM_FuseMatch(vm, offset + 9, JIF)) return PUSH_JIF;
+	}
+	else if (VM_FuseCompare(op) != 0 && VM_FuseMatch(vm, offset + 1, PUSH) && VM_FuseMatch(vm, offset + 10, JIF))
+	{
+		//Comparison; PUSH offset; JIF
+		return VM_FuseCompare(op);
+	}
+
+	return 0;
+}
+
+//Rewrite common sequences of verified code into superinstructions, returns the number of sequences fused.
+//Only the first opcode of a sequence is replaced, so its operands, branch targets inside it and the image
+//on disk are untouched, VM_BaseOpcode recovers the original opcode for the verifier, JIT and disassembler.
+UINTN VM_Fuse(VM* vm)
+{
+	VMVerification* info = &vm->Verification;
+	UINTN fused = 0;
+
+	if (info->Status != Verified) return 0;
+
+	for (UINTN i = 0; i < info->CodeLength; i++)
+	{
+		if (!(info->Flags[i] & VM_CODE_INSTRUCTION)) continue;
+
+		UINT8 result = VM_FuseAt(vm, i);
+
+		if (result != 0)
+		{
+			vm->Start[i] = result;
+			fused++;
+		}
+	}
+
+	return fused;
+}
+
+//Check that every superinstruction in verified code starts the sequence it stands for. The verifier only sees
+//the first instruction of a sequence, so code that was fused elsewhere must pass this before it runs unchecked.
+EFI_STATUS VM_FuseCheck(VM* vm)
+{
+	VMVerification* info = &vm->Verification;
+
+	if (info->Status != Verified) return EFI_NOT_READY;
+
+	for (UINTN i = 0; i < info->CodeLength; i++)
+	{
+		if (!(info->Flags[i] & VM_CODE_INSTRUCTION) || vm->Start[i] == VM_BaseOpcode(vm->Start[i])) continue;
+
+		if (VM_FuseAt(vm, i) != vm->Start[i]) return EFI_LOAD_ERROR;
+	}
+
+	return EFI_SUCCESS;
+}
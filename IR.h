@@ -0,0 +1,730 @@
+#pragma once
+#include "Verifier.h"
+
+//Register IR for verified VMIL programs.
+//The stack entry at depth n becomes the register Stack[n]. PUSH, LDVAR, LDINDVAR, LDSTACK, DUP and POP
+//emit nothing, they leave a reference to their value on a stack kept during translation and the
+//operation that consumes the value reads it straight from the variable or constant. References are
+//written back to their registers wherever control can enter or leave a block, so the stack there matches
+//the stack interpreter. HLT, BRK and jumps to targets that are not constant leave the IR and are run by
+//VM_Run, which also keeps faults going through vm->Error. An indexed access or lane operation out of
+//range leaves the IR before it, so that the interpreter faults on it, and so does a call or ENTER that
+//finds the return stack or the frame arena full. Calls and returns share the return stack with VM_Run.
+typedef enum
+{
+	IR_NOP,
+	IR_MOV,
+
+	IR_ADD,
+	IR_SUB,
+	IR_MUL,
+	IR_IMUL,
+	IR_DIV,
+	IR_IDIV,
+	IR_MOD,
+	IR_IMOD,
+
+	IR_AND,
+	IR_OR,
+	IR_XOR,
+	IR_SHL,
+	IR_SHR,
+	IR_NOT,
+
+	IR_EQU,
+	IR_NEQ,
+	IR_ABV,
+	IR_BEL,
+	IR_GTR,
+	IR_LES,
+
+	IR_JMP,
+	IR_JIF,
+
+	IR_JEQU,
+	IR_JNEQ,
+	IR_JABV,
+	IR_JBEL,
+	IR_JGTR,
+	IR_JLES,
+
+	IR_LDIDX,
+	IR_STIDX,
+	IR_LANES,
+
+	IR_CALL,
+	IR_RET,
+	IR_ENTER,
+	IR_LDLOC,
+	IR_STLOC,
+
+	IR_EXIT
+} IROpCode;
+
+//State of a single translation.
+typedef struct
+{
+	VM* VM;
+	VMIR* IR;
+	UINT64** Refs;
+	UINTN Depth;
+	UINTN ConstantCount;
+	UINT32 Retired;
+	INTN Last;
+	EFI_STATUS Status;
+} IRTranslator;
+
+//Get the IR operation for a VMIL arithmetic, logic or comparison opcode, or IR_NOP for other opcodes.
+UINT8 IR_Operation(UINT8 op)
+{
+	switch (op)
+	{
+		case ADD: return IR_ADD;
+		case SUB: return IR_SUB;
+		case MUL: return IR_MUL;
+		case IMUL: return IR_IMUL;
+		case DIV: return IR_DIV;
+		case IDIV: return IR_IDIV;
+		case MOD: return IR_MOD;
+		case IMOD: return IR_IMOD;
+		case AND: return IR_AND;
+		case OR: return IR_OR;
+		case XOR: return IR_XOR;
+		case SHL: return IR_SHL;
+		case SHR: return IR_SHR;
+		case EQU: return IR_EQU;
+		case NEQ: return IR_NEQ;
+		case ABV: return IR_ABV;
+		case BEL: return IR_BEL;
+		case GTR: return IR_GTR;
+		case LES: return IR_LES;
+	}
+
+	return IR_NOP;
+}
+
+//Append an instruction, it retires every VMIL instruction translated since the previous one.
+IRInstruction* IR_Emit(IRTranslator* t, UINT8 op, UINT64* dest, UINT64* a, UINT64* b)
+{
+	VMIR* ir = t->IR;
+
+	t->Last = -1;
+
+	if (EFI_ERROR(t->Status)) return NULL;
+
+	if (ir->Length == ir->Capacity)
+	{
+		MemBlock block;
+		block.Start = ir->Code;
+		block.Size = ir->Length * sizeof(IRInstruction);
+		block = realloc(&block, ir->Capacity * 2 * sizeof(IRInstruction));
+
+		if (block.Start == NULL)
+		{
+			ir->Code = NULL;
+			t->Status = EFI_OUT_OF_RESOURCES;
+			return NULL;
+		}
+
+		ir->Code = (IRInstruction*)block.Start;
+		ir->Capacity *= 2;
+	}
+
+	IRInstruction* result = &ir->Code[ir->Length++];
+	result->Op = op;
+	result->Retired = t->Retired;
+	result->Depth = (UINT32)t->Depth;
+	result->Offset = 0;
+	result->Target = 0;
+	result->Dest = dest;
+	result->A = a;
+	result->B = b;
+
+	t->Retired = 0;
+	return result;
+}
+
+//Add a value to the constant pool and return a reference to it.
+UINT64* IR_Constant(IRTranslator* t, UINT64 value)
+{
+	UINT64* result = &t->IR->Constants[t->ConstantCount++];
+	*result = value;
+	return result;
+}
+
+//Returns 1 if a reference points into the constant pool.
+int IR_IsConstant(IRTranslator* t, UINT64* ref)
+{
+	return ref >= t->IR->Constants && ref < t->IR->Constants + t->ConstantCount;
+}
+
+//Write every pending reference below the specified depth back to its register.
+void IR_Flush(IRTranslator* t, UINTN depth)
+{
+	UINT64* stack = t->IR->Stack;
+
+	for (UINTN i = 0; i < depth; i++)
+	{
+		if (t->Refs[i] != &stack[i])
+		{
+			IR_Emit(t, IR_MOV, &stack[i], t->Refs[i], NULL);
+			t->Refs[i] = &stack[i];
+		}
+	}
+}
+
+//Leave the IR before the instruction at the specified offset, it is run by the stack interpreter.
+void IR_EmitExit(IRTranslator* t, UINTN offset)
+{
+	t->Retired--;
+	IR_Flush(t, t->Depth);
+
+	IRInstruction* exit = IR_Emit(t, IR_EXIT, NULL, NULL, NULL);
+	if (exit != NULL) exit->Offset = (UINT32)offset;
+}
+
+//Emit a branch to the block at the specified offset, the stack has already been popped to its depth there.
+void IR_EmitBranch(IRTranslator* t, UINT8 op, UINTN target, UINT64* a, UINT64* b)
+{
+	IR_Flush(t, t->Depth);
+
+	IRInstruction* branch = IR_Emit(t, op, NULL, a, b);
+
+	if (branch != NULL)
+	{
+		branch->Offset = (UINT32)target;
+		branch->Target = (UINT32)VM_FindBlock(&t->VM->Verification, target);
+	}
+}
+
+//Translate the VMIL instruction at the specified offset, returns 0 if it ends the block.
+int IR_TranslateInstruction(IRTranslator* t, UINTN offset)
+{
+	VM* vm = t->VM;
+	UINT64* stack = t->IR->Stack;
+	UINT8 op = VM_BaseOpcode(vm->Start[offset]);
+	UINT64 operand = (op & IMMEDIATE) ? *((UINT64*)&vm->Start[offset + 1]) : 0;
+	UINTN depth = t->Depth;
+	UINTN next = offset + ((op & IMMEDIATE) ? 9 : 1);
+
+	t->Retired++;
+
+	switch (op)
+	{
+		case HLT:
+		case BRK:
+			IR_EmitExit(t, offset);
+			return 0;
+		case PUSH:
+			t->Refs[t->Depth++] = IR_Constant(t, operand);
+			return 1;
+		case DUP:
+			t->Refs[depth] = t->Refs[depth - 1];
+			t->Depth++;
+			return 1;
+		case POP:
+			t->Depth--;
+			return 1;
+		case LDSTACK:
+			t->Refs[t->Depth++] = IR_Constant(t, depth);
+			return 1;
+		case LDVAR:
+			t->Refs[t->Depth++] = &vm->Variables[operand];
+			return 1;
+		case LDINDVAR:
+			t->Refs[t->Depth++] = IR_Constant(t, (UINT64)&vm->Variables[operand]);
+			return 1;
+		case STVAR:
+		{
+			UINT64* variable = &vm->Variables[operand];
+
+			//Values still read from the variable have to be kept before it changes.
+			for (UINTN i = 0; i < depth - 1; i++)
+			{
+				if (t->Refs[i] == variable)
+				{
+					IR_Emit(t, IR_MOV, &stack[i], variable, NULL);
+					t->Refs[i] = &stack[i];
+				}
+			}
+
+			//An operation that just produced the value can write it to the variable itself.
+			if (t->Last >= 0 && t->Refs[depth - 1] == &stack[depth - 1] && t->IR->Code[t->Last].Dest == &stack[depth - 1])
+			{
+				t->IR->Code[t->Last].Dest = variable;
+				t->IR->Code[t->Last].Retired += t->Retired;
+				t->Retired = 0;
+			}
+			else
+			{
+				IR_Emit(t, IR_MOV, variable, t->Refs[depth - 1], NULL);
+			}
+
+			t->Depth--;
+			return 1;
+		}
+		case LDIDXVAR:
+		case STIDXVAR:
+		{
+			//The stack has to be in its registers in case the index is out of range and the IR is left.
+			t->Retired--;
+			IR_Flush(t, depth);
+			t->Retired++;
+
+			IRInstruction* access;
+
+			if (op == LDIDXVAR) access = IR_Emit(t, IR_LDIDX, &stack[depth - 1], &stack[depth - 1], &vm->Variables[operand]);
+			else access = IR_Emit(t, IR_STIDX, &vm->Variables[operand], &stack[depth - 2], &stack[depth - 1]);
+
+			if (access != NULL) access->Offset = (UINT32)offset;
+			if (op == STIDXVAR) t->Depth -= 2;
+
+			return 1;
+		}
+		case VADD:
+		case VSUB:
+		case VAND:
+		case VOR:
+		case VXOR:
+		case VEQU:
+		case VMIN:
+		case VMAX:
+		{
+			//The operands are written to their registers by the instruction itself if it leaves the IR.
+			t->Retired--;
+			IR_Flush(t, depth - 3);
+			t->Retired++;
+
+			IRInstruction* lanes = IR_Emit(t, IR_LANES, t->Refs[depth - 3], t->Refs[depth - 2], t->Refs[depth - 1]);
+
+			if (lanes != NULL)
+			{
+				lanes->Offset = (UINT32)offset;
+				lanes->Target = ((UINT32)operand << 8) | op;
+			}
+
+			t->Depth -= 3;
+			return 1;
+		}
+		//The offset of the instruction after the call is kept as a constant, the branch to the function
+		//leaves the IR with the offset of the function like any other branch.
+		case CALL:
+			if (!IR_IsConstant(t, t->Refs[depth - 1]))
+			{
+				IR_EmitExit(t, offset);
+				return 0;
+			}
+
+			t->Depth--;
+			IR_EmitBranch(t, IR_CALL, next + *t->Refs[depth - 1], t->Refs[depth - 1], IR_Constant(t, next));
+			return 0;
+		case RET:
+		{
+			IR_Flush(t, depth);
+
+			IRInstruction* ret = IR_Emit(t, IR_RET, NULL, NULL, NULL);
+			if (ret != NULL) ret->Offset = (UINT32)offset;
+
+			return 0;
+		}
+		case ENTER:
+		{
+			t->Retired--;
+			IR_Flush(t, depth);
+			t->Retired++;
+
+			IRInstruction* enter = IR_Emit(t, IR_ENTER, NULL, IR_Constant(t, operand), NULL);
+			if (enter != NULL) enter->Offset = (UINT32)offset;
+
+			return 1;
+		}
+		//Locals are read and written when the instruction runs, as the frame moves with every call.
+		case LDLOC:
+			IR_Emit(t, IR_LDLOC, &stack[depth], IR_Constant(t, operand), NULL);
+			t->Refs[t->Depth++] = &stack[depth];
+			t->Last = t->IR->Length - 1;
+			return 1;
+		case STLOC:
+			IR_Emit(t, IR_STLOC, NULL, t->Refs[depth - 1], IR_Constant(t, operand));
+			t->Depth--;
+			return 1;
+		case NOT:
+			IR_Emit(t, IR_NOT, &stack[depth - 1], t->Refs[depth - 1], NULL);
+			t->Refs[depth - 1] = &stack[depth - 1];
+			t->Last = t->IR->Length - 1;
+			return 1;
+		case JMP:
+			if (!IR_IsConstant(t, t->Refs[depth - 1]))
+			{
+				IR_EmitExit(t, offset);
+				return 0;
+			}
+
+			t->Depth--;
+			IR_EmitBranch(t, IR_JMP, next + *t->Refs[depth - 1], NULL, NULL);
+			return 0;
+		case JIF:
+		{
+			if (!IR_IsConstant(t, t->Refs[depth - 1]))
+			{
+				IR_EmitExit(t, offset);
+				return 0;
+			}
+
+			UINTN target = next + *t->Refs[depth - 1];
+			IRInstruction* last = t->Last >= 0 ? &t->IR->Code[t->Last] : NULL;
+			t->Depth -= 2;
+
+			//A comparison feeding the branch is folded into it.
+			if (last != NULL && last->Op >= IR_EQU && last->Op <= IR_LES && last->Dest == &stack[depth - 2] && t->Refs[depth - 2] == &stack[depth - 2])
+			{
+				IRInstruction compare = *last;
+				t->IR->Length--;
+				t->Retired += compare.Retired;
+				IR_EmitBranch(t, (UINT8)(compare.Op - IR_EQU + IR_JEQU), target, compare.A, compare.B);
+			}
+			else
+			{
+				IR_EmitBranch(t, IR_JIF, target, t->Refs[depth - 2], NULL);
+			}
+
+			return 1;
+		}
+	}
+
+	UINT8 operation = IR_Operation(op);
+	if (operation == IR_NOP)
+	{
+		IR_EmitExit(t, offset);
+		return 0;
+	}
+
+	t->Depth--;
+	IR_Emit(t, operation, &stack[depth - 2], t->Refs[depth - 2], t->Refs[depth - 1]);
+	t->Refs[depth - 2] = &stack[depth - 2];
+	t->Last = t->IR->Length - 1;
+	return 1;
+}
+
+//Translate a verified basic block, the registers below its entry depth already hold the stack.
+void IR_TranslateBlock(IRTranslator* t, VMBlock* block)
+{
+	VMVerification* info = &t->VM->Verification;
+	UINT64* stack = t->IR->Stack;
+	int open = 1;
+
+	t->Depth = block->EntryDepth;
+	t->Retired = 0;
+	t->Last = -1;
+
+	for (UINTN i = 0; i < t->Depth; i++)
+	{
+		t->Refs[i] = &stack[i];
+	}
+
+	for (UINTN i = block->Start; i < block->Start + block->Length && open && !EFI_ERROR(t->Status); i++)
+	{
+		if (info->Flags[i] & VM_CODE_INSTRUCTION) open = IR_TranslateInstruction(t, i);
+	}
+
+	//Falling through into the next block.
+	if (open)
+	{
+		IR_Flush(t, t->Depth);
+		if (t->Retired > 0) IR_Emit(t, IR_NOP, NULL, NULL, NULL);
+	}
+}
+
+//Translate the verified code of a VM into register IR, which IR_Run executes in place of the stack interpreter.
+EFI_STATUS IR_Translate(VM* vm)
+{
+	VMVerification* info = &vm->Verification;
+
+	if (info->Status != Verified) return EFI_UNSUPPORTED;
+	if (vm->IR.Code != NULL) return EFI_SUCCESS;
+
+	UINTN instructions = 0;
+	for (UINTN i = 0; i < info->CodeLength; i++)
+	{
+		if (info->Flags[i] & VM_CODE_INSTRUCTION) instructions++;
+	}
+
+	IRTranslator t;
+	t.VM = vm;
+	t.IR = &vm->IR;
+	t.Refs = (UINT64**)malloc((info->MaxStack + 1) * sizeof(UINT64*)).Start;
+	t.ConstantCount = 0;
+	t.Status = EFI_SUCCESS;
+
+	vm->IR.Capacity = instructions + info->BlockCount;
+	vm->IR.Code = (IRInstruction*)malloc(vm->IR.Capacity * sizeof(IRInstruction)).Start;
+	vm->IR.Blocks = (UINT32*)malloc(info->BlockCount * sizeof(UINT32)).Start;
+	vm->IR.Constants = (UINT64*)malloc(instructions * sizeof(UINT64)).Start;
+	vm->IR.Stack = vm->Stack;
+
+	if (t.Refs == NULL || vm->IR.Code == NULL || vm->IR.Blocks == NULL || vm->IR.Constants == NULL) t.Status = EFI_OUT_OF_RESOURCES;
+
+	for (UINTN i = 0; i < info->BlockCount && !EFI_ERROR(t.Status); i++)
+	{
+		vm->IR.Blocks[i] = (UINT32)vm->IR.Length;
+		IR_TranslateBlock(&t, &info->Blocks[i]);
+	}
+
+	//Branches were emitted with the index of their target block.
+	for (UINTN i = 0; i < vm->IR.Length && !EFI_ERROR(t.Status); i++)
+	{
+		IRInstruction* ins = &vm->IR.Code[i];
+		if ((ins->Op >= IR_JMP && ins->Op <= IR_JLES) || ins->Op == IR_CALL) ins->Target = vm->IR.Blocks[ins->Target];
+	}
+
+	if (t.Refs != NULL) freeany(t.Refs);
+
+	if (EFI_ERROR(t.Status)) VM_ClearIR(vm);
+
+	return t.Status;
+}
+
+//Runs IR from the specified instruction until it exits, or until a taken branch finds the budget used up.
+//Returns 1 if it stopped at an instruction that has to be run by the stack interpreter.
+int IR_Execute(VM* vm, IRInstruction* ins, UINTN budget, UINTN* retired)
+{
+	IRInstruction* code = vm->IR.Code;
+	UINTN done = 0;
+	int interpret = 0;
+	UINT64 operand;
+	UINT64 value;
+	UINT64 lanes;
+	UINT8* address;
+	INTN block;
+
+#define IR_LEAVE() { vm->Current = vm->Start + ins->Offset; vm->StackTop = ins->Depth; goto ir_exit; }
+#define IR_NEXT() { done += ins->Retired; ins++; IR_DISPATCH(); }
+#define IR_BRANCH() { done += ins->Retired; if (done >= budget) IR_LEAVE(); ins = code + ins->Target; IR_DISPATCH(); }
+#define IR_BINARY(expr) { value = *ins->A; operand = *ins->B; *ins->Dest = (expr); IR_NEXT(); }
+#define IR_COMPARE_BRANCH(expr) { value = *ins->A; operand = *ins->B; if (expr) IR_BRANCH(); IR_NEXT(); }
+//Leaves before an indexed access out of range, without retiring it.
+#define IR_INDEX(base) { value = *ins->A; if (value >= vm->VarCount - (UINTN)((base) - vm->Variables)) { done += ins->Retired - 1; interpret = 1; IR_LEAVE(); } }
+
+#if VM_THREADED_DISPATCH
+	static void* const dispatch[] =
+	{
+		[IR_NOP] = &&ir_op_NOP, [IR_MOV] = &&ir_op_MOV,
+		[IR_ADD] = &&ir_op_ADD, [IR_SUB] = &&ir_op_SUB, [IR_MUL] = &&ir_op_MUL, [IR_IMUL] = &&ir_op_IMUL,
+		[IR_DIV] = &&ir_op_DIV, [IR_IDIV] = &&ir_op_IDIV, [IR_MOD] = &&ir_op_MOD, [IR_IMOD] = &&ir_op_IMOD,
+		[IR_AND] = &&ir_op_AND, [IR_OR] = &&ir_op_OR, [IR_XOR] = &&ir_op_XOR, [IR_SHL] = &&ir_op_SHL, [IR_SHR] = &&ir_op_SHR, [IR_NOT] = &&ir_op_NOT,
+		[IR_EQU] = &&ir_op_EQU, [IR_NEQ] = &&ir_op_NEQ, [IR_ABV] = &&ir_op_ABV, [IR_BEL] = &&ir_op_BEL, [IR_GTR] = &&ir_op_GTR, [IR_LES] = &&ir_op_LES,
+		[IR_JMP] = &&ir_op_JMP, [IR_JIF] = &&ir_op_JIF,
+		[IR_JEQU] = &&ir_op_JEQU, [IR_JNEQ] = &&ir_op_JNEQ, [IR_JABV] = &&ir_op_JABV, [IR_JBEL] = &&ir_op_JBEL, [IR_JGTR] = &&ir_op_JGTR, [IR_JLES] = &&ir_op_JLES,
+		[IR_LDIDX] = &&ir_op_LDIDX, [IR_STIDX] = &&ir_op_STIDX, [IR_LANES] = &&ir_op_LANES,
+		[IR_CALL] = &&ir_op_CALL, [IR_RET] = &&ir_op_RET, [IR_ENTER] = &&ir_op_ENTER, [IR_LDLOC] = &&ir_op_LDLOC, [IR_STLOC] = &&ir_op_STLOC,
+		[IR_EXIT] = &&ir_op_EXIT
+	};
+
+#define IR_CASE(name) ir_op_##name
+#define IR_DISPATCH() goto *dispatch[ins->Op]
+
+	IR_DISPATCH();
+#else
+#define IR_CASE(name) case IR_##name
+#define IR_DISPATCH() goto ir_fetch
+
+ir_fetch:
+	switch (ins->Op)
+#endif
+	{
+		IR_CASE(NOP):
+			IR_NEXT();
+		IR_CASE(MOV):
+			*ins->Dest = *ins->A;
+			IR_NEXT();
+		IR_CASE(ADD):
+			IR_BINARY(value + operand);
+		IR_CASE(SUB):
+			IR_BINARY(value - operand);
+		IR_CASE(MUL):
+			IR_BINARY(value * operand);
+		IR_CASE(IMUL):
+			IR_BINARY((INT64)value * (INT64)operand);
+		IR_CASE(DIV):
+			IR_BINARY(value / operand);
+		IR_CASE(IDIV):
+			IR_BINARY((INT64)value / (INT64)operand);
+		IR_CASE(MOD):
+			IR_BINARY(value % operand);
+		IR_CASE(IMOD):
+			IR_BINARY((INT64)value % (INT64)operand);
+		IR_CASE(AND):
+			IR_BINARY(value & operand);
+		IR_CASE(OR):
+			IR_BINARY(value | operand);
+		IR_CASE(XOR):
+			IR_BINARY(value ^ operand);
+		IR_CASE(SHL):
+			IR_BINARY(value << (operand & 63));
+		IR_CASE(SHR):
+			IR_BINARY(value >> (operand & 63));
+		IR_CASE(NOT):
+			*ins->Dest = ~*ins->A;
+			IR_NEXT();
+		IR_CASE(EQU):
+			IR_BINARY(value == operand);
+		IR_CASE(NEQ):
+			IR_BINARY(value != operand);
+		IR_CASE(ABV):
+			IR_BINARY(value > operand);
+		IR_CASE(BEL):
+			IR_BINARY(value < operand);
+		IR_CASE(GTR):
+			IR_BINARY((INT64)value > (INT64)operand);
+		IR_CASE(LES):
+			IR_BINARY((INT64)value < (INT64)operand);
+		IR_CASE(JMP):
+			IR_BRANCH();
+		IR_CASE(JIF):
+			if (*ins->A) IR_BRANCH();
+			IR_NEXT();
+		IR_CASE(JEQU):
+			IR_COMPARE_BRANCH(value == operand);
+		IR_CASE(JNEQ):
+			IR_COMPARE_BRANCH(value != operand);
+		IR_CASE(JABV):
+			IR_COMPARE_BRANCH(value > operand);
+		IR_CASE(JBEL):
+			IR_COMPARE_BRANCH(value < operand);
+		IR_CASE(JGTR):
+			IR_COMPARE_BRANCH((INT64)value > (INT64)operand);
+		IR_CASE(JLES):
+			IR_COMPARE_BRANCH((INT64)value < (INT64)operand);
+		IR_CASE(LDIDX):
+			IR_INDEX(ins->B);
+			*ins->Dest = ins->B[value];
+			IR_NEXT();
+		IR_CASE(STIDX):
+			IR_INDEX(ins->Dest);
+			ins->Dest[value] = *ins->B;
+			IR_NEXT();
+		//The opcode is in the low byte of Target and the number of lanes above it, Dest, A and B are the
+		//variable indices of the destination and the operands.
+		IR_CASE(LANES):
+			value = *ins->Dest;
+			operand = *ins->A;
+			lanes = ins->Target >> 8;
+
+			if (lanes > vm->VarCount || value > vm->VarCount - lanes || operand > vm->VarCount - lanes || *ins->B > vm->VarCount - lanes)
+			{
+				vm->IR.Stack[ins->Depth - 3] = value;
+				vm->IR.Stack[ins->Depth - 2] = operand;
+				vm->IR.Stack[ins->Depth - 1] = *ins->B;
+				done += ins->Retired - 1;
+				interpret = 1;
+				IR_LEAVE();
+			}
+
+			VM_LaneOperation((UINT8)ins->Target, &vm->Variables[value], &vm->Variables[operand], &vm->Variables[*ins->B], lanes);
+			IR_NEXT();
+		//A is the offset of the function and B the offset to return to, a full return stack leaves before the
+		//call with the offset back on the stack.
+		IR_CASE(CALL):
+			if (!VM_PushCall(vm, vm->Start + *ins->B))
+			{
+				vm->IR.Stack[ins->Depth] = *ins->A;
+				vm->Current = vm->Start + *ins->B - 1;
+				vm->StackTop = ins->Depth + 1;
+				done += ins->Retired - 1;
+				interpret = 1;
+				goto ir_exit;
+			}
+
+			IR_BRANCH();
+		//Every return address was pushed by a verified call and starts a block, which is looked up here.
+		IR_CASE(RET):
+			address = VM_PopCall(vm);
+
+			if (address == NULL)
+			{
+				done += ins->Retired - 1;
+				interpret = 1;
+				IR_LEAVE();
+			}
+
+			done += ins->Retired;
+			block = VM_FindBlock(&vm->Verification, address - vm->Start);
+
+			if (done >= budget || block < 0)
+			{
+				vm->Current = address;
+				vm->StackTop = ins->Depth;
+				interpret = block < 0;
+				goto ir_exit;
+			}
+
+			ins = code + vm->IR.Blocks[block];
+			IR_DISPATCH();
+		IR_CASE(ENTER):
+			if (!VM_Enter(vm, *ins->A))
+			{
+				done += ins->Retired - 1;
+				interpret = 1;
+				IR_LEAVE();
+			}
+
+			IR_NEXT();
+		IR_CASE(LDLOC):
+			*ins->Dest = vm->Locals[vm->FrameStart + *ins->A];
+			IR_NEXT();
+		IR_CASE(STLOC):
+			vm->Locals[vm->FrameStart + *ins->B] = *ins->A;
+			IR_NEXT();
+		IR_CASE(EXIT):
+			done += ins->Retired;
+			interpret = 1;
+			IR_LEAVE();
+	}
+
+ir_exit:
+	*retired = done;
+	return interpret;
+
+#undef IR_LEAVE
+#undef IR_NEXT
+#undef IR_BRANCH
+#undef IR_BINARY
+#undef IR_COMPARE_BRANCH
+#undef IR_INDEX
+#undef IR_CASE
+#undef IR_DISPATCH
+}
+
+//Executes up to the specified number of instructions like VM_Run, running translated blocks as IR.
+//Inside the IR the budget is only checked on taken branches, so a slice ends at a branch.
+VMRunReason IR_Run(VM* vm, UINTN maxInstructions, UINTN* retired)
+{
+	UINTN total = 0;
+	VMRunReason reason = Exhausted;
+
+	while (total < maxInstructions)
+	{
+		INTN block = -1;
+		UINTN step;
+
+		//The registers are entries of the stack the IR was translated against.
+		if (vm->IR.Code != NULL && vm->Stack == vm->IR.Stack) block = VM_FindBlock(&vm->Verification, vm->Current - vm->Start);
+
+		if (block >= 0)
+		{
+			int interpret = IR_Execute(vm, &vm->IR.Code[vm->IR.Blocks[block]], maxInstructions - total, &step);
+			total += step;
+
+			if (!interpret || total >= maxInstructions) break;
+		}
+
+		reason = VM_Run(vm, 1, &step);
+		total += step;
+
+		if (reason != Exhausted) break;
+	}
+
+	if (retired != NULL) *retired = total;
+
+	return reason;
+}
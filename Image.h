@@ -0,0 +1,255 @@
+#pragma once
+#include "VM.h"
+
+//Versioned image format read by VMIL_Load: a header, a table of sections and the data of the sections.
+//The code section holds the program from its entry point on. The variables section only declares how many
+//bytes of variables come in front of the code, they are zero-filled instead of read, and data sections copy
+//their bytes over the variables starting at Target. Symbols are for tools and are never read by the loader.
+//The checksum is the CRC32C of the header with the checksum as 0, of the section table and of the data of
+//every section the loader reads, so a damaged image is rejected before it runs.
+
+//"LUCIDVM" followed by a zero byte.
+#define VM_IMAGE_MAGIC 0x004D56444943554C
+#define VM_IMAGE_VERSION 1
+
+//The code is in the compact encoding.
+#define VM_IMAGE_COMPACT 0x00000001
+
+//Most sections an image may have.
+#define VM_IMAGE_SECTIONS 16
+
+typedef enum
+{
+	CodeSection = 1,
+	DataSection = 2,
+	VariablesSection = 3,
+	SymbolsSection = 4
+} VMSectionType;
+
+//MaxStack is the deepest stack the program declares it uses, 0 if it does not declare one.
+typedef struct
+{
+	UINT64 Magic;
+	UINT32 Version;
+	UINT32 Flags;
+	UINT32 Checksum;
+	UINT32 SectionCount;
+	UINT64 Error;
+	UINT64 MaxStack;
+} VMImageHeader;
+
+//Offset is the position of the data of the section in the file, which a variables section has none of.
+typedef struct
+{
+	UINT32 Type;
+	UINT32 Reserved;
+	UINT64 Offset;
+	UINT64 Size;
+	UINT64 Target;
+} VMImageSection;
+
+//Table of the CRC32C polynomial, built on first use.
+UINT32 VMImage_CrcTable[256];
+int VMImage_CrcReady = 0;
+
+//Continue a CRC32C over the specified bytes, a new checksum starts from 0.
+UINT32 VMImage_Crc(UINT32 crc, void* data, UINTN length)
+{
+	if (!VMImage_CrcReady)
+	{
+		for (UINT32 i = 0; i < 256; i++)
+		{
+			UINT32 value = i;
+
+			for (int bit = 0; bit < 8; bit++)
+			{
+				value = (value & 1) ? (value >> 1) ^ 0x82F63B78 : value >> 1;
+			}
+
+			VMImage_CrcTable[i] = value;
+		}
+
+		VMImage_CrcReady = 1;
+	}
+
+	crc = ~crc;
+
+	for (UINTN i = 0; i < length; i++)
+	{
+		crc = VMImage_CrcTable[(crc ^ ((UINT8*)data)[i]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+//Read exactly the specified number of bytes at a position of a file.
+EFI_STATUS VMImage_Read(EFI_FILE* source, UINT64 position, UINTN length, void* buffer)
+{
+	EFI_STATUS status = source->SetPosition(source, position);
+	if (EFI_ERROR(status)) return status;
+
+	UINTN size = length;
+	status = source->Read(source, &size, buffer);
+	if (EFI_ERROR(status)) return status;
+
+	return size == length ? EFI_SUCCESS : EFI_END_OF_FILE;
+}
+
+//Write exactly the specified number of bytes at the current position of a file.
+EFI_STATUS VMImage_Write(EFI_FILE* file, UINTN length, void* buffer)
+{
+	UINTN size = length;
+	EFI_STATUS status = file->Write(file, &size, buffer);
+	if (EFI_ERROR(status)) return status;
+
+	return size == length ? EFI_SUCCESS : EFI_VOLUME_FULL;
+}
+
+//Load a VM from an image. The header and section table are checked before any memory is allocated,
+//then the code and data sections are read straight into the memory of the VM.
+EFI_STATUS VMImage_Load(EFI_FILE* source, UINTN id, VM* result)
+{
+	VMImageHeader header;
+	VMImageSection sections[VM_IMAGE_SECTIONS];
+
+	EFI_STATUS status = VMImage_Read(source, 0, sizeof(header), &header);
+	if (EFI_ERROR(status)) return status;
+
+	if (header.Magic != VM_IMAGE_MAGIC) return EFI_LOAD_ERROR;
+	if (header.Version != VM_IMAGE_VERSION || (header.Flags & ~VM_IMAGE_COMPACT) != 0) return EFI_INCOMPATIBLE_VERSION;
+	if (header.SectionCount == 0 || header.SectionCount > VM_IMAGE_SECTIONS) return EFI_LOAD_ERROR;
+
+	status = VMImage_Read(source, sizeof(header), header.SectionCount * sizeof(VMImageSection), sections);
+	if (EFI_ERROR(status)) return status;
+
+	UINT32 expected = header.Checksum;
+	header.Checksum = 0;
+
+	UINT32 crc = VMImage_Crc(0, &header, sizeof(header));
+	crc = VMImage_Crc(crc, sections, header.SectionCount * sizeof(VMImageSection));
+
+	VMImageSection* code = NULL;
+	UINT64 variables = 0;
+
+	for (UINT32 i = 0; i < header.SectionCount; i++)
+	{
+		VMImageSection* section = &sections[i];
+
+		if (section->Type == CodeSection && code == NULL) code = section;
+		else if (section->Type == VariablesSection && variables == 0) variables = section->Size;
+		else if (section->Type != DataSection && section->Type != SymbolsSection) return EFI_LOAD_ERROR;
+
+		if (section->Type != VariablesSection && section->Offset + section->Size < section->Offset) return EFI_LOAD_ERROR;
+	}
+
+	if (code == NULL || code->Size == 0 || header.Error >= code->Size) return EFI_LOAD_ERROR;
+	if ((variables % sizeof(UINT64)) != 0 || variables + code->Size < variables) return EFI_LOAD_ERROR;
+
+	for (UINT32 i = 0; i < header.SectionCount; i++)
+	{
+		if (sections[i].Type == DataSection && (sections[i].Target > variables || sections[i].Size > variables - sections[i].Target)) return EFI_LOAD_ERROR;
+	}
+
+	MemBlock mem = malloc(variables + code->Size);
+	if (mem.Start == NULL) return EFI_OUT_OF_RESOURCES;
+
+	fillmem(mem.Start, 0, variables);
+
+	//Sections are read in the order of the table, which is the order the checksum covers them in.
+	for (UINT32 i = 0; i < header.SectionCount && !EFI_ERROR(status); i++)
+	{
+		VMImageSection* section = &sections[i];
+		UINT8* target;
+
+		if (section->Type == CodeSection) target = (UINT8*)mem.Start + variables;
+		else if (section->Type == DataSection) target = (UINT8*)mem.Start + section->Target;
+		else continue;
+
+		status = VMImage_Read(source, section->Offset, (UINTN)section->Size, target);
+		if (!EFI_ERROR(status)) crc = VMImage_Crc(crc, target, (UINTN)section->Size);
+	}
+
+	if (!EFI_ERROR(status) && crc != expected) status = EFI_CRC_ERROR;
+
+	if (EFI_ERROR(status))
+	{
+		free(&mem);
+		return status;
+	}
+
+	UINT8* entry = (UINT8*)mem.Start + variables;
+
+	*result = New_VM(mem, id, 1, (UINT64*)mem.Start, variables / sizeof(UINT64), entry, entry + header.Error);
+	result->Encoding = (header.Flags & VM_IMAGE_COMPACT) ? CompactEncoding : WideEncoding;
+
+	if (header.MaxStack != 0) VM_SetStackLimit(result, header.MaxStack);
+
+	return EFI_SUCCESS;
+}
+
+//Save a VM that has not run yet as an image, declaring the specified stack depth. Variables that are not
+//zero are saved in a data section, the code is saved from the entry point to the end of the memory of the VM.
+//Superinstructions never appear in an image, so the VM must not have been fused.
+EFI_STATUS VMImage_Save(EFI_FILE* file, VM* vm, UINT64 maxStack)
+{
+	VMImageHeader header;
+	VMImageSection sections[3];
+	UINT32 count = 0;
+	UINTN first = 0;
+	UINTN last = vm->VarCount;
+
+	while (first < vm->VarCount && vm->Variables[first] == 0) first++;
+	while (last > first && vm->Variables[last - 1] == 0) last--;
+
+	UINT8* memStart = (UINT8*)VM_CodeMemory(vm)->Start;
+	UINT64 codeSize = memStart + VM_CodeMemory(vm)->Size - vm->Start;
+	UINT64 offset = sizeof(header) + ((vm->VarCount > 0) + (last > first) + 1) * sizeof(VMImageSection);
+
+	if (vm->VarCount > 0)
+	{
+		sections[count].Type = VariablesSection;
+		sections[count].Reserved = 0;
+		sections[count].Offset = 0;
+		sections[count].Size = vm->VarCount * sizeof(UINT64);
+		sections[count].Target = 0;
+		count++;
+	}
+
+	if (last > first)
+	{
+		sections[count].Type = DataSection;
+		sections[count].Reserved = 0;
+		sections[count].Offset = offset;
+		sections[count].Size = (last - first) * sizeof(UINT64);
+		sections[count].Target = first * sizeof(UINT64);
+		offset += sections[count].Size;
+		count++;
+	}
+
+	sections[count].Type = CodeSection;
+	sections[count].Reserved = 0;
+	sections[count].Offset = offset;
+	sections[count].Size = codeSize;
+	sections[count].Target = 0;
+	count++;
+
+	header.Magic = VM_IMAGE_MAGIC;
+	header.Version = VM_IMAGE_VERSION;
+	header.Flags = vm->Encoding == CompactEncoding ? VM_IMAGE_COMPACT : 0;
+	header.Checksum = 0;
+	header.SectionCount = count;
+	header.Error = vm->Error - vm->Start;
+	header.MaxStack = maxStack;
+
+	UINT32 crc = VMImage_Crc(0, &header, sizeof(header));
+	crc = VMImage_Crc(crc, sections, count * sizeof(VMImageSection));
+	if (last > first) crc = VMImage_Crc(crc, &vm->Variables[first], (last - first) * sizeof(UINT64));
+	header.Checksum = VMImage_Crc(crc, vm->Start, (UINTN)codeSize);
+
+	EFI_STATUS status = VMImage_Write(file, sizeof(header), &header);
+	if (!EFI_ERROR(status)) status = VMImage_Write(file, count * sizeof(VMImageSection), sections);
+	if (!EFI_ERROR(status) && last > first) status = VMImage_Write(file, (last - first) * sizeof(UINT64), &vm->Variables[first]);
+	if (!EFI_ERROR(status)) status = VMImage_Write(file, (UINTN)codeSize, vm->Start);
+
+	return status;
+}
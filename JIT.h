@@ -0,0 +1,920 @@
+#pragma once
+#include "Verifier.h"
+#include "Emitter.h"
+
+//Baseline x86-64 compiler for verified VMIL programs.
+//Every basic block is translated to native code that keeps operand stack slot n at Stack[n] and caches
+//the top of the stack in rax, so the stack pointer itself never exists at run time. HLT, BRK and any
+//instruction the compiler does not handle leave native code and are run by the interpreter.
+//A CALL updates the return stack of the VM and also makes a native call, and a RET whose call was made
+//by the same native run returns natively. Leaving native code drops the native calls, a RET that has
+//none left is run by the interpreter, which then reenters at the block after the call.
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#if defined(__GNUC__)
+#define JIT_ABI __attribute__((ms_abi))
+#else
+#define JIT_ABI
+#endif
+
+//Native code stops at an instruction it cannot run, leaving it to the interpreter.
+#define JIT_INTERPRET	0
+//Native code used up its budget of backward branches.
+#define JIT_BUDGET		1
+
+//Register block shared with native code, the generated code depends on this exact layout.
+typedef struct
+{
+	UINT64* Variables;
+	UINT64* Stack;
+	UINT64 Budget;
+	UINT64 Exit;
+	UINT64 Depth;
+	VM* Owner;
+	UINT64 StackPointer;
+} JitContext;
+
+typedef UINT64 (JIT_ABI *JitEntry)(JitContext* context, void* entry);
+
+//Pending rel32 displacement to a block that has not been emitted yet.
+typedef struct
+{
+	UINT32 At;
+	UINT32 Target;
+} JitPatch;
+
+//State of a single compilation.
+typedef struct
+{
+	VM* VM;
+	Emitter Emit;
+	UINT32* Labels;
+	JitPatch* Patches;
+	UINTN PatchCount;
+	INTN Cached;
+	UINTN Epilogue;
+} JitCompiler;
+
+#define JIT_RAX 0
+#define JIT_RCX 1
+#define JIT_RDX 2
+
+#define JIT_NO_LABEL 0xFFFFFFFF
+
+//Emit mov reg, [rsi + 8 * slot].
+void JIT_EmitLoadSlot(JitCompiler* jit, UINT8 reg, UINTN slot)
+{
+	UINT8 code[3] = { 0x48, 0x8B, (UINT8)(0x86 | (reg << 3)) };
+	Emitter_EmitBytes(&jit->Emit, code, 3);
+	Emitter_EmitUInt32(&jit->Emit, (UINT32)(slot * 8));
+}
+
+//Emit mov [rsi + 8 * slot], rax.
+void JIT_EmitStoreSlot(JitCompiler* jit, UINTN slot)
+{
+	UINT8 code[3] = { 0x48, 0x89, 0x86 };
+	Emitter_EmitBytes(&jit->Emit, code, 3);
+	Emitter_EmitUInt32(&jit->Emit, (UINT32)(slot * 8));
+}
+
+//Emit an instruction with a [rbx + 8 * index] operand, used for variable access.
+void JIT_EmitVariable(JitCompiler* jit, UINT8 opcode, UINT64 index)
+{
+	UINT8 code[3] = { 0x48, opcode, 0x83 };
+	Emitter_EmitBytes(&jit->Emit, code, 3);
+	Emitter_EmitUInt32(&jit->Emit, (UINT32)(index * 8));
+}
+
+//Emit mov rdx, [rdi + 0x28], the VM running the native code.
+void JIT_EmitLoadVM(JitCompiler* jit)
+{
+	UINT8 code[4] = { 0x48, 0x8B, 0x57, 0x28 };
+	Emitter_EmitBytes(&jit->Emit, code, 4);
+}
+
+//Emit an instruction with a [rdx + displacement] operand addressing the specified field of the VM.
+void JIT_EmitField(JitCompiler* jit, UINT8 opcode, UINT8 reg, void* field)
+{
+	UINT8 code[3] = { 0x48, opcode, (UINT8)(0x82 | (reg << 3)) };
+	Emitter_EmitBytes(&jit->Emit, code, 3);
+	Emitter_EmitUInt32(&jit->Emit, (UINT32)((UINT8*)field - (UINT8*)jit->VM));
+}
+
+//Emit mov rax, value using the shortest encoding.
+void JIT_EmitLoadConstant(JitCompiler* jit, UINT64 value)
+{
+	if (value <= 0xFFFFFFFF)
+	{
+		Emitter_EmitByte(&jit->Emit, 0xB8);
+		Emitter_EmitUInt32(&jit->Emit, (UINT32)value);
+	}
+	else if ((INT64)value >= -0x80000000LL && (INT64)value < 0)
+	{
+		UINT8 code[3] = { 0x48, 0xC7, 0xC0 };
+		Emitter_EmitBytes(&jit->Emit, code, 3);
+		Emitter_EmitUInt32(&jit->Emit, (UINT32)value);
+	}
+	else
+	{
+		UINT8 code[2] = { 0x48, 0xB8 };
+		Emitter_EmitBytes(&jit->Emit, code, 2);
+		Emitter_EmitUInt64(&jit->Emit, value);
+	}
+}
+
+//Write the cached top of the stack back to its slot.
+void JIT_Flush(JitCompiler* jit)
+{
+	if (jit->Cached >= 0)
+	{
+		JIT_EmitStoreSlot(jit, (UINTN)jit->Cached);
+		jit->Cached = -1;
+	}
+}
+
+//Make sure the top of the stack is in rax.
+void JIT_LoadTop(JitCompiler* jit, UINTN depth)
+{
+	if (jit->Cached != (INTN)depth - 1)
+	{
+		JIT_Flush(jit);
+		JIT_EmitLoadSlot(jit, JIT_RAX, depth - 1);
+	}
+
+	jit->Cached = -1;
+}
+
+//Emit a jump to the native code of the block at the specified offset.
+void JIT_EmitJump(JitCompiler* jit, UINT8* opcode, UINTN length, UINTN target)
+{
+	Emitter_EmitBytes(&jit->Emit, opcode, length);
+
+	jit->Patches[jit->PatchCount].At = (UINT32)Emitter_Offset(&jit->Emit);
+	jit->Patches[jit->PatchCount].Target = (UINT32)target;
+	jit->PatchCount++;
+
+	Emitter_EmitUInt32(&jit->Emit, 0);
+}
+
+//Emit a return to the caller that resumes at the specified offset with the specified stack depth.
+void JIT_EmitExit(JitCompiler* jit, UINTN offset, UINTN depth, UINT32 reason)
+{
+	UINT8 exit[4] = { 0x48, 0xC7, 0x47, 0x18 };
+	UINT8 stack[4] = { 0x48, 0xC7, 0x47, 0x20 };
+
+	Emitter_EmitBytes(&jit->Emit, exit, 4);
+	Emitter_EmitUInt32(&jit->Emit, (UINT32)offset);
+	Emitter_EmitBytes(&jit->Emit, stack, 4);
+	Emitter_EmitUInt32(&jit->Emit, (UINT32)depth);
+	Emitter_EmitByte(&jit->Emit, 0xB8);
+	Emitter_EmitUInt32(&jit->Emit, reason);
+	Emitter_EmitRelativeJump(&jit->Emit, jit->Epilogue);
+}
+
+//Emit a branch to a block, taken when the condition code is met (or always, when the condition is 0).
+//Backward branches are where loops spend their time, so they also count down the budget and leave
+//native code when it runs out.
+void JIT_EmitBranch(JitCompiler* jit, UINT8 condition, UINTN offset, UINTN target, UINTN depth)
+{
+	UINT8 jump[1] = { 0xE9 };
+	UINT8 jcc[2] = { 0x0F, condition };
+	UINT8 skip[2] = { 0x0F, (UINT8)(condition ^ 1) };
+	UINT8 budget[4] = { 0x49, 0x83, 0xEC, 0x01 };
+	UINT8 jnz[2] = { 0x0F, 0x85 };
+
+	if (target > offset)
+	{
+		if (condition == 0) JIT_EmitJump(jit, jump, 1, target);
+		else JIT_EmitJump(jit, jcc, 2, target);
+		return;
+	}
+
+	UINTN patch = 0;
+
+	if (condition != 0)
+	{
+		Emitter_EmitBytes(&jit->Emit, skip, 2);
+		patch = Emitter_Offset(&jit->Emit);
+		Emitter_EmitUInt32(&jit->Emit, 0);
+	}
+
+	Emitter_EmitBytes(&jit->Emit, budget, 4);
+	JIT_EmitJump(jit, jnz, 2, target);
+	JIT_EmitExit(jit, target, depth, JIT_BUDGET);
+
+	if (condition != 0 && !EFI_ERROR(jit->Emit.Status))
+	{
+		Emitter_PatchRelative32(&jit->Emit, patch, Emitter_Offset(&jit->Emit));
+	}
+}
+
+//Emit a bounds check of the index in a register against the variables after a base variable. An index
+//out of range leaves native code before the instruction, so the interpreter faults on it.
+void JIT_EmitIndexCheck(JitCompiler* jit, UINT8 reg, UINT64 base, UINTN offset, UINTN depth)
+{
+	UINT8 compare[3] = { 0x48, 0x81, (UINT8)(0xF8 | reg) };
+	UINT8 below[2] = { 0x0F, 0x82 };
+
+	Emitter_EmitBytes(&jit->Emit, compare, 3);
+	Emitter_EmitUInt32(&jit->Emit, (UINT32)(jit->VM->VarCount - base));
+	Emitter_EmitBytes(&jit->Emit, below, 2);
+
+	UINTN patch = Emitter_Offset(&jit->Emit);
+	Emitter_EmitUInt32(&jit->Emit, 0);
+
+	JIT_EmitExit(jit, offset, depth, JIT_INTERPRET);
+
+	if (!EFI_ERROR(jit->Emit.Status)) Emitter_PatchRelative32(&jit->Emit, patch, Emitter_Offset(&jit->Emit));
+}
+
+//Get the SSE2 instruction for a lane operation, or 0 if SSE2 has none and the interpreter runs it.
+UINT8 JIT_LaneInstruction(UINT8 op)
+{
+	switch (op)
+	{
+		case VADD: return 0xD4;
+		case VSUB: return 0xFB;
+		case VAND: return 0xDB;
+		case VOR: return 0xEB;
+		case VXOR: return 0xEF;
+	}
+
+	return 0;
+}
+
+//Emit a lane operation on [dest, a, b] with SSE2, every lane is loaded before any is stored.
+//An index out of range leaves native code before the instruction, so the interpreter faults on it.
+void JIT_EmitLanes(JitCompiler* jit, UINT8 instruction, UINT64 lanes, UINTN offset, UINTN depth)
+{
+	UINT8 registers[3] = { JIT_RAX, JIT_RCX, JIT_RDX };
+	UINT8 aboveOrEqual[2] = { 0x0F, 0x83 };
+	UINTN patches[3];
+
+	JIT_Flush(jit);
+
+	for (UINTN i = 0; i < 3; i++)
+	{
+		JIT_EmitLoadSlot(jit, registers[i], depth - 3 + i);
+	}
+
+	for (UINTN i = 0; i < 3; i++)
+	{
+		//cmp reg, VarCount - lanes + 1; jae exit
+		UINT8 compare[3] = { 0x48, 0x81, (UINT8)(0xF8 | registers[i]) };
+		Emitter_EmitBytes(&jit->Emit, compare, 3);
+		Emitter_EmitUInt32(&jit->Emit, (UINT32)(jit->VM->VarCount - lanes + 1));
+		Emitter_EmitBytes(&jit->Emit, aboveOrEqual, 2);
+		patches[i] = Emitter_Offset(&jit->Emit);
+		Emitter_EmitUInt32(&jit->Emit, 0);
+	}
+
+	for (UINTN half = 0; half < lanes / 2; half++)
+	{
+		//movdqu xmm(2 * half), [rbx + 8 * rcx + 16 * half]; movdqu xmm(2 * half + 1), [rbx + 8 * rdx + 16 * half]
+		UINT8 first[6] = { 0xF3, 0x0F, 0x6F, (UINT8)(0x44 | ((half * 2) << 3)), 0xCB, (UINT8)(half * 16) };
+		UINT8 second[6] = { 0xF3, 0x0F, 0x6F, (UINT8)(0x44 | ((half * 2 + 1) << 3)), 0xD3, (UINT8)(half * 16) };
+		Emitter_EmitBytes(&jit->Emit, first, 6);
+		Emitter_EmitBytes(&jit->Emit, second, 6);
+	}
+
+	for (UINTN half = 0; half < lanes / 2; half++)
+	{
+		//op xmm(2 * half), xmm(2 * half + 1); movdqu [rbx + 8 * rax + 16 * half], xmm(2 * half)
+		UINT8 operation[4] = { 0x66, 0x0F, instruction, (UINT8)(0xC0 | ((half * 2) << 3) | (half * 2 + 1)) };
+		UINT8 store[6] = { 0xF3, 0x0F, 0x7F, (UINT8)(0x44 | ((half * 2) << 3)), 0xC3, (UINT8)(half * 16) };
+		Emitter_EmitBytes(&jit->Emit, operation, 4);
+		Emitter_EmitBytes(&jit->Emit, store, 6);
+	}
+
+	//The exit is shared by the three checks and jumped over when they pass.
+	Emitter_EmitByte(&jit->Emit, 0xE9);
+	UINTN skip = Emitter_Offset(&jit->Emit);
+	Emitter_EmitUInt32(&jit->Emit, 0);
+
+	UINTN exit = Emitter_Offset(&jit->Emit);
+	JIT_EmitExit(jit, offset, depth, JIT_INTERPRET);
+
+	if (EFI_ERROR(jit->Emit.Status)) return;
+
+	for (UINTN i = 0; i < 3; i++)
+	{
+		Emitter_PatchRelative32(&jit->Emit, patches[i], exit);
+	}
+
+	Emitter_PatchRelative32(&jit->Emit, skip, Emitter_Offset(&jit->Emit));
+}
+
+//Emit a CALL of the function at the specified offset. The return stack of the VM is pushed like the
+//interpreter does and r13 counts the native calls. Calls also count down the budget, as recursion loops
+//without any backward branch. A full return stack or budget leaves native code at the PUSH of the offset.
+void JIT_EmitCall(JitCompiler* jit, UINTN offset, UINTN target, UINTN depth)
+{
+	VM* vm = jit->VM;
+	UINT8 test[3] = { 0x48, 0x85, 0xC0 };
+	UINT8 compare[3] = { 0x48, 0x81, 0xF9 };
+	UINT8 budget[4] = { 0x49, 0x83, 0xEC, 0x01 };
+	UINT8 zero[2] = { 0x0F, 0x84 };
+	UINT8 aboveOrEqual[2] = { 0x0F, 0x83 };
+	//shl rcx, 4; add rax, rcx; mov rcx, imm64
+	UINT8 entry[9] = { 0x48, 0xC1, 0xE1, 0x04, 0x48, 0x01, 0xC8, 0x48, 0xB9 };
+	UINT8 storeReturn[3] = { 0x48, 0x89, 0x08 };
+	UINT8 storeFrame[4] = { 0x48, 0x89, 0x48, 0x08 };
+	UINT8 count[3] = { 0x49, 0xFF, 0xC5 };
+	UINT8 call[1] = { 0xE8 };
+	UINTN patches[3];
+
+	JIT_Flush(jit);
+
+	//if (Calls == NULL || CallTop >= VM_CALL_LIMIT) exit
+	JIT_EmitLoadVM(jit);
+	JIT_EmitField(jit, 0x8B, JIT_RAX, &vm->Calls);
+	Emitter_EmitBytes(&jit->Emit, test, 3);
+	Emitter_EmitBytes(&jit->Emit, zero, 2);
+	patches[0] = Emitter_Offset(&jit->Emit);
+	Emitter_EmitUInt32(&jit->Emit, 0);
+	JIT_EmitField(jit, 0x8B, JIT_RCX, &vm->CallTop);
+	Emitter_EmitBytes(&jit->Emit, compare, 3);
+	Emitter_EmitUInt32(&jit->Emit, VM_CALL_LIMIT);
+	Emitter_EmitBytes(&jit->Emit, aboveOrEqual, 2);
+	patches[1] = Emitter_Offset(&jit->Emit);
+	Emitter_EmitUInt32(&jit->Emit, 0);
+	Emitter_EmitBytes(&jit->Emit, budget, 4);
+	Emitter_EmitBytes(&jit->Emit, zero, 2);
+	patches[2] = Emitter_Offset(&jit->Emit);
+	Emitter_EmitUInt32(&jit->Emit, 0);
+
+	//Calls[CallTop] = { return address, FrameStart }; FrameStart = FrameEnd; CallTop++
+	Emitter_EmitBytes(&jit->Emit, entry, 9);
+	Emitter_EmitUInt64(&jit->Emit, (UINT64)(UINTN)(vm->Start + offset + 1));
+	Emitter_EmitBytes(&jit->Emit, storeReturn, 3);
+	JIT_EmitField(jit, 0x8B, JIT_RCX, &vm->FrameStart);
+	Emitter_EmitBytes(&jit->Emit, storeFrame, 4);
+	JIT_EmitField(jit, 0x8B, JIT_RCX, &vm->FrameEnd);
+	JIT_EmitField(jit, 0x89, JIT_RCX, &vm->FrameStart);
+	JIT_EmitField(jit, 0xFF, 0, &vm->CallTop);
+	Emitter_EmitBytes(&jit->Emit, count, 3);
+	JIT_EmitJump(jit, call, 1, target);
+
+	//The native return lands here and jumps over the exits to the block after the call.
+	Emitter_EmitByte(&jit->Emit, 0xE9);
+	UINTN skip = Emitter_Offset(&jit->Emit);
+	Emitter_EmitUInt32(&jit->Emit, 0);
+
+	UINTN full = Emitter_Offset(&jit->Emit);
+	JIT_EmitExit(jit, offset - 9, depth - 1, JIT_INTERPRET);
+	UINTN exhausted = Emitter_Offset(&jit->Emit);
+	JIT_EmitExit(jit, offset - 9, depth - 1, JIT_BUDGET);
+
+	if (EFI_ERROR(jit->Emit.Status)) return;
+
+	Emitter_PatchRelative32(&jit->Emit, patches[0], full);
+	Emitter_PatchRelative32(&jit->Emit, patches[1], full);
+	Emitter_PatchRelative32(&jit->Emit, patches[2], exhausted);
+	Emitter_PatchRelative32(&jit->Emit, skip, Emitter_Offset(&jit->Emit));
+}
+
+//Emit a RET, which pops the return stack of the VM and returns natively if its call was native.
+void JIT_EmitReturn(JitCompiler* jit, UINTN offset, UINTN depth)
+{
+	VM* vm = jit->VM;
+	UINT8 test[3] = { 0x4D, 0x85, 0xED };
+	UINT8 zero[2] = { 0x0F, 0x84 };
+	UINT8 count[3] = { 0x49, 0xFF, 0xCD };
+	UINT8 decrement[3] = { 0x48, 0xFF, 0xC9 };
+	UINT8 shift[4] = { 0x48, 0xC1, 0xE1, 0x04 };
+	UINT8 frame[4] = { 0x48, 0x8B, 0x41, 0x08 };
+
+	JIT_Flush(jit);
+
+	Emitter_EmitBytes(&jit->Emit, test, 3);
+	Emitter_EmitBytes(&jit->Emit, zero, 2);
+	UINTN patch = Emitter_Offset(&jit->Emit);
+	Emitter_EmitUInt32(&jit->Emit, 0);
+
+	//CallTop--; FrameEnd = FrameStart; FrameStart = Calls[CallTop].Frame
+	Emitter_EmitBytes(&jit->Emit, count, 3);
+	JIT_EmitLoadVM(jit);
+	JIT_EmitField(jit, 0x8B, JIT_RCX, &vm->CallTop);
+	Emitter_EmitBytes(&jit->Emit, decrement, 3);
+	JIT_EmitField(jit, 0x89, JIT_RCX, &vm->CallTop);
+	JIT_EmitField(jit, 0x8B, JIT_RAX, &vm->FrameStart);
+	JIT_EmitField(jit, 0x89, JIT_RAX, &vm->FrameEnd);
+	Emitter_EmitBytes(&jit->Emit, shift, 4);
+	JIT_EmitField(jit, 0x03, JIT_RCX, &vm->Calls);
+	Emitter_EmitBytes(&jit->Emit, frame, 4);
+	JIT_EmitField(jit, 0x89, JIT_RAX, &vm->FrameStart);
+	Emitter_EmitByte(&jit->Emit, 0xC3);
+
+	UINTN exit = Emitter_Offset(&jit->Emit);
+	JIT_EmitExit(jit, offset, depth, JIT_INTERPRET);
+
+	if (!EFI_ERROR(jit->Emit.Status)) Emitter_PatchRelative32(&jit->Emit, patch, exit);
+}
+
+//Emit an ENTER of the specified number of zeroed locals. A frame arena that is full or not allocated yet
+//leaves native code before the instruction, so the interpreter runs it.
+void JIT_EmitEnter(JitCompiler* jit, UINT64 locals, UINTN offset, UINTN depth)
+{
+	VM* vm = jit->VM;
+	UINT8 test[3] = { 0x48, 0x85, 0xC0 };
+	UINT8 compare[3] = { 0x48, 0x81, 0xF9 };
+	UINT8 zero[2] = { 0x0F, 0x84 };
+	UINT8 above[2] = { 0x0F, 0x87 };
+	//lea rax, [rax + 8 * rcx]; add rcx, imm32
+	UINT8 frame[7] = { 0x48, 0x8D, 0x04, 0xC8, 0x48, 0x81, 0xC1 };
+	//mov qword [rax], 0; add rax, 8; dec rcx; jnz back to the store
+	UINT8 clear[16] = { 0x48, 0xC7, 0x00, 0x00, 0x00, 0x00, 0x00, 0x48, 0x83, 0xC0, 0x08, 0x48, 0xFF, 0xC9, 0x75, 0xF0 };
+	UINTN patches[2];
+
+	JIT_Flush(jit);
+
+	JIT_EmitLoadVM(jit);
+	JIT_EmitField(jit, 0x8B, JIT_RAX, &vm->Locals);
+	Emitter_EmitBytes(&jit->Emit, test, 3);
+	Emitter_EmitBytes(&jit->Emit, zero, 2);
+	patches[0] = Emitter_Offset(&jit->Emit);
+	Emitter_EmitUInt32(&jit->Emit, 0);
+	JIT_EmitField(jit, 0x8B, JIT_RCX, &vm->FrameEnd);
+	Emitter_EmitBytes(&jit->Emit, compare, 3);
+	Emitter_EmitUInt32(&jit->Emit, (UINT32)(VM_FRAME_LIMIT - locals));
+	Emitter_EmitBytes(&jit->Emit, above, 2);
+	patches[1] = Emitter_Offset(&jit->Emit);
+	Emitter_EmitUInt32(&jit->Emit, 0);
+
+	Emitter_EmitBytes(&jit->Emit, frame, 7);
+	Emitter_EmitUInt32(&jit->Emit, (UINT32)locals);
+	JIT_EmitField(jit, 0x89, JIT_RCX, &vm->FrameEnd);
+
+	if (locals > 0)
+	{
+		//mov ecx, locals
+		Emitter_EmitByte(&jit->Emit, 0xB9);
+		Emitter_EmitUInt32(&jit->Emit, (UINT32)locals);
+		Emitter_EmitBytes(&jit->Emit, clear, 16);
+	}
+
+	Emitter_EmitByte(&jit->Emit, 0xE9);
+	UINTN skip = Emitter_Offset(&jit->Emit);
+	Emitter_EmitUInt32(&jit->Emit, 0);
+
+	UINTN exit = Emitter_Offset(&jit->Emit);
+	JIT_EmitExit(jit, offset, depth, JIT_INTERPRET);
+
+	if (EFI_ERROR(jit->Emit.Status)) return;
+
+	Emitter_PatchRelative32(&jit->Emit, patches[0], exit);
+	Emitter_PatchRelative32(&jit->Emit, patches[1], exit);
+	Emitter_PatchRelative32(&jit->Emit, skip, Emitter_Offset(&jit->Emit));
+}
+
+//Get the constant offset used by a JMP or JIF, which is pushed by the instruction right before it.
+int JIT_JumpOffset(VM* vm, UINTN offset, UINT64* result)
+{
+	VMVerification* info = &vm->Verification;
+
+	if (offset < 9 || (info->Flags[offset] & VM_CODE_LEADER)) return 0;
+	if (!(info->Flags[offset - 9] & VM_CODE_INSTRUCTION) || VM_BaseOpcode(vm->Start[offset - 9]) != PUSH) return 0;
+
+	*result = *((UINT64*)&vm->Start[offset - 8]);
+	return 1;
+}
+
+//Get the condition code that a comparison opcode sets, or 0 for other opcodes.
+UINT8 JIT_Condition(UINT8 op)
+{
+	switch (op)
+	{
+		case EQU: return 0x84;
+		case NEQ: return 0x85;
+		case ABV: return 0x87;
+		case BEL: return 0x82;
+		case GTR: return 0x8F;
+		case LES: return 0x8C;
+	}
+
+	return 0;
+}
+
+//Translate a single instruction, returns the number of code bytes it consumed.
+UINTN JIT_CompileInstruction(JitCompiler* jit, UINTN offset)
+{
+	VM* vm = jit->VM;
+	VMVerification* info = &vm->Verification;
+	UINT8* code = vm->Start;
+	UINT8 op = VM_BaseOpcode(code[offset]);
+	UINTN depth = info->Depths[offset];
+	UINTN size = (op & IMMEDIATE) ? 9 : 1;
+	UINT64 operand = (op & IMMEDIATE) ? *((UINT64*)&code[offset + 1]) : 0;
+	UINT64 jump;
+
+	static UINT8 binary[][4] =
+	{
+		{ ADD, 0x48, 0x01, 0xC8 },
+		{ SUB, 0x48, 0x29, 0xC8 },
+		{ AND, 0x48, 0x21, 0xC8 },
+		{ OR, 0x48, 0x09, 0xC8 },
+		{ XOR, 0x48, 0x31, 0xC8 },
+		{ SHL, 0x48, 0xD3, 0xE0 },
+		{ SHR, 0x48, 0xD3, 0xE8 }
+	};
+
+	switch (op)
+	{
+		case PUSH:
+			//The offset of a PUSH/JMP, PUSH/JIF or PUSH/CALL pair is folded into the branch itself.
+			if (offset + 9 < info->CodeLength && !(info->Flags[offset + 9] & VM_CODE_LEADER) &&
+				(VM_BaseOpcode(code[offset + 9]) == JMP || VM_BaseOpcode(code[offset + 9]) == JIF || VM_BaseOpcode(code[offset + 9]) == CALL))
+			{
+				return size;
+			}
+
+			JIT_Flush(jit);
+			JIT_EmitLoadConstant(jit, operand);
+			jit->Cached = depth;
+			return size;
+		case LDVAR:
+			JIT_Flush(jit);
+			JIT_EmitVariable(jit, 0x8B, operand);
+			jit->Cached = depth;
+			return size;
+		case LDINDVAR:
+			JIT_Flush(jit);
+			JIT_EmitVariable(jit, 0x8D, operand);
+			jit->Cached = depth;
+			return size;
+		case LDSTACK:
+			JIT_Flush(jit);
+			JIT_EmitLoadConstant(jit, depth);
+			jit->Cached = depth;
+			return size;
+		case STVAR:
+			JIT_LoadTop(jit, depth);
+			JIT_EmitVariable(jit, 0x89, operand);
+			return size;
+		case DUP:
+			if (jit->Cached == (INTN)depth - 1)
+			{
+				JIT_EmitStoreSlot(jit, depth - 1);
+			}
+			else
+			{
+				JIT_Flush(jit);
+				JIT_EmitLoadSlot(jit, JIT_RAX, depth - 1);
+			}
+
+			jit->Cached = depth;
+			return size;
+		case POP:
+			if (jit->Cached == (INTN)depth - 1) jit->Cached = -1;
+			return size;
+		case LDIDXVAR:
+			{
+				//mov rax, [rbx + 8 * rax + 8 * base]
+				UINT8 load[4] = { 0x48, 0x8B, 0x84, 0xC3 };
+				int cached = jit->Cached == (INTN)depth - 1;
+
+				//The index stays in its slot for the interpreter if it is out of range.
+				JIT_Flush(jit);
+				if (!cached) JIT_EmitLoadSlot(jit, JIT_RAX, depth - 1);
+				JIT_EmitIndexCheck(jit, JIT_RAX, operand, offset, depth);
+				Emitter_EmitBytes(&jit->Emit, load, 4);
+				Emitter_EmitUInt32(&jit->Emit, (UINT32)(operand * 8));
+				jit->Cached = depth - 1;
+			}
+			return size;
+		case STIDXVAR:
+			{
+				//mov [rbx + 8 * rcx + 8 * base], rax
+				UINT8 store[4] = { 0x48, 0x89, 0x84, 0xCB };
+				int cached = jit->Cached == (INTN)depth - 1;
+
+				JIT_Flush(jit);
+				JIT_EmitLoadSlot(jit, JIT_RCX, depth - 2);
+				JIT_EmitIndexCheck(jit, JIT_RCX, operand, offset, depth);
+				if (!cached) JIT_EmitLoadSlot(jit, JIT_RAX, depth - 1);
+				Emitter_EmitBytes(&jit->Emit, store, 4);
+				Emitter_EmitUInt32(&jit->Emit, (UINT32)(operand * 8));
+			}
+			return size;
+		//Locals are addressed through the frame of the VM as it changes with every call.
+		case LDLOC:
+			{
+				//mov rcx, [rdx + Locals]; mov rax, [rdx + FrameStart]; mov rax, [rcx + 8 * rax + 8 * local]
+				UINT8 load[4] = { 0x48, 0x8B, 0x84, 0xC1 };
+
+				JIT_Flush(jit);
+				JIT_EmitLoadVM(jit);
+				JIT_EmitField(jit, 0x8B, JIT_RCX, &vm->Locals);
+				JIT_EmitField(jit, 0x8B, JIT_RAX, &vm->FrameStart);
+				Emitter_EmitBytes(&jit->Emit, load, 4);
+				Emitter_EmitUInt32(&jit->Emit, (UINT32)(operand * 8));
+				jit->Cached = depth;
+			}
+			return size;
+		case STLOC:
+			{
+				//mov rcx, [rdx + Locals]; mov rdx, [rdx + FrameStart]; mov [rcx + 8 * rdx + 8 * local], rax
+				UINT8 store[4] = { 0x48, 0x89, 0x84, 0xD1 };
+
+				JIT_LoadTop(jit, depth);
+				JIT_EmitLoadVM(jit);
+				JIT_EmitField(jit, 0x8B, JIT_RCX, &vm->Locals);
+				JIT_EmitField(jit, 0x8B, JIT_RDX, &vm->FrameStart);
+				Emitter_EmitBytes(&jit->Emit, store, 4);
+				Emitter_EmitUInt32(&jit->Emit, (UINT32)(operand * 8));
+			}
+			return size;
+		case ENTER:
+			if (operand > VM_FRAME_LIMIT) break;
+
+			JIT_EmitEnter(jit, operand, offset, depth);
+			return size;
+		case CALL:
+			if (!JIT_JumpOffset(vm, offset, &jump)) break;
+
+			JIT_EmitCall(jit, offset, offset + 1 + jump, depth);
+			return size;
+		case RET:
+			JIT_EmitReturn(jit, offset, depth);
+			return size;
+		case NOT:
+			{
+				UINT8 invert[3] = { 0x48, 0xF7, 0xD0 };
+				JIT_LoadTop(jit, depth);
+				Emitter_EmitBytes(&jit->Emit, invert, 3);
+				jit->Cached = depth - 1;
+			}
+			return size;
+		case JMP:
+			if (!JIT_JumpOffset(vm, offset, &jump)) break;
+
+			JIT_Flush(jit);
+			JIT_EmitBranch(jit, 0, offset, offset + 1 + jump, depth - 1);
+			return size;
+		case JIF:
+			if (!JIT_JumpOffset(vm, offset, &jump)) break;
+
+			{
+				UINT8 test[3] = { 0x48, 0x85, 0xC0 };
+				JIT_LoadTop(jit, depth - 1);
+				Emitter_EmitBytes(&jit->Emit, test, 3);
+				JIT_EmitBranch(jit, 0x85, offset, offset + 1 + jump, depth - 2);
+			}
+			return size;
+	}
+
+	if (JIT_LaneInstruction(op) != 0 && operand <= vm->VarCount)
+	{
+		JIT_EmitLanes(jit, JIT_LaneInstruction(op), operand, offset, depth);
+		return size;
+	}
+
+	if (op == ADD || op == SUB || op == MUL || op == IMUL || op == DIV || op == IDIV || op == MOD || op == IMOD ||
+		op == AND || op == OR || op == XOR || op == SHL || op == SHR || JIT_Condition(op) != 0)
+	{
+		UINT8 move[3] = { 0x48, 0x89, 0xC1 };
+
+		if (jit->Cached == (INTN)depth - 1)
+		{
+			Emitter_EmitBytes(&jit->Emit, move, 3);
+		}
+		else
+		{
+			JIT_Flush(jit);
+			JIT_EmitLoadSlot(jit, JIT_RCX, depth - 1);
+		}
+
+		JIT_EmitLoadSlot(jit, JIT_RAX, depth - 2);
+		jit->Cached = depth - 2;
+
+		for (UINTN i = 0; i < sizeof(binary) / sizeof(binary[0]); i++)
+		{
+			if (binary[i][0] == op) Emitter_EmitBytes(&jit->Emit, &binary[i][1], 3);
+		}
+
+		if (op == MUL || op == IMUL)
+		{
+			UINT8 imul[4] = { 0x48, 0x0F, 0xAF, 0xC1 };
+			Emitter_EmitBytes(&jit->Emit, imul, 4);
+		}
+		else if (op == DIV || op == MOD)
+		{
+			UINT8 div[5] = { 0x31, 0xD2, 0x48, 0xF7, 0xF1 };
+			Emitter_EmitBytes(&jit->Emit, div, 5);
+		}
+		else if (op == IDIV || op == IMOD)
+		{
+			UINT8 idiv[5] = { 0x48, 0x99, 0x48, 0xF7, 0xF9 };
+			Emitter_EmitBytes(&jit->Emit, idiv, 5);
+		}
+
+		if (op == MOD || op == IMOD)
+		{
+			UINT8 remainder[3] = { 0x48, 0x89, 0xD0 };
+			Emitter_EmitBytes(&jit->Emit, remainder, 3);
+		}
+
+		UINT8 condition = JIT_Condition(op);
+
+		if (condition != 0)
+		{
+			UINT8 compare[3] = { 0x48, 0x39, 0xC8 };
+			Emitter_EmitBytes(&jit->Emit, compare, 3);
+
+			//A comparison feeding PUSH/JIF branches on the flags instead of materializing a boolean.
+			UINTN next = offset + 1;
+			if (next + 9 < info->CodeLength && VM_BaseOpcode(code[next]) == PUSH && VM_BaseOpcode(code[next + 9]) == JIF &&
+				!(info->Flags[next] & VM_CODE_LEADER) && JIT_JumpOffset(vm, next + 9, &jump))
+			{
+				jit->Cached = -1;
+				JIT_EmitBranch(jit, condition, next + 9, next + 10 + jump, depth - 2);
+				return 11;
+			}
+
+			UINT8 set[6] = { 0x0F, (UINT8)(condition + 0x10), 0xC0, 0x0F, 0xB6, 0xC0 };
+			Emitter_EmitBytes(&jit->Emit, set, 6);
+		}
+
+		return size;
+	}
+
+	//Everything else, including HLT and BRK, is handed back to the interpreter.
+	JIT_Flush(jit);
+	JIT_EmitExit(jit, offset, depth, JIT_INTERPRET);
+	return size;
+}
+
+//Compile a verified VM to native code, on failure the VM keeps running on the interpreter.
+EFI_STATUS JIT_Compile(VM* vm)
+{
+	if (!JIT_SUPPORTED) return EFI_UNSUPPORTED;
+	if (vm->Verification.Status != Verified) return EFI_UNSUPPORTED;
+	if (vm->Native.Start != NULL) return EFI_SUCCESS;
+
+	VMVerification* info = &vm->Verification;
+
+	//Slots and variables are addressed with 32-bit displacements.
+	if (info->MaxStack >= 0x10000000 || vm->VarCount >= 0x10000000) return EFI_UNSUPPORTED;
+
+	UINTN instructions = 0;
+
+	for (UINTN i = 0; i < info->CodeLength; i++)
+	{
+		if (info->Flags[i] & VM_CODE_INSTRUCTION) instructions++;
+	}
+
+	JitCompiler jit;
+	jit.VM = vm;
+	jit.Labels = (UINT32*)malloc(info->CodeLength * sizeof(UINT32)).Start;
+	jit.Patches = (JitPatch*)malloc(instructions * sizeof(JitPatch)).Start;
+	jit.PatchCount = 0;
+	jit.Cached = -1;
+
+	MemBlock native = codealloc(64 + (instructions * 96));
+
+	if (jit.Labels == NULL || jit.Patches == NULL || native.Start == NULL)
+	{
+		if (jit.Labels != NULL) freeany(jit.Labels);
+		if (jit.Patches != NULL) freeany(jit.Patches);
+		if (native.Start != NULL) free(&native);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	jit.Emit = New_Emitter(native.Start, native.Size);
+
+	//push rbx; push rsi; push rdi; push r12; push r13; mov rdi, rcx
+	//mov rbx, [rdi]; mov rsi, [rdi + 8]; mov r12, [rdi + 16]; xor r13d, r13d; mov [rdi + 48], rsp; jmp rdx
+	UINT8 prologue[] =
+	{
+		0x53, 0x56, 0x57, 0x41, 0x54, 0x41, 0x55, 0x48, 0x89, 0xCF,
+		0x48, 0x8B, 0x1F, 0x48, 0x8B, 0x77, 0x08, 0x4C, 0x8B, 0x67, 0x10, 0x45, 0x31, 0xED,
+		0x48, 0x89, 0x67, 0x30, 0xFF, 0xE2
+	};
+
+	//Native calls still pending are dropped with the stack pointer.
+	//mov rsp, [rdi + 48]; mov [rdi + 16], r12; pop r13; pop r12; pop rdi; pop rsi; pop rbx; ret
+	UINT8 epilogue[] = { 0x48, 0x8B, 0x67, 0x30, 0x4C, 0x89, 0x67, 0x10, 0x41, 0x5D, 0x41, 0x5C, 0x5F, 0x5E, 0x5B, 0xC3 };
+
+	Emitter_EmitBytes(&jit.Emit, prologue, sizeof(prologue));
+	jit.Epilogue = Emitter_Offset(&jit.Emit);
+	Emitter_EmitBytes(&jit.Emit, epilogue, sizeof(epilogue));
+
+	for (UINTN i = 0; i < info->CodeLength; i++)
+	{
+		jit.Labels[i] = JIT_NO_LABEL;
+	}
+
+	UINTN offset = 0;
+
+	while (offset < info->CodeLength && !EFI_ERROR(jit.Emit.Status))
+	{
+		if (!(info->Flags[offset] & VM_CODE_INSTRUCTION))
+		{
+			offset++;
+			continue;
+		}
+
+		if (info->Flags[offset] & VM_CODE_LEADER)
+		{
+			JIT_Flush(&jit);
+			jit.Labels[offset] = (UINT32)Emitter_Offset(&jit.Emit);
+		}
+
+		offset += JIT_CompileInstruction(&jit, offset);
+	}
+
+	EFI_STATUS status = jit.Emit.Status;
+
+	for (UINTN i = 0; i < jit.PatchCount && !EFI_ERROR(status); i++)
+	{
+		UINT32 label = jit.Labels[jit.Patches[i].Target];
+
+		if (label == JIT_NO_LABEL) status = EFI_LOAD_ERROR;
+		else Emitter_PatchRelative32(&jit.Emit, jit.Patches[i].At, label);
+	}
+
+	if (!EFI_ERROR(status))
+	{
+		vm->NativeBlocks = (UINT32*)malloc(info->BlockCount * sizeof(UINT32)).Start;
+		if (vm->NativeBlocks == NULL) status = EFI_OUT_OF_RESOURCES;
+	}
+
+	if (!EFI_ERROR(status))
+	{
+		for (UINTN i = 0; i < info->BlockCount; i++)
+		{
+			vm->NativeBlocks[i] = jit.Labels[info->Blocks[i].Start];
+		}
+
+		vm->Native = native;
+	}
+	else
+	{
+		free(&native);
+	}
+
+	freeany(jit.Labels);
+	freeany(jit.Patches);
+
+	return status;
+}
+
+//Find the native code for the block starting at the current instruction, or NULL if there is none.
+void* JIT_Entry(VM* vm)
+{
+	if (vm->Native.Start == NULL) return NULL;
+
+	INTN block = VM_FindBlock(&vm->Verification, vm->Current - vm->Start);
+
+	if (block < 0 || vm->NativeBlocks[block] == JIT_NO_LABEL) return NULL;
+
+	return (UINT8*)vm->Native.Start + vm->NativeBlocks[block];
+}
+
+//Executes up to the specified number of instructions like VM_Run, running compiled blocks natively.
+//Inside native code the budget is only charged for backward branches, so a slice ends at a loop edge
+//and the retired count of native code is the number of loop iterations rather than instructions.
+VMRunReason JIT_Run(VM* vm, UINTN maxInstructions, UINTN* retired)
+{
+	UINTN count = maxInstructions;
+	UINTN total = 0;
+	VMRunReason reason = Exhausted;
+
+	while (count > 0)
+	{
+		void* entry = JIT_Entry(vm);
+
+		if (entry != NULL)
+		{
+			JitContext context;
+			context.Variables = vm->Variables;
+			context.Stack = vm->Stack;
+			context.Budget = count;
+			context.Owner = vm;
+
+			UINT64 exit = ((JitEntry)vm->Native.Start)(&context, entry);
+
+			vm->Current = vm->Start + context.Exit;
+			vm->StackTop = context.Depth;
+			total += count - context.Budget;
+			count = context.Budget;
+
+			if (exit == JIT_BUDGET || count == 0) break;
+		}
+
+		UINTN step;
+		reason = VM_Run(vm, 1, &step);
+		total += step;
+		count--;
+
+		if (reason != Exhausted) break;
+	}
+
+	if (retired != NULL) *retired = total;
+
+	return reason;
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include "stdlib.h"
+#include "Slab.h"
 
 //Object that represents a linked list.
 typedef struct LinkedListNode
@@ -12,7 +13,7 @@ typedef struct LinkedListNode
 //Create a new linked list node.
 LinkedListNode* New_LinkedListNode()
 {
-	LinkedListNode* node = malloc(sizeof(LinkedListNode)).Start;
+	LinkedListNode* node = Slab_Alloc(sizeof(LinkedListNode)).Start;
 	node->Element = NULL;
 	node->Next = NULL;
 	node->Previous = NULL;
@@ -40,7 +41,7 @@ void Dispose_LinkedListNode(LinkedListNode* node)
 		Dispose_LinkedListNode(prev);
 	}
 
-	freeany(node);
+	Slab_Free(node, sizeof(LinkedListNode));
 }
 
 //Get the first node of a linked list.
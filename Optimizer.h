@@ -0,0 +1,370 @@
+#pragma once
+#include "VM.h"
+
+//Peephole optimizer run by the assembler between parsing and emission.
+//Jumps and calls are only understood in the PUSH offset; JMP, PUSH offset; JIF and PUSH offset; CALL form,
+//a program with any other jump is emitted as written. Instructions are never moved, only removed or rewritten in place, and every
+//jump offset is recomputed from the positions of the instructions that are left.
+
+//Flags the optimizer keeps for every instruction.
+#define OPTIMIZER_TARGET	0x01
+#define OPTIMIZER_OFFSET	0x02
+#define OPTIMIZER_REACHED	0x04
+#define OPTIMIZER_REMOVED	0x08
+
+//Instruction of a program being optimized, Position is its offset in the code, Size the number of bytes
+//it is emitted in and Source its line.
+typedef struct
+{
+	UINT8 Operation;
+	UINT8 Flags;
+	UINT8 Size;
+	UINT64 Operand;
+	UINT64 Position;
+	UINTN Target;
+	UINT64 Source;
+	UINT64 SourceLength;
+} OptimizerInstruction;
+
+//Returns 1 if an opcode takes the offset of its target from a preceding PUSH.
+inline int Optimizer_Branch(UINT8 op)
+{
+	return op == JMP || op == JIF || op == CALL;
+}
+
+//Get the number of bytes an instruction is encoded in as written, which is always the wide encoding.
+UINT64 Optimizer_Size(UINT8 op)
+{
+	return (op & IMMEDIATE) ? 9 : 1;
+}
+
+//Get the number of bytes an instruction is emitted in with the specified encoding.
+UINT64 Optimizer_EncodedSize(UINT8 op, UINT64 operand, VMEncoding encoding)
+{
+	if (encoding == CompactEncoding && (op & IMMEDIATE)) return 1 + VM_CompactSize(operand);
+
+	return Optimizer_Size(op);
+}
+
+//Find the instruction at the specified position, the end of the code maps to length and -1 means no match.
+INTN Optimizer_Find(OptimizerInstruction* code, UINTN length, UINT64 position)
+{
+	UINTN low = 0;
+	UINTN high = length;
+
+	if (length > 0 && position == code[length - 1].Position + Optimizer_Size(code[length - 1].Operation)) return (INTN)length;
+
+	while (low < high)
+	{
+		UINTN middle = (low + high) / 2;
+
+		if (code[middle].Position < position) low = middle + 1;
+		else high = middle;
+	}
+
+	if (low >= length || code[low].Position != position) return -1;
+
+	return (INTN)low;
+}
+
+//Get the closest instruction before the specified one that has not been removed, or -1 if there is none.
+INTN Optimizer_Previous(OptimizerInstruction* code, INTN index)
+{
+	do index--; while (index >= 0 && (code[index].Flags & OPTIMIZER_REMOVED));
+
+	return index;
+}
+
+//Returns 1 if the instruction is a PUSH whose value may be changed or removed.
+int Optimizer_Constant(OptimizerInstruction* code, INTN index)
+{
+	return index >= 0 && code[index].Operation == PUSH && !(code[index].Flags & OPTIMIZER_OFFSET);
+}
+
+//Returns the base 2 logarithm of a power of two, or -1 for any other value.
+int Optimizer_Log2(UINT64 value)
+{
+	if (value == 0 || (value & (value - 1)) != 0) return -1;
+
+	int result = 0;
+	while (value > 1)
+	{
+		value >>= 1;
+		result++;
+	}
+
+	return result;
+}
+
+//Compute a binary operation the way the interpreter does, returns 0 if it cannot be done at assembly time.
+int Optimizer_Evaluate(UINT8 op, UINT64 value, UINT64 operand, UINT64* result)
+{
+	//Division by zero and the one signed division that overflows are left to fault at run time.
+	if ((op == DIV || op == IDIV || op == MOD || op == IMOD) && operand == 0) return 0;
+	if ((op == IDIV || op == IMOD) && value == 0x8000000000000000 && operand == 0xFFFFFFFFFFFFFFFF) return 0;
+
+	switch (op)
+	{
+		case ADD: *result = value + operand; return 1;
+		case SUB: *result = value - operand; return 1;
+		case MUL: *result = value * operand; return 1;
+		case IMUL: *result = (UINT64)((INT64)value * (INT64)operand); return 1;
+		case DIV: *result = value / operand; return 1;
+		case IDIV: *result = (UINT64)((INT64)value / (INT64)operand); return 1;
+		case MOD: *result = value % operand; return 1;
+		case IMOD: *result = (UINT64)((INT64)value % (INT64)operand); return 1;
+		case AND: *result = value & operand; return 1;
+		case OR: *result = value | operand; return 1;
+		case XOR: *result = value ^ operand; return 1;
+		case SHL: *result = value << (operand & 63); return 1;
+		case SHR: *result = value >> (operand & 63); return 1;
+		case EQU: *result = value == operand; return 1;
+		case NEQ: *result = value != operand; return 1;
+		case ABV: *result = value > operand; return 1;
+		case BEL: *result = value < operand; return 1;
+		case GTR: *result = (INT64)value > (INT64)operand; return 1;
+		case LES: *result = (INT64)value < (INT64)operand; return 1;
+	}
+
+	return 0;
+}
+
+//Record jump targets and the instructions holding jump offsets.
+//Returns EFI_UNSUPPORTED if a jump does not use a constant offset to an instruction boundary.
+EFI_STATUS Optimizer_Analyze(OptimizerInstruction* code, UINTN length, INTN handler)
+{
+	for (UINTN i = 0; i < length; i++)
+	{
+		code[i].Flags = 0;
+		code[i].Target = 0;
+	}
+
+	if (length > 0) code[0].Flags |= OPTIMIZER_TARGET;
+	if (handler >= 0 && (UINTN)handler < length) code[handler].Flags |= OPTIMIZER_TARGET;
+
+	for (UINTN i = 0; i < length; i++)
+	{
+		if (!Optimizer_Branch(code[i].Operation)) continue;
+
+		if (i == 0 || code[i - 1].Operation != PUSH) return EFI_UNSUPPORTED;
+
+		INTN target = Optimizer_Find(code, length, code[i].Position + 1 + code[i - 1].Operand);
+		if (target < 0) return EFI_UNSUPPORTED;
+
+		code[i].Target = (UINTN)target;
+		code[i - 1].Flags |= OPTIMIZER_OFFSET;
+		if ((UINTN)target < length) code[target].Flags |= OPTIMIZER_TARGET;
+
+		//Execution also resumes after a call, with whatever the function left on the stack.
+		if (code[i].Operation == CALL && i + 1 < length) code[i + 1].Flags |= OPTIMIZER_TARGET;
+	}
+
+	//A jump that is itself jumped to takes its offset from whatever is on the stack.
+	for (UINTN i = 0; i < length; i++)
+	{
+		if (Optimizer_Branch(code[i].Operation) && (code[i].Flags & OPTIMIZER_TARGET)) return EFI_UNSUPPORTED;
+	}
+
+	return EFI_SUCCESS;
+}
+
+//Remove every instruction that cannot be reached from the entry point or the error handler.
+EFI_STATUS Optimizer_RemoveUnreachable(OptimizerInstruction* code, UINTN length, INTN handler)
+{
+	UINTN* worklist = (UINTN*)malloc((length + 2) * sizeof(UINTN)).Start;
+	UINTN pending = 0;
+
+	if (worklist == NULL) return EFI_OUT_OF_RESOURCES;
+
+	worklist[pending++] = 0;
+	if (handler >= 0) worklist[pending++] = (UINTN)handler;
+
+	while (pending > 0)
+	{
+		UINTN i = worklist[--pending];
+
+		if (i >= length || (code[i].Flags & OPTIMIZER_REACHED)) continue;
+
+		code[i].Flags |= OPTIMIZER_REACHED;
+
+		if (Optimizer_Branch(code[i].Operation)) worklist[pending++] = code[i].Target;
+		if (code[i].Operation != JMP && code[i].Operation != HLT && code[i].Operation != RET) worklist[pending++] = i + 1;
+	}
+
+	freeany(worklist);
+
+	for (UINTN i = 0; i < length; i++)
+	{
+		if (!(code[i].Flags & OPTIMIZER_REACHED)) code[i].Flags |= OPTIMIZER_REMOVED;
+	}
+
+	return EFI_SUCCESS;
+}
+
+//Fold operations on constants into a single PUSH, returns the number of operations folded.
+UINTN Optimizer_Fold(OptimizerInstruction* code, UINTN length)
+{
+	UINTN changes = 0;
+
+	for (UINTN k = 0; k < length; k++)
+	{
+		if ((code[k].Flags & (OPTIMIZER_REMOVED | OPTIMIZER_TARGET))) continue;
+
+		INTN j = Optimizer_Previous(code, (INTN)k);
+
+		if (code[k].Operation == NOT)
+		{
+			if (!Optimizer_Constant(code, j)) continue;
+
+			code[j].Operand = ~code[j].Operand;
+			code[k].Flags |= OPTIMIZER_REMOVED;
+			changes++;
+			continue;
+		}
+
+		INTN i = j >= 0 ? Optimizer_Previous(code, j) : -1;
+		UINT64 result;
+
+		if (!Optimizer_Constant(code, i) || !Optimizer_Constant(code, j) || (code[j].Flags & OPTIMIZER_TARGET)) continue;
+		if (!Optimizer_Evaluate(code[k].Operation, code[i].Operand, code[j].Operand, &result)) continue;
+
+		code[i].Operand = result;
+		code[j].Flags |= OPTIMIZER_REMOVED;
+		code[k].Flags |= OPTIMIZER_REMOVED;
+		changes++;
+	}
+
+	return changes;
+}
+
+//Replace operations by constant powers of two with shifts and masks and remove operations by their
+//identity, returns the number of operations changed.
+UINTN Optimizer_Reduce(OptimizerInstruction* code, UINTN length)
+{
+	UINTN changes = 0;
+
+	for (UINTN k = 0; k < length; k++)
+	{
+		if ((code[k].Flags & (OPTIMIZER_REMOVED | OPTIMIZER_TARGET))) continue;
+
+		INTN j = Optimizer_Previous(code, (INTN)k);
+		if (!Optimizer_Constant(code, j)) continue;
+
+		UINT8 op = code[k].Operation;
+		UINT64 constant = code[j].Operand;
+		int shift = Optimizer_Log2(constant);
+
+		int identity = (constant == 1 && (op == MUL || op == IMUL || op == DIV || op == IDIV)) ||
+			(constant == 0 && (op == ADD || op == SUB || op == OR || op == XOR || op == SHL || op == SHR));
+
+		if (identity && !(code[j].Flags & OPTIMIZER_TARGET))
+		{
+			code[j].Flags |= OPTIMIZER_REMOVED;
+			code[k].Flags |= OPTIMIZER_REMOVED;
+			changes++;
+		}
+		else if (shift > 0 && (op == MUL || op == IMUL))
+		{
+			code[j].Operand = (UINT64)shift;
+			code[k].Operation = SHL;
+			changes++;
+		}
+		else if (shift > 0 && op == DIV)
+		{
+			code[j].Operand = (UINT64)shift;
+			code[k].Operation = SHR;
+			changes++;
+		}
+		else if (shift > 0 && op == MOD)
+		{
+			code[j].Operand = constant - 1;
+			code[k].Operation = AND;
+			changes++;
+		}
+	}
+
+	return changes;
+}
+
+//Optimize a parsed program in place and lay it out in the specified encoding, removed instructions are flagged
+//with OPTIMIZER_REMOVED. handler is the position of the error handler in the code as written, or NULL if there
+//is none, and is updated to its position in the optimized code. Returns EFI_UNSUPPORTED if the program cannot be optimized.
+EFI_STATUS Optimizer_Run(OptimizerInstruction* code, UINTN length, UINT64* handler, VMEncoding encoding)
+{
+	INTN index = -1;
+
+	if (length == 0) return EFI_SUCCESS;
+
+	//Flags and sizes are cleared first, a program that cannot be optimized is emitted as written from them.
+	for (UINTN i = 0; i < length; i++)
+	{
+		code[i].Position = i == 0 ? 0 : code[i - 1].Position + Optimizer_Size(code[i - 1].Operation);
+		code[i].Flags = 0;
+		code[i].Size = 0;
+	}
+
+	if (handler != NULL)
+	{
+		index = Optimizer_Find(code, length, *handler);
+		if (index < 0) return EFI_UNSUPPORTED;
+	}
+
+	EFI_STATUS status = Optimizer_Analyze(code, length, index);
+	if (!EFI_ERROR(status)) status = Optimizer_RemoveUnreachable(code, length, index);
+
+	if (EFI_ERROR(status))
+	{
+		for (UINTN i = 0; i < length; i++)
+		{
+			code[i].Flags = 0;
+		}
+
+		return status;
+	}
+
+	while (Optimizer_Fold(code, length) + Optimizer_Reduce(code, length) > 0);
+
+	for (UINTN i = 0; i < length; i++)
+	{
+		code[i].Size = (UINT8)Optimizer_EncodedSize(code[i].Operation, code[i].Operand, encoding);
+	}
+
+	//Lay out what is left and point every jump at the new position of its target. A compact offset can
+	//need more bytes than the one it replaces, so the layout is repeated until no offset grows any more.
+	//Offsets never shrink, which ends the loop, and are padded to their size when emitted.
+	UINT64 position;
+	int grown;
+
+	do
+	{
+		position = 0;
+		grown = 0;
+
+		for (UINTN i = 0; i < length; i++)
+		{
+			code[i].Position = position;
+			if (!(code[i].Flags & OPTIMIZER_REMOVED)) position += code[i].Size;
+		}
+
+		for (UINTN i = 0; i < length; i++)
+		{
+			if ((code[i].Flags & OPTIMIZER_REMOVED) || !Optimizer_Branch(code[i].Operation)) continue;
+
+			UINT64 target = code[i].Target < length ? code[code[i].Target].Position : position;
+			code[i - 1].Operand = target - (code[i].Position + 1);
+
+			UINT8 size = (UINT8)Optimizer_EncodedSize(PUSH, code[i - 1].Operand, encoding);
+
+			if (size > code[i - 1].Size)
+			{
+				code[i - 1].Size = size;
+				grown = 1;
+			}
+		}
+	}
+	while (grown);
+
+	if (handler != NULL) *handler = (UINTN)index < length ? code[index].Position : position;
+
+	return EFI_SUCCESS;
+}
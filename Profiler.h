@@ -0,0 +1,160 @@
+#pragma once
+#include "VMIL.h"
+
+#if VM_PROFILE
+//Execution profiles of VMs, built with VM_PROFILE set to 1.
+//Only the stack interpreter counts instructions, native code and register IR run uncounted, and a
+//superinstruction counts as the opcode it was fused from.
+
+//Start counting the instructions a VM executes, counts from an earlier profile are discarded.
+EFI_STATUS VM_StartProfile(VM* vm)
+{
+	UINT8* end = (UINT8*)VM_CodeMemory(vm)->Start + VM_CodeMemory(vm)->Size;
+	UINTN length = vm->Start < end ? (UINTN)(end - vm->Start) : 0;
+
+	VM_ClearProfile(vm);
+
+	vm->Profile = (VMProfile*)zmalloc(sizeof(VMProfile)).Start;
+	if (vm->Profile == NULL) return EFI_OUT_OF_RESOURCES;
+
+	vm->Profile->Length = length;
+	vm->Profile->Hits = (UINT64*)calloc(length + 1, sizeof(UINT64)).Start;
+	vm->Profile->Taken = (UINT64*)calloc(length + 1, sizeof(UINT64)).Start;
+	vm->Profile->NotTaken = (UINT64*)calloc(length + 1, sizeof(UINT64)).Start;
+
+	if (vm->Profile->Hits == NULL || vm->Profile->Taken == NULL || vm->Profile->NotTaken == NULL)
+	{
+		VM_ClearProfile(vm);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	return EFI_SUCCESS;
+}
+
+//Print a line of a profile to the console, or append it to a file if one is specified.
+EFI_STATUS Profile_WriteLine(EFI_FILE* file, CHAR16* line)
+{
+	if (file == NULL)
+	{
+		Print(L"%s\n", line);
+		return EFI_SUCCESS;
+	}
+
+	CHAR16* newline = L"\r\n";
+	UINTN size = StrLen(line) * sizeof(CHAR16);
+	EFI_STATUS status = file->Write(file, &size, line);
+
+	size = StrLen(newline) * sizeof(CHAR16);
+	if (!EFI_ERROR(status)) status = file->Write(file, &size, newline);
+
+	return status;
+}
+
+//Write the profile of a VM as text, an opcode histogram followed by every offset that was executed.
+//Conditional jumps also show how often they were taken. Writes to the console if file is NULL.
+EFI_STATUS VM_WriteProfile(VM* vm, EFI_FILE* file)
+{
+	VMProfile* profile = vm->Profile;
+	CHAR16 line[128];
+	CHAR16 instruction[64];
+	UINT8 code[9] = { 0 };
+	UINT64 total = 0;
+	EFI_STATUS status;
+
+	if (profile == NULL) return EFI_NOT_STARTED;
+
+	for (UINTN i = 0; i < 256; i++)
+	{
+		total += profile->Opcodes[i];
+	}
+
+	SPrint(line, sizeof(line), L"Task %d: %ld instructions", vm->Id, total);
+	status = Profile_WriteLine(file, line);
+
+	for (UINTN i = 0; i < 256 && !EFI_ERROR(status); i++)
+	{
+		UINT64 position = 0;
+
+		if (profile->Opcodes[i] == 0) continue;
+
+		//Disassemble the opcode alone and cut its operand.
+		code[0] = (UINT8)i;
+
+		if (EFI_ERROR(VMIL_ToString(code, &position, sizeof(code), instruction, sizeof(instruction), WideEncoding)))
+		{
+			SPrint(instruction, sizeof(instruction), L"0x%02x", i);
+		}
+
+		for (UINTN j = 0; instruction[j] != 0; j++)
+		{
+			if (instruction[j] == L' ') instruction[j] = 0;
+		}
+
+		SPrint(line, sizeof(line), L"  %-10s %ld", instruction, profile->Opcodes[i]);
+		status = Profile_WriteLine(file, line);
+	}
+
+	if (!EFI_ERROR(status))
+	{
+		StrCpy(line, L"  Offset  Instruction          Hits");
+		status = Profile_WriteLine(file, line);
+	}
+
+	for (UINT64 i = 0; i < profile->Length && !EFI_ERROR(status); i++)
+	{
+		UINT64 position = i;
+
+		if (profile->Hits[i] == 0) continue;
+
+		if (EFI_ERROR(VMIL_ToString(vm->Start, &position, profile->Length, instruction, sizeof(instruction), vm->Encoding)))
+		{
+			StrCpy(instruction, L"?");
+		}
+
+		if (profile->Taken[i] + profile->NotTaken[i] > 0)
+		{
+			SPrint(line, sizeof(line), L"  %06lx  %-20s %ld taken %ld not taken %ld", i, instruction, profile->Hits[i], profile->Taken[i], profile->NotTaken[i]);
+		}
+		else
+		{
+			SPrint(line, sizeof(line), L"  %06lx  %-20s %ld", i, instruction, profile->Hits[i]);
+		}
+
+		status = Profile_WriteLine(file, line);
+	}
+
+	return status;
+}
+
+//Print the profile of a VM to the console.
+EFI_STATUS VM_PrintProfile(VM* vm)
+{
+	return VM_WriteProfile(vm, NULL);
+}
+
+//Save the profile of a VM to a text file in a directory, replacing the file if it exists.
+EFI_STATUS VM_SaveProfile(VM* vm, EFI_FILE* directory, CHAR16* name)
+{
+	EFI_FILE* file;
+	EFI_STATUS status;
+
+	if (vm->Profile == NULL) return EFI_NOT_STARTED;
+
+	//Opening an existing file keeps its contents, so it is deleted first.
+	status = directory->Open(directory, &file, name, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+	if (!EFI_ERROR(status)) file->Delete(file);
+
+	status = directory->Open(directory, &file, name, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+	if (EFI_ERROR(status)) return status;
+
+	//Text files on the ESP are UCS-2 with a byte order mark.
+	CHAR16 mark = 0xFEFF;
+	UINTN size = sizeof(mark);
+	status = file->Write(file, &size, &mark);
+
+	if (!EFI_ERROR(status)) status = VM_WriteProfile(vm, file);
+
+	file->Close(file);
+	return status;
+}
+#endif
@@ -1,11 +1,25 @@
 #pragma once
 #include "VMIL.h"
+#include "Cache.h"
+#include "JIT.h"
+#include "Fusion.h"
+#include "IR.h"
+#include "Profiler.h"
 #include "File.h"
 
+//Instructions a task may retire per scheduler pass for every level of priority.
+#ifndef RUNTIME_SLICE
+#define RUNTIME_SLICE 1024
+#endif
+
 typedef struct
 {
 	ArrayList Tasks;
 	UINTN NextId;
+	Arena Scratch;
+#if VM_PROFILE
+	EFI_FILE* ProfileDirectory;
+#endif
 } Runtime;
 
 Runtime New_Runtime()
@@ -13,44 +27,147 @@ Runtime New_Runtime()
 	Runtime result;
 	result.Tasks = New_ArrayList();
 	result.NextId = 0;
+	result.Scratch = New_Arena(VMIL_READ_AHEAD);
+#if VM_PROFILE
+	result.ProfileDirectory = NULL;
+#endif
 	return result;
 }
 
+//Length of the longest name of a cache, the longest name of a file followed by VM_CACHE_SUFFIX.
+#define RUNTIME_CACHE_NAME 264
+
+//Find a task whose code is shared and was loaded from the image with the specified key.
+VM* Runtime_FindCode(Runtime* rt, UINT64 key)
+{
+	for (UINTN i = 0; i < rt->Tasks.Length; i++)
+	{
+		VM* task = (VM*)ArrayList_Get(rt->Tasks, i);
+		if (task->Code != NULL && task->Code->Key == key) return task;
+	}
+
+	return NULL;
+}
+
+//Load a program and prepare it for the fastest engine that accepts it.
+//Programs verified on an earlier boot are loaded from their cache, which is regenerated when the program changes.
+//Another instance of a program that is already running shares its code and only gets its own variables.
 EFI_STATUS Runtime_Launch(Runtime* rt, EFI_FILE* directory, EFI_FILE_INFO* file)
 {
-	VM* vm = (VM*)malloc(sizeof(VM)).Start;
-	
-	EFI_STATUS status = VMIL_Load(OpenEntry(directory, file), rt->NextId++, vm);
+	EFI_FILE* source = OpenEntry(directory, file);
+	if (source == NULL) return EFI_NOT_FOUND;
+
+	UINT64 key;
+	int keyed = !EFI_ERROR(VMCache_Key(source, &rt->Scratch, &key));
+	VM* parent = keyed ? Runtime_FindCode(rt, key) : NULL;
+
+	VM* vm = (VM*)Slab_Alloc(sizeof(VM)).Start;
+	if (vm == NULL)
+	{
+		source->Close(source);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	UINTN id = rt->NextId++;
+	EFI_STATUS status;
+	int cached = 0;
+
+#if !VM_PROFILE
+	CHAR16 name[RUNTIME_CACHE_NAME];
+	SPrint(name, sizeof(name), L"%s%s", file->FileName, VM_CACHE_SUFFIX);
+
+	if (parent == NULL && keyed) cached = !EFI_ERROR(VMCache_Load(directory, name, key, id, vm));
+#endif
+
+	if (parent != NULL) status = VM_Spawn(parent, id, vm);
+	else if (cached) status = EFI_SUCCESS;
+	else
+	{
+		status = source->SetPosition(source, 0);
+		if (!EFI_ERROR(status)) status = VMIL_Load(source, id, &rt->Scratch, vm);
+	}
+
+	source->Close(source);
+	Arena_Reset(&rt->Scratch);
 
 	if (EFI_ERROR(status))
 	{
-		freeany(vm);
+		Slab_Free(vm, sizeof(VM));
 		return status;
 	}
 
-	ArrayList_Add(&rt->Tasks, vm);
+	if (parent == NULL)
+	{
+#if VM_PROFILE
+		VM_Verify(vm);
+#else
+		//Programs that fail verification still run, but on the checked interpreter.
+		if (cached || !EFI_ERROR(VM_Verify(vm)))
+		{
+			if (!cached)
+			{
+				VM_Fuse(vm);
+				if (keyed) VMCache_Save(directory, name, key, vm);
+			}
+
+			JIT_Compile(vm);
+		}
+#endif
+
+		//The code no longer changes once it was verified or rejected, so later instances can share it.
+		if (keyed) VM_Share(vm, key);
+	}
+
+#if VM_PROFILE
+	//Profiled programs stay on the interpreter so that every instruction is counted.
+	//The profile is saved next to the program when it halts.
+	VM_StartProfile(vm);
+	rt->ProfileDirectory = directory;
+#else
+	//Verified programs that cannot be compiled to native code run as register IR, which is bound to the
+	//variables and stack of a VM and so is never shared.
+	if (vm->Verification.Status == Verified && vm->Native.Start == NULL) IR_Translate(vm);
+#endif
+
+	if (!ArrayList_Add(&rt->Tasks, vm))
+	{
+		Dispose_VM(vm);
+		Slab_Free(vm, sizeof(VM));
+		return EFI_OUT_OF_RESOURCES;
+	}
 
 	return EFI_SUCCESS;
 }
 
+//Run a task on the fastest engine that was prepared for it.
+VMRunReason Runtime_Run(VM* task, UINTN count)
+{
+	if (task->Native.Start != NULL) return JIT_Run(task, count, NULL);
+	if (task->IR.Code != NULL) return IR_Run(task, count, NULL);
+
+	return VM_Run(task, count, NULL);
+}
+
+//Run every active task for a time slice proportional to its priority, removing the ones that halted.
 void Runtime_Execute(Runtime* rt)
 {
 	for (UINTN i = 0; i < rt->Tasks.Length; i++)
 	{
 		VM* task = (VM*)ArrayList_Get(rt->Tasks, i);
 
-		if (task->Status == Active)
-		{
-			for (UINTN j = 0; j < task->Priority && task->Status == Active; j++)
-			{
-				VM_Execute(task);
-			}
-		}
-		
-		if (task->Status == Finished)
+		if (task->Status == Active && Runtime_Run(task, (UINTN)task->Priority * RUNTIME_SLICE) == Halted)
 		{
+#if VM_PROFILE
+			CHAR16 name[32];
+			SPrint(name, sizeof(name), L"profile%d.txt", task->Id);
+
+			//Fall back to the console if the profile cannot be written to the disk.
+			if (rt->ProfileDirectory == NULL || EFI_ERROR(VM_SaveProfile(task, rt->ProfileDirectory, name))) VM_PrintProfile(task);
+#endif
 			ArrayList_RemoveAt(&rt->Tasks, i);
+			Dispose_VM(task);
+			Slab_Free(task, sizeof(VM));
 			i--;
 		}
 	}
-}
\ No newline at end of file
+}
@@ -0,0 +1,216 @@
+#pragma once
+#include "stdlib.h"
+
+//Allocator for small fixed-size objects. Sizes are rounded up to a power of two and every size class keeps a
+//free list, refilled a batch at a time from pages taken with AllocatePages, so allocating and freeing an object
+//is a few instructions. Objects of a class are packed together in their pages and are aligned to their size up to
+//the page size, larger classes are only page-aligned.
+//Pages are kept by their class once taken. Sizes above the largest class are allocated from the pool.
+//Resizable blocks from Slab_AllocBlock are an exception, above the largest class they are runs of pages.
+
+//Smallest class, big enough to hold the link of the free list.
+#define SLAB_MIN_SHIFT 4
+
+//Largest class, 32 KiB.
+#define SLAB_MAX_SHIFT 15
+
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+//Bytes taken from the firmware when the free list of a class runs out.
+#define SLAB_BATCH 0x10000
+
+//Free object, linked through its first bytes.
+typedef struct SlabObject
+{
+	struct SlabObject* Next;
+} SlabObject;
+
+//Free list of a size class, Pages counts the pages the class has taken and Used the objects handed out.
+typedef struct
+{
+	SlabObject* Free;
+	UINTN Pages;
+	UINTN Used;
+} SlabClass;
+
+SlabClass Slab_Classes[SLAB_CLASSES];
+
+//Get the class of a size, or SLAB_CLASSES if it is too large for a class.
+UINTN Slab_Class(UINTN size)
+{
+	UINTN shift = SLAB_MIN_SHIFT;
+
+	while (shift <= SLAB_MAX_SHIFT && ((UINTN)1 << shift) < size) shift++;
+
+	return shift - SLAB_MIN_SHIFT;
+}
+
+//Carve a new batch of pages into free objects of a class, returns 0 if the firmware is out of pages.
+int Slab_Refill(SlabClass* slab, UINTN size)
+{
+	UINTN pages = EFI_SIZE_TO_PAGES(size > SLAB_BATCH ? size : SLAB_BATCH);
+
+	EFI_PHYSICAL_ADDRESS address;
+	EFI_STATUS status = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages, EfiLoaderData, pages, &address);
+	if (EFI_ERROR(status)) return 0;
+
+	UINT8* start = (UINT8*)(UINTN)address;
+
+	//Objects are pushed from the end so that consecutive allocations are next to each other.
+	for (UINTN i = (pages * EFI_PAGE_SIZE) / size; i > 0; i--)
+	{
+		SlabObject* object = (SlabObject*)(start + ((i - 1) * size));
+		object->Next = slab->Free;
+		slab->Free = object;
+	}
+
+	slab->Pages += pages;
+	return 1;
+}
+
+//Allocate an object of the specified size.
+MemBlock Slab_Alloc(UINTN size)
+{
+	UINTN index = Slab_Class(size);
+
+	if (size == 0 || index == SLAB_CLASSES) return malloc(size);
+
+	MemBlock result;
+	result.Start = NULL;
+	result.Size = 0;
+
+	SlabClass* slab = &Slab_Classes[index];
+
+	if (slab->Free == NULL && !Slab_Refill(slab, (UINTN)1 << (index + SLAB_MIN_SHIFT))) return result;
+
+	SlabObject* object = slab->Free;
+	slab->Free = object->Next;
+	slab->Used++;
+
+	result.Start = object;
+	result.Size = size;
+	return result;
+}
+
+//Allocate an object of the specified size and zero it out.
+MemBlock Slab_ZAlloc(UINTN size)
+{
+	MemBlock result = Slab_Alloc(size);
+	if (result.Start != NULL) fillmem(result.Start, 0, result.Size);
+	return result;
+}
+
+//Free an object allocated with Slab_Alloc, size must be the size it was allocated with.
+void Slab_Free(void* ptr, UINTN size)
+{
+	if (ptr == NULL) return;
+
+	UINTN index = Slab_Class(size);
+
+	if (index == SLAB_CLASSES)
+	{
+		freeany(ptr);
+		return;
+	}
+
+	SlabClass* slab = &Slab_Classes[index];
+	SlabObject* object = (SlabObject*)ptr;
+
+	object->Next = slab->Free;
+	slab->Free = object;
+	slab->Used--;
+}
+
+//Get the usable size of a resizable block that holds at least the specified number of bytes: the size of its
+//class, or whole pages above the largest class.
+UINTN Slab_Usable(UINTN size)
+{
+	UINTN index = Slab_Class(size);
+
+	if (index < SLAB_CLASSES) return (UINTN)1 << (index + SLAB_MIN_SHIFT);
+
+	return EFI_PAGES_TO_SIZE(EFI_SIZE_TO_PAGES(size));
+}
+
+//Allocate a resizable block of at least the specified size. Size is set to the usable size of the block,
+//which callers may use in full, and the block must only be resized with Slab_Resize and freed with Slab_FreeBlock.
+MemBlock Slab_AllocBlock(UINTN size)
+{
+	UINTN usable = Slab_Usable(size);
+
+	if (usable <= ((UINTN)1 << SLAB_MAX_SHIFT)) return Slab_Alloc(usable);
+
+	MemBlock result;
+	result.Start = NULL;
+	result.Size = 0;
+
+	EFI_PHYSICAL_ADDRESS address;
+	EFI_STATUS status = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(usable), &address);
+	if (EFI_ERROR(status)) return result;
+
+	result.Start = (void*)(UINTN)address;
+	result.Size = usable;
+	return result;
+}
+
+//Free a resizable block.
+void Slab_FreeBlock(MemBlock* block)
+{
+	if (block->Start == NULL) return;
+
+	if (block->Size <= ((UINTN)1 << SLAB_MAX_SHIFT)) Slab_Free(block->Start, block->Size);
+	else uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)(UINTN)block->Start, EFI_SIZE_TO_PAGES(block->Size));
+
+	block->Start = NULL;
+	block->Size = 0;
+}
+
+//Resize a block from Slab_AllocBlock to hold at least the specified number of bytes, keeping its first used bytes.
+//A block that stays in its class is left alone. Runs of pages shrink by returning their last pages and grow by
+//taking the pages right after them when those are free, only otherwise is the block moved.
+//Returns 0 if there is not enough memory, in which case the block is left as it was.
+int Slab_Resize(MemBlock* block, UINTN size, UINTN used)
+{
+	if (block->Start == NULL)
+	{
+		*block = Slab_AllocBlock(size);
+		return block->Start != NULL;
+	}
+
+	UINTN usable = Slab_Usable(size);
+	UINTN largest = (UINTN)1 << SLAB_MAX_SHIFT;
+
+	if (usable == block->Size) return 1;
+
+	if (block->Size > largest && usable > largest)
+	{
+		UINTN pages = EFI_SIZE_TO_PAGES(block->Size);
+		UINTN needed = EFI_SIZE_TO_PAGES(usable);
+		EFI_PHYSICAL_ADDRESS end = (EFI_PHYSICAL_ADDRESS)(UINTN)block->Start + block->Size;
+
+		if (needed < pages)
+		{
+			uefi_call_wrapper(BS->FreePages, 2, end - EFI_PAGES_TO_SIZE(pages - needed), pages - needed);
+			block->Size = usable;
+			return 1;
+		}
+
+		EFI_PHYSICAL_ADDRESS address = end;
+		EFI_STATUS status = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData, needed - pages, &address);
+
+		if (!EFI_ERROR(status))
+		{
+			block->Size = usable;
+			return 1;
+		}
+	}
+
+	MemBlock result = Slab_AllocBlock(size);
+	if (result.Start == NULL) return 0;
+
+	copymem(result.Start, block->Start, used < usable ? used : usable);
+	Slab_FreeBlock(block);
+
+	*block = result;
+	return 1;
+}
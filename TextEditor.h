@@ -1,5 +1,7 @@
 #pragma once
 #include "stdlib.h"
+#include "Arena.h"
+#include "Slab.h"
 #include "Console.h"
 
 typedef struct TextEditorBlock
@@ -19,11 +21,17 @@ typedef struct
 	TextEditorBlock* Page;
 } TextEditor;
 
+//Get the number of bytes a block for a screen of the specified size takes, which includes the row of the status bar.
+UINTN TextEditorBlock_Size(UINTN width, UINTN height)
+{
+	return sizeof(TextEditorBlock) + ((width * height) * sizeof(CHAR16));
+}
+
 TextEditorBlock* New_TextEditorBlock(Environment* e)
 {
 	Size screenSize = e->Screen.Size;
 
-	TextEditorBlock* result = (TextEditorBlock*)zmalloc(sizeof(TextEditorBlock) + ((screenSize.Width * screenSize.Height) * sizeof(CHAR16))).Start;
+	TextEditorBlock* result = (TextEditorBlock*)Slab_ZAlloc(TextEditorBlock_Size(screenSize.Width, screenSize.Height)).Start;
 
 	if (result != 0)
 	{
@@ -36,7 +44,7 @@ TextEditorBlock* New_TextEditorBlock(Environment* e)
 
 void Dispose_TextEditorBlock(TextEditorBlock* block)
 {
-	freeany(block);
+	Slab_Free(block, TextEditorBlock_Size(block->Width, block->Height + 1));
 }
 
 INT64 TextEditorBlock_DistanceToStart(TextEditorBlock* block)
@@ -65,9 +73,12 @@ INT64 TextEditorBlock_DistanceToEnd(TextEditorBlock* block)
 	return result;
 }
 
-CHAR16* TextEditorBlock_ToString(TextEditorBlock* block)
+//Get the text of a block with its lines separated by newlines. The string and the scratch buffers used to
+//build it are allocated from the arena, so the string lives until the arena is reset.
+CHAR16* TextEditorBlock_ToString(TextEditorBlock* block, Arena* arena)
 {
-	INT64* lineLengths = (UINT64*)malloc(block->Height).Start;
+	INT64* lineLengths = (INT64*)Arena_Alloc(arena, block->Height * sizeof(INT64), 0).Start;
+	if (lineLengths == NULL) return NULL;
 
 	for (INT64 i = 0; i < block->Height; i++)
 	{
@@ -93,7 +104,9 @@ CHAR16* TextEditorBlock_ToString(TextEditorBlock* block)
 		bufferSize += lineLengths[i] + 1;
 	}
 
-	CHAR16* buffer = malloc(bufferSize * sizeof(CHAR16)).Start;
+	CHAR16* buffer = Arena_Alloc(arena, bufferSize * sizeof(CHAR16), 0).Start;
+	if (buffer == NULL) return NULL;
+
 	INT64 position = 0;
 
 	for (INT64 i = 0; i < block->Height; i++)
@@ -118,8 +131,6 @@ CHAR16* TextEditorBlock_ToString(TextEditorBlock* block)
 		}
 	}
 
-	freeany(lineLengths);
-
 	return buffer;
 }
 
@@ -167,9 +178,9 @@ void TextEditorBlock_Insert(Environment* e, TextEditorBlock* block, UINT64 posit
 				next = block->Buffer[index];
 			}
 
-			for (UINT64 j = index + 1; j > position; j--)
+			if ((UINT64)index + 1 > position)
 			{
-				block->Buffer[j] = block->Buffer[j - 1];
+				movemem(&block->Buffer[position + 1], &block->Buffer[position], ((UINT64)index + 1 - position) * sizeof(CHAR16));
 			}
 
 			block->Buffer[position] = value;
@@ -226,10 +237,7 @@ void TextEditorBlock_Remove(Environment* e, TextEditorBlock* block, UINT64 posit
 
 	UINT64 end = (((position / block->Width) + 1) * block->Width) - 1;
 
-	for (UINT64 i = position; i < end; i++)
-	{
-		block->Buffer[i] = block->Buffer[i + 1];
-	}
+	if (end > position) movemem(&block->Buffer[position], &block->Buffer[position + 1], (end - position) * sizeof(CHAR16));
 
 	for (UINT64 i = end; i > position; i--)
 	{
@@ -1,5 +1,31 @@
 #pragma once
 #include "ArrayList.h"
+#include "Slab.h"
+
+//Number of stack entries allocated up front, 64 entries fill a single 512 byte block.
+#ifndef VM_STACK_INITIAL
+#define VM_STACK_INITIAL 64
+#endif
+
+//Default maximum stack depth, pushing past it faults to the error handler.
+#ifndef VM_STACK_LIMIT
+#define VM_STACK_LIMIT 65536
+#endif
+
+//Deepest nesting of calls, a CALL past it faults to the error handler.
+#ifndef VM_CALL_LIMIT
+#define VM_CALL_LIMIT 256
+#endif
+
+//Number of locals the frames of all active calls of a VM hold together, ENTER past it faults to the error handler.
+#ifndef VM_FRAME_LIMIT
+#define VM_FRAME_LIMIT 4096
+#endif
+
+//Count executed instructions per opcode and per offset, see Profiler.h. Compiled out by default.
+#ifndef VM_PROFILE
+#define VM_PROFILE 0
+#endif
 
 typedef enum
 {
@@ -8,15 +34,130 @@ typedef enum
 	Finished
 } VMStatus;
 
+//Why a call to VM_Run returned.
+typedef enum
+{
+	Exhausted,
+	Broke,
+	Halted,
+	Faulted
+} VMRunReason;
+
+typedef enum
+{
+	Unverified,
+	Verified,
+	Rejected
+} VerificationStatus;
+
+//How the operands of opcodes with the IMMEDIATE bit are encoded. Wide code follows the opcode with 8 bytes,
+//compact code with a signed LEB128 number of 1 to VM_COMPACT_MAX bytes. Only the checked interpreter runs
+//compact code, VM_Verify rewrites it wide for the other engines.
+typedef enum
+{
+	WideEncoding,
+	CompactEncoding
+} VMEncoding;
+
+//Longest operand of compact code, 64 bits in groups of 7.
+#define VM_COMPACT_MAX 10
+
+//Basic block of verified code, offsets are relative to the entry point.
+typedef struct
+{
+	UINT32 Start;
+	UINT32 Length;
+	UINT32 EntryDepth;
+	UINT32 MaxDepth;
+} VMBlock;
+
+//Result of verifying the code of a VM, cached on the VM so later passes can reuse it.
+typedef struct
+{
+	VerificationStatus Status;
+	UINTN MaxStack;
+	UINTN CodeLength;
+	UINT8* Flags;
+	UINT32* Depths;
+	VMBlock* Blocks;
+	UINTN BlockCount;
+} VMVerification;
+
+//Instruction of the register IR built by IR_Translate, its operands point straight at variables,
+//entries of the stack or constants so that no stack pointer exists at run time.
+typedef struct
+{
+	UINT8 Op;
+	UINT32 Retired;
+	UINT32 Depth;
+	UINT32 Offset;
+	UINT32 Target;
+	UINT64* Dest;
+	UINT64* A;
+	UINT64* B;
+} IRInstruction;
+
+//Register IR of a verified program, bound to the stack buffer it was translated against.
+typedef struct
+{
+	IRInstruction* Code;
+	UINTN Length;
+	UINTN Capacity;
+	UINT32* Blocks;
+	UINT64* Constants;
+	UINT64* Stack;
+} VMIR;
+
+//Entry of the return stack, pushed by CALL and popped by RET.
+typedef struct
+{
+	UINT8* Return;
+	UINTN Frame;
+} VMCall;
+
+//Code of a program shared by every VM launched from the same image, freed with the last VM that references it.
+//Memory holds the initial variables followed by the code and is never written once shared, every VM runs on a
+//copy of the variables. Verification and native code are shared too, they only depend on the code.
+typedef struct
+{
+	MemBlock Memory;
+	UINTN References;
+	UINT64 Key;
+	UINT64* Variables;
+	VMVerification Verification;
+	MemBlock Native;
+	UINT32* NativeBlocks;
+} VMCode;
+
+#if VM_PROFILE
+//Execution counts of a VM, Hits, Taken and NotTaken have an entry for every byte of code after the entry point.
+typedef struct
+{
+	UINT64 Opcodes[256];
+	UINT64* Hits;
+	UINT64* Taken;
+	UINT64* NotTaken;
+	UINTN Length;
+} VMProfile;
+#endif
+
 typedef struct
 {
 	VMStatus Status;
 	UINTN Id;
 	UINT8 Priority;
 
+	//Memory of the VM, which holds its code as well unless the code is shared.
 	MemBlock Memory;
+	VMCode* Code;
 
-	ArrayList Stack;
+	//StackCapacity never exceeds StackLimit, so a full stack is the only check the interpreter makes.
+	//StackSize is the usable size of the block that holds the stack, which may have room for more entries.
+	UINT64* Stack;
+	UINTN StackTop;
+	UINTN StackCapacity;
+	UINTN StackLimit;
+	UINTN StackSize;
 
 	UINT64* Variables;
 	UINTN VarCount;
@@ -24,6 +165,26 @@ typedef struct
 	UINT8* Start;
 	UINT8* Current;
 	UINT8* Error;
+	VMEncoding Encoding;
+
+	//Return stack and frame arena, both allocated on first use. The locals of the current frame are
+	//Locals[FrameStart] up to Locals[FrameEnd].
+	VMCall* Calls;
+	UINTN CallTop;
+	UINT64* Locals;
+	UINTN FrameStart;
+	UINTN FrameEnd;
+
+	VMVerification Verification;
+
+	MemBlock Native;
+	UINT32* NativeBlocks;
+
+	VMIR IR;
+
+#if VM_PROFILE
+	VMProfile* Profile;
+#endif
 } VM;
 
 typedef enum
@@ -41,6 +202,8 @@ typedef enum
 	LDVAR		= 0b00000011,
 	LDINDVAR	= 0b00000101,
 	STVAR		= 0b00000111,
+	LDIDXVAR	= 0b00001001,
+	STIDXVAR	= 0b00001011,
 
 	ADD			= 0b00001010,
 	SUB			= 0b00001100,
@@ -64,9 +227,53 @@ typedef enum
 	LES			= 0b00101100,
 
 	JMP			= 0b00101110,
-	JIF			= 0b00110000
+	JIF			= 0b00110000,
+
+	SHL			= 0b00110010,
+	SHR			= 0b00110100,
+
+	CPYVAR		= 0b00110110,
+	FILLVAR		= 0b00111000,
+	CMPVAR		= 0b00111010,
+	SUMVAR		= 0b00111100,
+	XORVAR		= 0b00111110,
+
+	CALL		= 0b01010000,
+	RET			= 0b01010010,
+	ENTER		= 0b01010001,
+	LDLOC		= 0b01010011,
+	STLOC		= 0b01010101,
+
+	VADD		= 0b01000001,
+	VSUB		= 0b01000011,
+	VAND		= 0b01000101,
+	VOR			= 0b01000111,
+	VXOR		= 0b01001001,
+	VEQU		= 0b01001011,
+	VMIN		= 0b01001101,
+	VMAX		= 0b01001111
 } OpCode;
 
+//Opcodes with this bit set are superinstructions written over verified code by VM_Fuse, they never appear in an image.
+#define VM_FUSED 0b10000000
+
+//Each superinstruction replaces the first opcode of the sequence it stands for and keeps its IMMEDIATE bit,
+//the rest of the sequence is left in place so that jumps into the middle of it still land on the original code.
+typedef enum
+{
+	EQU_JIF			= 0b10000000,
+	NEQ_JIF			= 0b10000010,
+	ABV_JIF			= 0b10000100,
+	BEL_JIF			= 0b10000110,
+	GTR_JIF			= 0b10001000,
+	LES_JIF			= 0b10001010,
+
+	LDVAR_ADD_STVAR	= 0b10000001,
+	LDVAR_SUB_STVAR	= 0b10000011,
+	PUSH_JMP		= 0b10000101,
+	PUSH_JIF		= 0b10000111
+} FusedOpCode;
+
 VM New_VM(MemBlock memory, UINTN id, UINT8 priority, UINT64* variables, UINT64 varCount, UINT8* start, UINT8* error)
 {
 	VM vm;
@@ -74,338 +281,556 @@ VM New_VM(MemBlock memory, UINTN id, UINT8 priority, UINT64* variables, UINT64 v
 	vm.Id = id;
 	vm.Priority = priority;
 	vm.Memory = memory;
-	vm.Stack = New_ArrayList();
+	vm.Code = NULL;
+	MemBlock stack = Slab_AllocBlock((VM_STACK_INITIAL + 1) * sizeof(UINT64));
+	vm.Stack = stack.Start == NULL ? NULL : (UINT64*)stack.Start + 1;
+	vm.StackTop = 0;
+	vm.StackCapacity = stack.Start == NULL ? 0 : (stack.Size / sizeof(UINT64)) - 1;
+	vm.StackLimit = VM_STACK_LIMIT;
+	vm.StackSize = stack.Size;
+	if (vm.StackCapacity > vm.StackLimit) vm.StackCapacity = vm.StackLimit;
 	vm.Variables = variables;
 	vm.VarCount = varCount;
 	vm.Start = start;
 	vm.Current = start;
 	vm.Error = error;
+	vm.Encoding = WideEncoding;
+	vm.Calls = NULL;
+	vm.CallTop = 0;
+	vm.Locals = NULL;
+	vm.FrameStart = 0;
+	vm.FrameEnd = 0;
+	vm.Verification.Status = Unverified;
+	vm.Verification.MaxStack = 0;
+	vm.Verification.CodeLength = 0;
+	vm.Verification.Flags = NULL;
+	vm.Verification.Depths = NULL;
+	vm.Verification.Blocks = NULL;
+	vm.Verification.BlockCount = 0;
+	vm.Native.Start = NULL;
+	vm.Native.Size = 0;
+	vm.NativeBlocks = NULL;
+	vm.IR.Code = NULL;
+	vm.IR.Length = 0;
+	vm.IR.Capacity = 0;
+	vm.IR.Blocks = NULL;
+	vm.IR.Constants = NULL;
+	vm.IR.Stack = NULL;
+#if VM_PROFILE
+	vm.Profile = NULL;
+#endif
 	return vm;
 }
 
+//Returns the opcode a superinstruction was fused from, other opcodes are returned unchanged.
+inline UINT8 VM_BaseOpcode(UINT8 op)
+{
+	if (!(op & VM_FUSED)) return op;
+
+	switch (op)
+	{
+		case EQU_JIF: return EQU;
+		case NEQ_JIF: return NEQ;
+		case ABV_JIF: return ABV;
+		case BEL_JIF: return BEL;
+		case GTR_JIF: return GTR;
+		case LES_JIF: return LES;
+		case LDVAR_ADD_STVAR:
+		case LDVAR_SUB_STVAR: return LDVAR;
+		case PUSH_JMP:
+		case PUSH_JIF: return PUSH;
+	}
+
+	return op;
+}
+
+//Returns 1 for the opcodes that operate on the lanes of short vectors of variables.
+inline int VM_LaneOpcode(UINT8 op)
+{
+	return op >= VADD && op <= VMAX && (op & IMMEDIATE);
+}
+
+//Returns 1 for the opcodes that operate on a range of variables.
+inline int VM_BulkOpcode(UINT8 op)
+{
+	return op == CPYVAR || op == FILLVAR || op == CMPVAR || op == SUMVAR || op == XORVAR || VM_LaneOpcode(op);
+}
+
+//Get the number of bytes an operand takes in compact code.
+inline UINTN VM_CompactSize(UINT64 operand)
+{
+	INT64 value = (INT64)operand;
+	UINTN size = 1;
+
+	while (value < -64 || value > 63)
+	{
+		value >>= 7;
+		size++;
+	}
+
+	return size;
+}
+
+//Write an operand of compact code padded to at least width bytes, returns the number of bytes written.
+inline UINTN VM_EncodeCompact(UINT8* data, UINT64 operand, UINTN width)
+{
+	INT64 value = (INT64)operand;
+	UINTN size = 0;
+
+	while (value < -64 || value > 63 || size + 1 < width)
+	{
+		data[size++] = (UINT8)((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+
+	data[size++] = (UINT8)(value & 0x7F);
+	return size;
+}
+
+//Read an operand of compact code that has to end before end, returns the number of bytes read or 0 if it does not.
+inline UINTN VM_DecodeCompact(UINT8* data, UINT8* end, UINT64* operand)
+{
+	UINT64 value = 0;
+	UINTN shift = 0;
+	UINTN size = 0;
+	UINT8 byte;
+
+	//Most operands are small enough for a single byte.
+	if (data < end && !(*data & 0x80))
+	{
+		*operand = (UINT64)((INT64)((UINT64)*data << 57) >> 57);
+		return 1;
+	}
+
+	do
+	{
+		if (data + size >= end || size == VM_COMPACT_MAX) return 0;
+
+		byte = data[size++];
+		value |= (UINT64)(byte & 0x7F) << shift;
+		shift += 7;
+	}
+	while (byte & 0x80);
+
+	if (shift < 64 && (byte & 0x40)) value |= ~(UINT64)0 << shift;
+
+	*operand = value;
+	return size;
+}
+
+//Get the block of memory that holds the code of a VM.
+inline MemBlock* VM_CodeMemory(VM* vm)
+{
+	return vm->Code != NULL ? &vm->Code->Memory : &vm->Memory;
+}
+
 inline int VM_ValidPointer(VM* vm)
 {
-	return vm->Current >= (UINT8*)vm->Memory.Start && vm->Current < ((UINT8*)vm->Memory.Start + vm->Memory.Size);
+	MemBlock* code = VM_CodeMemory(vm);
+	return vm->Current >= (UINT8*)code->Start && vm->Current < ((UINT8*)code->Start + code->Size);
 }
 
 inline int VM_ValidOperand(VM* vm)
 {
-	return vm->Current >= (UINT8*)vm->Memory.Start && (vm->Current + 8) < ((UINT8*)vm->Memory.Start + vm->Memory.Size);
+	MemBlock* code = VM_CodeMemory(vm);
+	return vm->Current >= (UINT8*)code->Start && (vm->Current + 8) < ((UINT8*)code->Start + code->Size);
 }
 
-inline void VM_PushStack(VM* vm, UINT64 operand)
+//Release the native code compiled for a VM, it falls back to the interpreter. Shared native code is only let go of.
+void VM_ClearNative(VM* vm)
 {
-	ArrayList_Add(&vm->Stack, (void*)operand);
+	int shared = vm->Code != NULL && vm->Native.Start == vm->Code->Native.Start;
+
+	if (vm->Native.Start != NULL && !shared) free(&vm->Native);
+	if (vm->NativeBlocks != NULL && !shared) freeany(vm->NativeBlocks);
+
+	vm->Native.Start = NULL;
+	vm->Native.Size = 0;
+	vm->NativeBlocks = NULL;
 }
 
-inline int VM_PopStack(VM* vm, UINT64* value)
+//Release the register IR translated for a VM, it falls back to the stack interpreter.
+void VM_ClearIR(VM* vm)
+{
+	if (vm->IR.Code != NULL) freeany(vm->IR.Code);
+	if (vm->IR.Blocks != NULL) freeany(vm->IR.Blocks);
+	if (vm->IR.Constants != NULL) freeany(vm->IR.Constants);
+
+	vm->IR.Code = NULL;
+	vm->IR.Length = 0;
+	vm->IR.Capacity = 0;
+	vm->IR.Blocks = NULL;
+	vm->IR.Constants = NULL;
+	vm->IR.Stack = NULL;
+}
+
+//Release the tables built by the verifier, the VM falls back to checked execution.
+void VM_ClearVerification(VM* vm)
 {
-	if (vm->Stack.Length > 0)
+	VM_ClearNative(vm);
+	VM_ClearIR(vm);
+
+	int shared = vm->Code != NULL && vm->Verification.Flags == vm->Code->Verification.Flags;
+
+	if (vm->Verification.Flags != NULL && !shared) freeany(vm->Verification.Flags);
+	if (vm->Verification.Depths != NULL && !shared) freeany(vm->Verification.Depths);
+	if (vm->Verification.Blocks != NULL && !shared) freeany(vm->Verification.Blocks);
+
+	vm->Verification.Status = Unverified;
+	vm->Verification.MaxStack = 0;
+	vm->Verification.CodeLength = 0;
+	vm->Verification.Flags = NULL;
+	vm->Verification.Depths = NULL;
+	vm->Verification.Blocks = NULL;
+	vm->Verification.BlockCount = 0;
+}
+
+#if VM_PROFILE
+//Release the execution counts of a VM.
+void VM_ClearProfile(VM* vm)
+{
+	if (vm->Profile == NULL) return;
+
+	if (vm->Profile->Hits != NULL) freeany(vm->Profile->Hits);
+	if (vm->Profile->Taken != NULL) freeany(vm->Profile->Taken);
+	if (vm->Profile->NotTaken != NULL) freeany(vm->Profile->NotTaken);
+	freeany(vm->Profile);
+
+	vm->Profile = NULL;
+}
+
+//Count the instruction about to run, offsets outside the code after the entry point only count their opcode.
+inline void VM_ProfileFetch(VM* vm, UINT8* ip)
+{
+	VMProfile* profile = vm->Profile;
+
+	if (profile == NULL) return;
+
+	profile->Opcodes[VM_BaseOpcode(*ip)]++;
+	if (ip >= vm->Start && (UINTN)(ip - vm->Start) < profile->Length) profile->Hits[ip - vm->Start]++;
+}
+
+//Count the outcome of the conditional jump at the specified address.
+inline void VM_ProfileBranch(VM* vm, UINT8* ip, int taken)
+{
+	VMProfile* profile = vm->Profile;
+
+	if (profile == NULL || ip < vm->Start || (UINTN)(ip - vm->Start) >= profile->Length) return;
+
+	if (taken) profile->Taken[ip - vm->Start]++;
+	else profile->NotTaken[ip - vm->Start]++;
+}
+
+#define VM_PROFILE_FETCH(ip) VM_ProfileFetch(vm, (ip))
+#define VM_PROFILE_BRANCH(ip, taken) VM_ProfileBranch(vm, (ip), (taken))
+#else
+#define VM_PROFILE_FETCH(ip)
+#define VM_PROFILE_BRANCH(ip, taken)
+#endif
+
+//Get the resizable block that holds the stack of a VM, including its guard entry.
+MemBlock VM_StackBlock(VM* vm)
+{
+	MemBlock result;
+	result.Start = vm->Stack == NULL ? NULL : vm->Stack - 1;
+	result.Size = result.Start == NULL ? 0 : vm->StackSize;
+	return result;
+}
+
+//Destroy a VM, releasing its stack and memory block.
+void Dispose_VM(VM* vm)
+{
+	VM_ClearVerification(vm);
+#if VM_PROFILE
+	VM_ClearProfile(vm);
+#endif
+
+	if (vm->Stack != NULL)
 	{
-		*value = (UINT64)ArrayList_RemoveAt(&vm->Stack, vm->Stack.Length - 1);
-		return 1;
+		MemBlock stack = VM_StackBlock(vm);
+		Slab_FreeBlock(&stack);
 	}
-	else
+	if (vm->Calls != NULL) freeany(vm->Calls);
+	if (vm->Locals != NULL) freeany(vm->Locals);
+	if (vm->Memory.Start != NULL) free(&vm->Memory);
+
+	//The last VM that shares code frees it along with its verification and native code.
+	if (vm->Code != NULL && --vm->Code->References == 0)
+	{
+		VMCode* code = vm->Code;
+		vm->Code = NULL;
+
+		vm->Verification = code->Verification;
+		vm->Native = code->Native;
+		vm->NativeBlocks = code->NativeBlocks;
+		VM_ClearVerification(vm);
+
+		free(&code->Memory);
+		Slab_Free(code, sizeof(VMCode));
+	}
+
+	vm->Code = NULL;
+
+	vm->Stack = NULL;
+	vm->StackTop = 0;
+	vm->StackCapacity = 0;
+	vm->StackSize = 0;
+	vm->Calls = NULL;
+	vm->CallTop = 0;
+	vm->Locals = NULL;
+	vm->FrameStart = 0;
+	vm->FrameEnd = 0;
+}
+
+//Set the maximum stack depth of a VM, the stack is never shrunk below its current depth.
+//The capacity is cut down to a lower limit, a higher one is reached by growing the stack.
+void VM_SetStackLimit(VM* vm, UINTN limit)
+{
+	vm->StackLimit = limit < vm->StackTop ? vm->StackTop : limit;
+	if (vm->StackCapacity > vm->StackLimit) vm->StackCapacity = vm->StackLimit;
+}
+
+//Grow the stack geometrically up to its limit, returns 0 if it is already full.
+//Every stack keeps one guard entry in front of its first entry. The stack grows in place when its block
+//has room and only the live entries are copied when it moves, the capacity is the usable size of the block
+//cut down to the limit.
+int VM_GrowStack(VM* vm)
+{
+	if (vm->StackCapacity >= vm->StackLimit) return 0;
+
+	UINTN capacity = vm->StackCapacity == 0 ? VM_STACK_INITIAL : vm->StackCapacity * 2;
+	if (capacity > vm->StackLimit) capacity = vm->StackLimit;
+
+	MemBlock block = VM_StackBlock(vm);
+
+	if (!Slab_Resize(&block, (capacity + 1) * sizeof(UINT64), (vm->StackTop + 1) * sizeof(UINT64))) return 0;
+
+	capacity = (block.Size / sizeof(UINT64)) - 1;
+	if (capacity > vm->StackLimit) capacity = vm->StackLimit;
+
+	vm->Stack = (UINT64*)block.Start + 1;
+	vm->StackCapacity = capacity;
+	vm->StackSize = block.Size;
+	return 1;
+}
+
+//Grow the stack until it holds the specified depth, returns 0 if the limit or memory does not allow it.
+//The unchecked interpreter never grows the stack, so verified code reserves its deepest point up front.
+int VM_ReserveStack(VM* vm, UINTN depth)
+{
+	while (vm->StackCapacity < depth)
+	{
+		if (!VM_GrowStack(vm)) return 0;
+	}
+
+	return vm->Stack != NULL;
+}
+
+//Move the code of a VM that has not run yet into a VMCode that later VMs can share with VM_Spawn. The code must
+//have been verified or rejected so that it no longer changes. The VM continues on a copy of its variables.
+EFI_STATUS VM_Share(VM* vm, UINT64 key)
+{
+	if (vm->Code != NULL) return EFI_SUCCESS;
+	if (vm->Verification.Status == Unverified || vm->Current != vm->Start || vm->StackTop != 0) return EFI_NOT_READY;
+
+	UINTN size = vm->VarCount * sizeof(UINT64);
+	MemBlock variables = { NULL, 0 };
+	VMCode* code = (VMCode*)Slab_Alloc(sizeof(VMCode)).Start;
+
+	if (code != NULL && size > 0) variables = malloc(size);
+
+	if (code == NULL || (size > 0 && variables.Start == NULL))
+	{
+		Slab_Free(code, sizeof(VMCode));
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	if (size > 0) copymem(variables.Start, vm->Variables, size);
+
+	code->Memory = vm->Memory;
+	code->References = 1;
+	code->Key = key;
+	code->Variables = vm->Variables;
+	code->Verification = vm->Verification;
+	code->Native = vm->Native;
+	code->NativeBlocks = vm->NativeBlocks;
+
+	vm->Memory = variables;
+	vm->Code = code;
+	vm->Variables = (UINT64*)variables.Start;
+
+	return EFI_SUCCESS;
+}
+
+//Create another instance of a VM whose code is shared, only its stack and a copy of the initial variables are allocated.
+EFI_STATUS VM_Spawn(VM* parent, UINTN id, VM* result)
+{
+	VMCode* code = parent->Code;
+	UINTN size = parent->VarCount * sizeof(UINT64);
+	MemBlock variables = { NULL, 0 };
+
+	if (code == NULL) return EFI_NOT_READY;
+
+	if (size > 0)
+	{
+		variables = malloc(size);
+		if (variables.Start == NULL) return EFI_OUT_OF_RESOURCES;
+
+		copymem(variables.Start, code->Variables, size);
+	}
+
+	*result = New_VM(variables, id, parent->Priority, (UINT64*)variables.Start, parent->VarCount, parent->Start, parent->Error);
+	result->Code = code;
+	code->References++;
+
+	result->Encoding = parent->Encoding;
+	VM_SetStackLimit(result, parent->StackLimit);
+	result->Verification = code->Verification;
+	result->Native = code->Native;
+	result->NativeBlocks = code->NativeBlocks;
+
+	if (!VM_ReserveStack(result, result->Verification.Status == Verified ? result->Verification.MaxStack : 0))
+	{
+		Dispose_VM(result);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	return EFI_SUCCESS;
+}
+
+//Push a call returning to the specified address and start an empty frame for it, returns 0 if the return stack is full.
+int VM_PushCall(VM* vm, UINT8* address)
+{
+	if (vm->Calls == NULL)
+	{
+		vm->Calls = (VMCall*)malloc(VM_CALL_LIMIT * sizeof(VMCall)).Start;
+		if (vm->Calls == NULL) return 0;
+	}
+
+	if (vm->CallTop == VM_CALL_LIMIT) return 0;
+
+	vm->Calls[vm->CallTop].Return = address;
+	vm->Calls[vm->CallTop].Frame = vm->FrameStart;
+	vm->CallTop++;
+	vm->FrameStart = vm->FrameEnd;
+	return 1;
+}
+
+//Pop the innermost call and release its frame, returns the address to return to or NULL if there is no call.
+UINT8* VM_PopCall(VM* vm)
+{
+	if (vm->CallTop == 0) return NULL;
+
+	vm->CallTop--;
+	vm->FrameEnd = vm->FrameStart;
+	vm->FrameStart = vm->Calls[vm->CallTop].Frame;
+	return vm->Calls[vm->CallTop].Return;
+}
+
+//Add zeroed locals to the current frame, returns 0 if the frame arena is full.
+int VM_Enter(VM* vm, UINT64 count)
+{
+	if (vm->Locals == NULL)
+	{
+		vm->Locals = (UINT64*)malloc(VM_FRAME_LIMIT * sizeof(UINT64)).Start;
+		if (vm->Locals == NULL) return 0;
+	}
+
+	if (count > VM_FRAME_LIMIT - vm->FrameEnd) return 0;
+
+	for (UINT64 i = 0; i < count; i++)
+	{
+		vm->Locals[vm->FrameEnd + i] = 0;
+	}
+
+	vm->FrameEnd += count;
+	return 1;
+}
+
+inline int VM_PushStack(VM* vm, UINT64 operand)
+{
+	if (vm->StackTop == vm->StackCapacity && !VM_GrowStack(vm))
 	{
 		vm->Current = vm->Error;
 		return 0;
 	}
+
+	vm->Stack[vm->StackTop++] = operand;
+	return 1;
 }
 
-void VM_Execute(VM* vm)
+inline int VM_PopStack(VM* vm, UINT64* value)
 {
-	if (!VM_ValidPointer(vm))
+	if (vm->StackTop > 0)
+	{
+		*value = vm->Stack[--vm->StackTop];
+		return 1;
+	}
+	else
 	{
 		vm->Current = vm->Error;
-		return;
+		return 0;
 	}
+}
 
-	UINT8 op = *vm->Current;
-	UINT64 operand = 0;
-	UINT64 value = 0;
-	vm->Current++;
+#include "VMBulk.h"
+
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED_DISPATCH 1
+#else
+#define VM_THREADED_DISPATCH 0
+#endif
+
+//Keep the top of the stack of verified programs in a register, 0 keeps every entry in memory.
+#ifndef VM_CACHE_TOP
+#define VM_CACHE_TOP 1
+#endif
+
+#define VM_DISPATCH_NAME VM_ExecuteChecked
+#define VM_DISPATCH_CHECKED 1
+#define VM_DISPATCH_CACHED 0
+#define VM_DISPATCH_COMPACT 0
+#include "VMDispatch.h"
+
+#define VM_DISPATCH_NAME VM_ExecuteCompact
+#define VM_DISPATCH_CHECKED 1
+#define VM_DISPATCH_CACHED 0
+#define VM_DISPATCH_COMPACT 1
+#include "VMDispatch.h"
+
+#define VM_DISPATCH_NAME VM_ExecuteVerified
+#define VM_DISPATCH_CHECKED 0
+#define VM_DISPATCH_CACHED VM_CACHE_TOP
+#define VM_DISPATCH_COMPACT 0
+#include "VMDispatch.h"
 
-	if (op & IMMEDIATE)
+//Executes up to the specified number of instructions, returning when the budget is exhausted, on BRK, on HLT
+//or after a fault has moved the VM to its error handler. The number of instructions retired is stored in
+//retired if it is not NULL. Programs that passed VM_Verify run without per-instruction bounds and stack checks.
+VMRunReason VM_Run(VM* vm, UINTN maxInstructions, UINTN* retired)
+{
+	if (vm->Verification.Status == Verified)
 	{
-		if (!VM_ValidOperand(vm))
-		{
-			vm->Current = vm->Error;
-			return;
-		}
-
-		operand = *((UINT64*)vm->Current);
-		vm->Current += 8;
+		return VM_ExecuteVerified(vm, maxInstructions, retired);
 	}
-
-	switch (op)
+	else if (vm->Encoding == CompactEncoding)
 	{
-		case HLT:
-			vm->Status = Finished;
-			return;
-		case BRK:
-			vm->Status = Idle;
-			return;
-		case PUSH:
-			VM_PushStack(vm, operand);
-			return;
-		case DUP:
-			if (VM_PopStack(vm, &operand))
-			{
-				VM_PushStack(vm, operand);
-				VM_PushStack(vm, operand);
-			}
-			return;
-		case POP:
-			VM_PopStack(vm, &operand);
-			return;
-		case LDSTACK:
-			VM_PushStack(vm, vm->Stack.Length);
-			return;
-		case LDVAR:
-			if (operand < vm->VarCount)
-			{
-				VM_PushStack(vm, vm->Variables[operand]);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case LDINDVAR:
-			if (operand < vm->VarCount)
-			{
-				VM_PushStack(vm, (UINT64)&vm->Variables[operand]);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case STVAR:
-			if (operand < vm->VarCount && VM_PopStack(vm, &value))
-			{
-				vm->Variables[operand] = value;
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case ADD:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value + operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case SUB:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value - operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case MUL:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value * operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case IMUL:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, (INT64)value * (INT64)operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case DIV:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value / operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case IDIV:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, (INT64)value / (INT64)operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case MOD:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value % operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case IMOD:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, (INT64)value % (INT64)operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case AND:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value & operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case OR:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value | operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case XOR:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value ^ operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case NOT:
-			if (VM_PopStack(vm, &operand))
-			{
-				VM_PushStack(vm, ~operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case EQU:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value == operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case NEQ:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value != operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case ABV:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value > operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case BEL:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, value < operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case GTR:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, (INT64)value > (INT64)operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case LES:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				VM_PushStack(vm, (INT64)value < (INT64)operand);
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case JMP:
-			if (VM_PopStack(vm, &operand))
-			{
-				vm->Current = vm->Current + (INT64)operand;
-
-				if (!VM_ValidPointer(vm))
-				{
-					vm->Current = vm->Error;
-				}
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		case JIF:
-			if (VM_PopStack(vm, &operand) && VM_PopStack(vm, &value))
-			{
-				if (value)
-				{
-					vm->Current = vm->Current + (INT64)operand;
-
-					if (!VM_ValidPointer(vm))
-					{
-						vm->Current = vm->Error;
-					}
-				}
-			}
-			else
-			{
-				vm->Current = vm->Error;
-			}
-			return;
-		default:
-			vm->Current = vm->Error;
-			return;
+		return VM_ExecuteCompact(vm, maxInstructions, retired);
 	}
-}
\ No newline at end of file
+	else
+	{
+		return VM_ExecuteChecked(vm, maxInstructions, retired);
+	}
+}
+
+//Executes up to the specified number of instructions, stopping early if the VM halts, breaks or faults.
+void VM_ExecuteBatch(VM* vm, UINTN count)
+{
+	VM_Run(vm, count, NULL);
+}
+
+//Executes a single instruction.
+void VM_Execute(VM* vm)
+{
+	VM_Run(vm, 1, NULL);
+}
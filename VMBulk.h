@@ -0,0 +1,171 @@
+#pragma once
+
+//Block and lane operations over VM variables, included by VM.h before the interpreter.
+//Block operations over ranges of any length are used by CPYVAR, FILLVAR, CMPVAR, SUMVAR and XORVAR.
+//The caller checks the ranges against VarCount once, these loops never check anything themselves.
+//Copies and comparisons are the memory primitives of stdlib.h, the rest use its vectors of two variables
+//where stdlib.h has them and the scalar loop elsewhere.
+#if MEM_VECTOR && !defined(VM_SCALAR_BULK)
+#define VM_VECTOR_BULK 1
+#else
+#define VM_VECTOR_BULK 0
+#endif
+
+//Copy a range of variables, the ranges may overlap.
+void VM_CopyVariables(UINT64* dest, UINT64* source, UINT64 count)
+{
+	movemem(dest, source, count * sizeof(UINT64));
+}
+
+//Set a range of variables to a value.
+void VM_FillVariables(UINT64* dest, UINT64 value, UINT64 count)
+{
+	UINT64 i = 0;
+
+#if VM_VECTOR_BULK
+	MemVector vector = { value, value };
+
+	for (; i + 4 <= count; i += 4)
+	{
+		Mem_StoreVector((UINT8*)&dest[i], vector);
+		Mem_StoreVector((UINT8*)&dest[i + 2], vector);
+	}
+#endif
+	for (; i < count; i++)
+	{
+		dest[i] = value;
+	}
+}
+
+//Returns 1 if two ranges of variables hold the same values.
+int VM_CompareVariables(UINT64* a, UINT64* b, UINT64 count)
+{
+	return comparemem(a, b, count * sizeof(UINT64)) == 0;
+}
+
+//Add up a range of variables, wrapping like ADD.
+UINT64 VM_SumVariables(UINT64* source, UINT64 count)
+{
+	UINT64 result = 0;
+	UINT64 i = 0;
+
+#if VM_VECTOR_BULK
+	MemVector low = { 0, 0 };
+	MemVector high = { 0, 0 };
+
+	for (; i + 4 <= count; i += 4)
+	{
+		low += Mem_LoadVector((UINT8*)&source[i]);
+		high += Mem_LoadVector((UINT8*)&source[i + 2]);
+	}
+
+	low += high;
+	result = low[0] + low[1];
+#endif
+	for (; i < count; i++)
+	{
+		result += source[i];
+	}
+
+	return result;
+}
+
+//Combine a range of variables with exclusive or.
+UINT64 VM_XorVariables(UINT64* source, UINT64 count)
+{
+	UINT64 result = 0;
+	UINT64 i = 0;
+
+#if VM_VECTOR_BULK
+	MemVector low = { 0, 0 };
+	MemVector high = { 0, 0 };
+
+	for (; i + 4 <= count; i += 4)
+	{
+		low ^= Mem_LoadVector((UINT8*)&source[i]);
+		high ^= Mem_LoadVector((UINT8*)&source[i + 2]);
+	}
+
+	low ^= high;
+	result = low[0] ^ low[1];
+#endif
+	for (; i < count; i++)
+	{
+		result ^= source[i];
+	}
+
+	return result;
+}
+
+//Lane operations work on 2 or 4 consecutive variables at once, used by VADD, VSUB, VAND, VOR, VXOR,
+//VEQU, VMIN and VMAX. Every lane is read before any is written, so the ranges may overlap.
+//VEQU sets a lane to 1 or 0 like EQU, VMIN and VMAX compare unsigned like ABV and BEL.
+#if VM_VECTOR_BULK
+inline MemVector VM_LaneVector(UINT8 op, MemVector a, MemVector b)
+{
+	MemVector mask;
+
+	switch (op)
+	{
+		case VADD: return a + b;
+		case VSUB: return a - b;
+		case VAND: return a & b;
+		case VOR: return a | b;
+		case VXOR: return a ^ b;
+		case VEQU: return -(MemVector)(a == b);
+		case VMIN:
+			mask = (MemVector)(a < b);
+			return (a & mask) | (b & ~mask);
+		case VMAX:
+			mask = (MemVector)(a > b);
+			return (a & mask) | (b & ~mask);
+	}
+
+	return a;
+}
+#else
+inline UINT64 VM_Lane(UINT8 op, UINT64 a, UINT64 b)
+{
+	switch (op)
+	{
+		case VADD: return a + b;
+		case VSUB: return a - b;
+		case VAND: return a & b;
+		case VOR: return a | b;
+		case VXOR: return a ^ b;
+		case VEQU: return a == b;
+		case VMIN: return a < b ? a : b;
+		case VMAX: return a > b ? a : b;
+	}
+
+	return a;
+}
+#endif
+
+//Apply a lane operation to 2 or 4 lanes, dest[i] = a[i] op b[i].
+inline void VM_LaneOperation(UINT8 op, UINT64* dest, UINT64* a, UINT64* b, UINT64 lanes)
+{
+#if VM_VECTOR_BULK
+	MemVector low = VM_LaneVector(op, Mem_LoadVector((UINT8*)a), Mem_LoadVector((UINT8*)b));
+
+	if (lanes == 4)
+	{
+		MemVector high = VM_LaneVector(op, Mem_LoadVector((UINT8*)(a + 2)), Mem_LoadVector((UINT8*)(b + 2)));
+		Mem_StoreVector((UINT8*)(dest + 2), high);
+	}
+
+	Mem_StoreVector((UINT8*)dest, low);
+#else
+	UINT64 result[4];
+
+	for (UINT64 i = 0; i < lanes; i++)
+	{
+		result[i] = VM_Lane(op, a[i], b[i]);
+	}
+
+	for (UINT64 i = 0; i < lanes; i++)
+	{
+		dest[i] = result[i];
+	}
+#endif
+}
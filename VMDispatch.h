@@ -0,0 +1,460 @@
+//Interpreter loop, included by VM.h once for every variant of the dispatcher.
+//VM_DISPATCH_NAME is the name of the generated function, VM_DISPATCH_CHECKED selects whether every
+//instruction validates its pointer, operands and stack, or trusts a program that passed VM_Verify.
+//VM_DISPATCH_CACHED keeps the top of the stack in a local instead of memory, which needs the stack
+//reserved up front and so is only available to the unchecked variant. VM_DISPATCH_COMPACT reads operands
+//in the compact encoding, which is never verified and so is only available to the checked variant.
+
+#if VM_DISPATCH_CACHED && VM_DISPATCH_CHECKED
+#error The checked interpreter cannot cache the top of the stack.
+#endif
+
+#if VM_DISPATCH_COMPACT && !VM_DISPATCH_CHECKED
+#error Compact code is only run by the checked interpreter.
+#endif
+
+//Executes up to the specified number of instructions, stopping early if the VM halts, breaks or faults.
+//With GCC-compatible compilers every handler ends in its own indirect jump through a label table
+//(direct threading), otherwise the same handlers are compiled as the cases of a switch.
+VMRunReason VM_DISPATCH_NAME(VM* vm, UINTN count, UINTN* retired)
+{
+	UINTN budget = count;
+	UINTN fused = 0;
+	VMRunReason reason = Exhausted;
+	UINT8* memStart = (UINT8*)VM_CodeMemory(vm)->Start;
+	UINT8* memEnd = memStart + VM_CodeMemory(vm)->Size;
+	UINT8* ip = vm->Current;
+	UINT64* stack = vm->Stack;
+	UINTN top = vm->StackTop;
+#if !VM_DISPATCH_CACHED
+	UINTN capacity = vm->StackCapacity;
+#endif
+	UINT64 operand;
+	UINT64 value;
+	UINT64 length;
+	UINT64 index;
+	UINT64 left;
+	UINT64 right;
+#if VM_DISPATCH_COMPACT
+	UINTN width;
+#endif
+
+#if VM_DISPATCH_CACHED
+	//The entry below the stack is a guard, so an empty stack can be filled and spilled like any other.
+	UINT64 cached = stack[top - 1];
+#endif
+
+#define VM_FAULT() { ip = vm->Error; reason = Faulted; goto vm_exit; }
+#define VM_CHECK(condition) { if (VM_DISPATCH_CHECKED && !(condition)) VM_FAULT(); }
+#define VM_VALID(pointer) ((pointer) >= memStart && (pointer) < memEnd)
+#if VM_DISPATCH_COMPACT
+#define VM_OPERAND() { width = VM_DecodeCompact(ip + 1, memEnd, &operand); VM_CHECK(width != 0); ip += 1 + width; }
+#else
+#define VM_OPERAND() { VM_CHECK(ip + 9 < memEnd); operand = *((UINT64*)(ip + 1)); ip += 9; }
+#endif
+#define VM_RESERVE() \
+	{ \
+		if (VM_DISPATCH_CHECKED && top == capacity) \
+		{ \
+			vm->StackTop = top; \
+			if (!VM_GrowStack(vm)) VM_FAULT(); \
+			stack = vm->Stack; \
+			capacity = vm->StackCapacity; \
+		} \
+	}
+#if VM_DISPATCH_CACHED
+#define VM_TOP cached
+#define VM_DROP() { top--; cached = stack[top - 1]; }
+#define VM_PUSH(x) { stack[top - 1] = cached; cached = (x); top++; }
+#else
+#define VM_TOP stack[top - 1]
+#define VM_DROP() { top--; }
+#define VM_PUSH(x) { VM_RESERVE(); stack[top] = (x); top++; }
+#endif
+//A binary operation with a single entry on the stack still consumes it before faulting.
+#define VM_REQUIRE(n) { if (VM_DISPATCH_CHECKED && top < (n)) { top = 0; VM_FAULT(); } }
+#define VM_POP(x) { x = VM_TOP; VM_DROP(); }
+//Ranges of variables used by block operations are checked once, in every variant, as they come from the stack.
+#define VM_RANGE(start, length) { if ((length) > vm->VarCount || (start) > vm->VarCount - (length)) VM_FAULT(); }
+//Indexed accesses are checked once against the variables after the base, which the verifier keeps in range.
+#define VM_INDEX(base, index) { if ((index) >= vm->VarCount - (base)) VM_FAULT(); }
+//Lane operation on [dest, a, b] with the number of lanes in the operand, which the verifier keeps at 2 or 4.
+#define VM_LANES(op) \
+	{ \
+		VM_OPERAND(); \
+		VM_CHECK(operand == 2 || operand == 4); \
+		VM_REQUIRE(3); \
+		VM_POP(right); \
+		VM_POP(left); \
+		VM_POP(value); \
+		VM_RANGE(value, operand); \
+		VM_RANGE(left, operand); \
+		VM_RANGE(right, operand); \
+		VM_LaneOperation(op, &vm->Variables[value], &vm->Variables[left], &vm->Variables[right], operand); \
+		VM_DISPATCH(); \
+	}
+#define VM_BINARY(expr) { ip++; VM_REQUIRE(2); operand = VM_TOP; VM_DROP(); value = VM_TOP; VM_TOP = (expr); VM_DISPATCH(); }
+//Comparison; PUSH offset; JIF, only reached by verified code.
+#define VM_COMPARE_JIF(expr) { fused += 2; operand = VM_TOP; VM_DROP(); value = VM_TOP; VM_DROP(); ip += (expr) ? 11 + *((INT64*)(ip + 2)) : 11; VM_DISPATCH(); }
+
+#if VM_THREADED_DISPATCH
+	static void* const dispatch[256] =
+	{
+		[0 ... 255] = &&vm_op_default,
+		[HLT] = &&vm_op_HLT, [BRK] = &&vm_op_BRK,
+		[PUSH] = &&vm_op_PUSH, [DUP] = &&vm_op_DUP, [POP] = &&vm_op_POP, [LDSTACK] = &&vm_op_LDSTACK,
+		[LDVAR] = &&vm_op_LDVAR, [LDINDVAR] = &&vm_op_LDINDVAR, [STVAR] = &&vm_op_STVAR,
+		[LDIDXVAR] = &&vm_op_LDIDXVAR, [STIDXVAR] = &&vm_op_STIDXVAR,
+		[ADD] = &&vm_op_ADD, [SUB] = &&vm_op_SUB, [MUL] = &&vm_op_MUL, [IMUL] = &&vm_op_IMUL,
+		[DIV] = &&vm_op_DIV, [IDIV] = &&vm_op_IDIV, [MOD] = &&vm_op_MOD, [IMOD] = &&vm_op_IMOD,
+		[AND] = &&vm_op_AND, [OR] = &&vm_op_OR, [XOR] = &&vm_op_XOR, [NOT] = &&vm_op_NOT,
+		[EQU] = &&vm_op_EQU, [NEQ] = &&vm_op_NEQ, [ABV] = &&vm_op_ABV, [BEL] = &&vm_op_BEL, [GTR] = &&vm_op_GTR, [LES] = &&vm_op_LES,
+		[JMP] = &&vm_op_JMP, [JIF] = &&vm_op_JIF, [SHL] = &&vm_op_SHL, [SHR] = &&vm_op_SHR,
+		[CPYVAR] = &&vm_op_CPYVAR, [FILLVAR] = &&vm_op_FILLVAR, [CMPVAR] = &&vm_op_CMPVAR, [SUMVAR] = &&vm_op_SUMVAR, [XORVAR] = &&vm_op_XORVAR,
+		[VADD] = &&vm_op_VADD, [VSUB] = &&vm_op_VSUB, [VAND] = &&vm_op_VAND, [VOR] = &&vm_op_VOR,
+		[VXOR] = &&vm_op_VXOR, [VEQU] = &&vm_op_VEQU, [VMIN] = &&vm_op_VMIN, [VMAX] = &&vm_op_VMAX,
+		[CALL] = &&vm_op_CALL, [RET] = &&vm_op_RET, [ENTER] = &&vm_op_ENTER, [LDLOC] = &&vm_op_LDLOC, [STLOC] = &&vm_op_STLOC,
+#if VM_DISPATCH_CHECKED
+		//Superinstructions are run as the original sequence, which is still in place behind the fused opcode.
+		[EQU_JIF] = &&vm_op_EQU, [NEQ_JIF] = &&vm_op_NEQ, [ABV_JIF] = &&vm_op_ABV, [BEL_JIF] = &&vm_op_BEL, [GTR_JIF] = &&vm_op_GTR, [LES_JIF] = &&vm_op_LES,
+		[LDVAR_ADD_STVAR] = &&vm_op_LDVAR, [LDVAR_SUB_STVAR] = &&vm_op_LDVAR, [PUSH_JMP] = &&vm_op_PUSH, [PUSH_JIF] = &&vm_op_PUSH
+#else
+		[EQU_JIF] = &&vm_op_EQU_JIF, [NEQ_JIF] = &&vm_op_NEQ_JIF, [ABV_JIF] = &&vm_op_ABV_JIF, [BEL_JIF] = &&vm_op_BEL_JIF, [GTR_JIF] = &&vm_op_GTR_JIF, [LES_JIF] = &&vm_op_LES_JIF,
+		[LDVAR_ADD_STVAR] = &&vm_op_LDVAR_ADD_STVAR, [LDVAR_SUB_STVAR] = &&vm_op_LDVAR_SUB_STVAR, [PUSH_JMP] = &&vm_op_PUSH_JMP, [PUSH_JIF] = &&vm_op_PUSH_JIF
+#endif
+	};
+
+#define VM_CASE(name) vm_op_##name
+#define VM_DEFAULT vm_op_default
+#define VM_DISPATCH() \
+	{ \
+		if (count == 0) goto vm_exit; \
+		count--; \
+		if (VM_DISPATCH_CHECKED && !VM_VALID(ip)) VM_FAULT(); \
+		VM_PROFILE_FETCH(ip); \
+		goto *dispatch[*ip]; \
+	}
+
+	VM_DISPATCH();
+#else
+#define VM_CASE(name) case name
+#define VM_DEFAULT default
+#define VM_DISPATCH() goto vm_fetch
+
+vm_fetch:
+	if (count == 0) goto vm_exit;
+	count--;
+
+	if (VM_DISPATCH_CHECKED && !VM_VALID(ip)) VM_FAULT();
+	VM_PROFILE_FETCH(ip);
+
+	//Superinstructions are run as the original sequence, which is still in place behind the fused opcode.
+	switch (VM_DISPATCH_CHECKED ? VM_BaseOpcode(*ip) : *ip)
+#endif
+	{
+		VM_CASE(HLT):
+			ip++;
+			vm->Status = Finished;
+			reason = Halted;
+			goto vm_exit;
+		VM_CASE(BRK):
+			ip++;
+			vm->Status = Idle;
+			reason = Broke;
+			goto vm_exit;
+		VM_CASE(PUSH):
+			VM_OPERAND();
+			VM_PUSH(operand);
+			VM_DISPATCH();
+		VM_CASE(DUP):
+			ip++;
+			VM_CHECK(top > 0);
+			value = VM_TOP;
+			VM_PUSH(value);
+			VM_DISPATCH();
+		VM_CASE(POP):
+			ip++;
+			VM_CHECK(top > 0);
+			VM_DROP();
+			VM_DISPATCH();
+		VM_CASE(LDSTACK):
+			ip++;
+			VM_PUSH(top);
+			VM_DISPATCH();
+		VM_CASE(LDVAR):
+			VM_OPERAND();
+			VM_CHECK(operand < vm->VarCount);
+			VM_PUSH(vm->Variables[operand]);
+			VM_DISPATCH();
+		VM_CASE(LDINDVAR):
+			VM_OPERAND();
+			VM_CHECK(operand < vm->VarCount);
+			VM_PUSH((UINT64)&vm->Variables[operand]);
+			VM_DISPATCH();
+		VM_CASE(STVAR):
+			VM_OPERAND();
+			VM_CHECK(operand < vm->VarCount && top > 0);
+			vm->Variables[operand] = VM_TOP;
+			VM_DROP();
+			VM_DISPATCH();
+		//Base variable in the operand, index on the stack; the index is consumed before faulting.
+		VM_CASE(LDIDXVAR):
+			VM_OPERAND();
+			VM_CHECK(operand < vm->VarCount && top > 0);
+			index = VM_TOP;
+			if (index >= vm->VarCount - operand)
+			{
+				VM_DROP();
+				VM_FAULT();
+			}
+			VM_TOP = vm->Variables[operand + index];
+			VM_DISPATCH();
+		//Index below the value to store.
+		VM_CASE(STIDXVAR):
+			VM_OPERAND();
+			VM_CHECK(operand < vm->VarCount);
+			VM_REQUIRE(2);
+			VM_POP(value);
+			VM_POP(index);
+			VM_INDEX(operand, index);
+			vm->Variables[operand + index] = value;
+			VM_DISPATCH();
+		VM_CASE(ADD):
+			VM_BINARY(value + operand);
+		VM_CASE(SUB):
+			VM_BINARY(value - operand);
+		VM_CASE(MUL):
+			VM_BINARY(value * operand);
+		VM_CASE(IMUL):
+			VM_BINARY((INT64)value * (INT64)operand);
+		VM_CASE(DIV):
+			VM_BINARY(value / operand);
+		VM_CASE(IDIV):
+			VM_BINARY((INT64)value / (INT64)operand);
+		VM_CASE(MOD):
+			VM_BINARY(value % operand);
+		VM_CASE(IMOD):
+			VM_BINARY((INT64)value % (INT64)operand);
+		VM_CASE(AND):
+			VM_BINARY(value & operand);
+		VM_CASE(OR):
+			VM_BINARY(value | operand);
+		VM_CASE(XOR):
+			VM_BINARY(value ^ operand);
+		//Shift counts wrap at 64 like they do on x86.
+		VM_CASE(SHL):
+			VM_BINARY(value << (operand & 63));
+		VM_CASE(SHR):
+			VM_BINARY(value >> (operand & 63));
+		VM_CASE(NOT):
+			ip++;
+			VM_CHECK(top > 0);
+			VM_TOP = ~VM_TOP;
+			VM_DISPATCH();
+		VM_CASE(EQU):
+			VM_BINARY(value == operand);
+		VM_CASE(NEQ):
+			VM_BINARY(value != operand);
+		VM_CASE(ABV):
+			VM_BINARY(value > operand);
+		VM_CASE(BEL):
+			VM_BINARY(value < operand);
+		VM_CASE(GTR):
+			VM_BINARY((INT64)value > (INT64)operand);
+		VM_CASE(LES):
+			VM_BINARY((INT64)value < (INT64)operand);
+		VM_CASE(JMP):
+			ip++;
+			VM_CHECK(top > 0);
+			ip += (INT64)VM_TOP;
+			VM_DROP();
+			VM_CHECK(VM_VALID(ip));
+			VM_DISPATCH();
+		VM_CASE(JIF):
+			ip++;
+			VM_REQUIRE(2);
+			operand = VM_TOP;
+			VM_DROP();
+			value = VM_TOP;
+			VM_DROP();
+			VM_PROFILE_BRANCH(ip - 1, value != 0);
+			if (value)
+			{
+				ip += (INT64)operand;
+				VM_CHECK(VM_VALID(ip));
+			}
+			VM_DISPATCH();
+		//Calls take their offset from the stack like JMP. The depth of the return stack and the size of the
+		//frame arena are checked in every variant, the verifier keeps local indices inside the frame.
+		VM_CASE(CALL):
+			ip++;
+			VM_CHECK(top > 0);
+			VM_POP(operand);
+			if (!VM_PushCall(vm, ip)) VM_FAULT();
+			ip += (INT64)operand;
+			VM_CHECK(VM_VALID(ip));
+			VM_DISPATCH();
+		VM_CASE(RET):
+			ip = VM_PopCall(vm);
+			if (ip == NULL) VM_FAULT();
+			VM_DISPATCH();
+		VM_CASE(ENTER):
+			VM_OPERAND();
+			if (!VM_Enter(vm, operand)) VM_FAULT();
+			VM_DISPATCH();
+		VM_CASE(LDLOC):
+			VM_OPERAND();
+			VM_CHECK(operand < vm->FrameEnd - vm->FrameStart);
+			VM_PUSH(vm->Locals[vm->FrameStart + operand]);
+			VM_DISPATCH();
+		VM_CASE(STLOC):
+			VM_OPERAND();
+			VM_CHECK(operand < vm->FrameEnd - vm->FrameStart && top > 0);
+			vm->Locals[vm->FrameStart + operand] = VM_TOP;
+			VM_DROP();
+			VM_DISPATCH();
+		//Block operations take their count from the top of the stack and consume every operand before faulting.
+		VM_CASE(CPYVAR):
+			ip++;
+			VM_REQUIRE(3);
+			VM_POP(length);
+			VM_POP(operand);
+			VM_POP(value);
+			VM_RANGE(value, length);
+			VM_RANGE(operand, length);
+			VM_CopyVariables(&vm->Variables[value], &vm->Variables[operand], length);
+			VM_DISPATCH();
+		VM_CASE(FILLVAR):
+			ip++;
+			VM_REQUIRE(3);
+			VM_POP(length);
+			VM_POP(operand);
+			VM_POP(value);
+			VM_RANGE(value, length);
+			VM_FillVariables(&vm->Variables[value], operand, length);
+			VM_DISPATCH();
+		VM_CASE(CMPVAR):
+			ip++;
+			VM_REQUIRE(3);
+			VM_POP(length);
+			VM_POP(operand);
+			VM_POP(value);
+			VM_RANGE(value, length);
+			VM_RANGE(operand, length);
+			VM_PUSH(VM_CompareVariables(&vm->Variables[value], &vm->Variables[operand], length));
+			VM_DISPATCH();
+		VM_CASE(SUMVAR):
+			ip++;
+			VM_REQUIRE(2);
+			VM_POP(length);
+			VM_POP(value);
+			VM_RANGE(value, length);
+			VM_PUSH(VM_SumVariables(&vm->Variables[value], length));
+			VM_DISPATCH();
+		VM_CASE(XORVAR):
+			ip++;
+			VM_REQUIRE(2);
+			VM_POP(length);
+			VM_POP(value);
+			VM_RANGE(value, length);
+			VM_PUSH(VM_XorVariables(&vm->Variables[value], length));
+			VM_DISPATCH();
+		VM_CASE(VADD):
+			VM_LANES(VADD);
+		VM_CASE(VSUB):
+			VM_LANES(VSUB);
+		VM_CASE(VAND):
+			VM_LANES(VAND);
+		VM_CASE(VOR):
+			VM_LANES(VOR);
+		VM_CASE(VXOR):
+			VM_LANES(VXOR);
+		VM_CASE(VEQU):
+			VM_LANES(VEQU);
+		VM_CASE(VMIN):
+			VM_LANES(VMIN);
+		VM_CASE(VMAX):
+			VM_LANES(VMAX);
+#if !VM_DISPATCH_CHECKED
+		VM_CASE(LDVAR_ADD_STVAR):
+			vm->Variables[*((UINT64*)(ip + 20))] = vm->Variables[*((UINT64*)(ip + 1))] + *((UINT64*)(ip + 10));
+			ip += 28;
+			fused += 3;
+			VM_DISPATCH();
+		VM_CASE(LDVAR_SUB_STVAR):
+			vm->Variables[*((UINT64*)(ip + 20))] = vm->Variables[*((UINT64*)(ip + 1))] - *((UINT64*)(ip + 10));
+			ip += 28;
+			fused += 3;
+			VM_DISPATCH();
+		VM_CASE(PUSH_JMP):
+			ip += 10 + *((INT64*)(ip + 1));
+			fused++;
+			VM_DISPATCH();
+		VM_CASE(PUSH_JIF):
+			value = VM_TOP;
+			VM_DROP();
+			ip += value ? 10 + *((INT64*)(ip + 1)) : 10;
+			fused++;
+			VM_DISPATCH();
+		VM_CASE(EQU_JIF):
+			VM_COMPARE_JIF(value == operand);
+		VM_CASE(NEQ_JIF):
+			VM_COMPARE_JIF(value != operand);
+		VM_CASE(ABV_JIF):
+			VM_COMPARE_JIF(value > operand);
+		VM_CASE(BEL_JIF):
+			VM_COMPARE_JIF(value < operand);
+		VM_CASE(GTR_JIF):
+			VM_COMPARE_JIF((INT64)value > (INT64)operand);
+		VM_CASE(LES_JIF):
+			VM_COMPARE_JIF((INT64)value < (INT64)operand);
+#endif
+		VM_DEFAULT:
+			VM_FAULT();
+	}
+
+vm_exit:
+#if VM_DISPATCH_CACHED
+	stack[top - 1] = cached;
+#endif
+	vm->Current = ip;
+	vm->StackTop = top;
+
+#if !VM_DISPATCH_CHECKED
+	//The error handler is never verified, so a VM that faulted carries on in the checked interpreter.
+	if (reason == Faulted)
+	{
+		VM_ClearVerification(vm);
+		vm->Verification.Status = Rejected;
+	}
+#endif
+
+	//A superinstruction is charged to the budget once but retires every instruction it stands for.
+	if (retired != NULL) *retired = budget - count + fused;
+
+	return reason;
+
+#undef VM_FAULT
+#undef VM_CHECK
+#undef VM_VALID
+#undef VM_OPERAND
+#undef VM_RESERVE
+#undef VM_TOP
+#undef VM_DROP
+#undef VM_PUSH
+#undef VM_REQUIRE
+#undef VM_POP
+#undef VM_RANGE
+#undef VM_INDEX
+#undef VM_LANES
+#undef VM_BINARY
+#undef VM_COMPARE_JIF
+#undef VM_CASE
+#undef VM_DEFAULT
+#undef VM_DISPATCH
+}
+
+#undef VM_DISPATCH_NAME
+#undef VM_DISPATCH_CHECKED
+#undef VM_DISPATCH_CACHED
+#undef VM_DISPATCH_COMPACT
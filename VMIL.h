@@ -1,6 +1,8 @@
 #pragma once
 #include "VM.h"
+#include "Optimizer.h"
 #include "File.h"
+#include "Image.h"
 
 typedef struct
 {
@@ -12,7 +14,7 @@ EFI_STATUS VMIL_FromInstruction(UINT8* data, UINT64* position, UINT64 length, VM
 {
 	if (*position >= length) return EFI_INVALID_PARAMETER;
 
-	data[*(position++)] = inst.Operation;
+	data[(*position)++] = inst.Operation;
 
 	if (inst.Operation & IMMEDIATE)
 	{
@@ -30,6 +32,26 @@ EFI_STATUS VMIL_FromInstruction(UINT8* data, UINT64* position, UINT64 length, VM
 	return EFI_SUCCESS;
 }
 
+//Encode an instruction, a compact operand is padded so that the instruction takes at least size bytes.
+EFI_STATUS VMIL_Encode(UINT8* data, UINT64* position, UINT64 length, VMInstruction inst, VMEncoding encoding, UINT64 size)
+{
+	if (*position >= length) return EFI_INVALID_PARAMETER;
+
+	if (encoding == CompactEncoding && (inst.Operation & IMMEDIATE))
+	{
+		UINT64 width = VM_CompactSize(inst.Operand);
+		if (size > width + 1) width = size - 1;
+
+		if ((*position + 1 + width) > length) return EFI_INVALID_PARAMETER;
+
+		data[(*position)++] = inst.Operation;
+		*position += VM_EncodeCompact(&data[*position], inst.Operand, (UINTN)width);
+		return EFI_SUCCESS;
+	}
+
+	return VMIL_FromInstruction(data, position, length, inst);
+}
+
 EFI_STATUS VMIL_OpcodeFromString(CHAR16* buffer, UINT64 bufferSize, UINT8* result)
 {
 	if (!StrnCmp(L"HLT", buffer, bufferSize))
@@ -68,6 +90,14 @@ EFI_STATUS VMIL_OpcodeFromString(CHAR16* buffer, UINT64 bufferSize, UINT8* resul
 	{
 		*result = STVAR;
 	}
+	else if (!StrnCmp(L"LDIDXVAR", buffer, bufferSize))
+	{
+		*result = LDIDXVAR;
+	}
+	else if (!StrnCmp(L"STIDXVAR", buffer, bufferSize))
+	{
+		*result = STIDXVAR;
+	}
 	else if (!StrnCmp(L"ADD", buffer, bufferSize))
 	{
 		*result = ADD;
@@ -148,6 +178,86 @@ EFI_STATUS VMIL_OpcodeFromString(CHAR16* buffer, UINT64 bufferSize, UINT8* resul
 	{
 		*result = JIF;
 	}
+	else if (!StrnCmp(L"SHL", buffer, bufferSize))
+	{
+		*result = SHL;
+	}
+	else if (!StrnCmp(L"SHR", buffer, bufferSize))
+	{
+		*result = SHR;
+	}
+	else if (!StrnCmp(L"CPYVAR", buffer, bufferSize))
+	{
+		*result = CPYVAR;
+	}
+	else if (!StrnCmp(L"FILLVAR", buffer, bufferSize))
+	{
+		*result = FILLVAR;
+	}
+	else if (!StrnCmp(L"CMPVAR", buffer, bufferSize))
+	{
+		*result = CMPVAR;
+	}
+	else if (!StrnCmp(L"SUMVAR", buffer, bufferSize))
+	{
+		*result = SUMVAR;
+	}
+	else if (!StrnCmp(L"XORVAR", buffer, bufferSize))
+	{
+		*result = XORVAR;
+	}
+	else if (!StrnCmp(L"VADD", buffer, bufferSize))
+	{
+		*result = VADD;
+	}
+	else if (!StrnCmp(L"VSUB", buffer, bufferSize))
+	{
+		*result = VSUB;
+	}
+	else if (!StrnCmp(L"VAND", buffer, bufferSize))
+	{
+		*result = VAND;
+	}
+	else if (!StrnCmp(L"VOR", buffer, bufferSize))
+	{
+		*result = VOR;
+	}
+	else if (!StrnCmp(L"VXOR", buffer, bufferSize))
+	{
+		*result = VXOR;
+	}
+	else if (!StrnCmp(L"VEQU", buffer, bufferSize))
+	{
+		*result = VEQU;
+	}
+	else if (!StrnCmp(L"VMIN", buffer, bufferSize))
+	{
+		*result = VMIN;
+	}
+	else if (!StrnCmp(L"VMAX", buffer, bufferSize))
+	{
+		*result = VMAX;
+	}
+	else if (!StrnCmp(L"CALL", buffer, bufferSize))
+	{
+		*result = CALL;
+	}
+	else if (!StrnCmp(L"RET", buffer, bufferSize))
+	{
+		*result = RET;
+	}
+	else if (!StrnCmp(L"ENTER", buffer, bufferSize))
+	{
+		*result = ENTER;
+	}
+	else if (!StrnCmp(L"LDLOC", buffer, bufferSize))
+	{
+		*result = LDLOC;
+	}
+	else if (!StrnCmp(L"STLOC", buffer, bufferSize))
+	{
+		*result = STLOC;
+	}
 	else
 	{
 		return EFI_INVALID_PARAMETER;
@@ -184,19 +294,18 @@ EFI_STATUS VMIL_IntFromString(CHAR16* buffer, UINT64 bufferSize, UINT64* result)
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS VMIL_FromStringLine(UINT8* data, UINT64* position, UINT64 length, CHAR16* buffer, UINT64 bufferSize)
+EFI_STATUS VMIL_ParseLine(CHAR16* buffer, UINT64 bufferSize, VMInstruction* result)
 {
-	if (*position >= length) return EFI_INVALID_PARAMETER;
-
 	int state = 0;
 	UINT64 opcodeStart = 0;
 	UINT64 opcodeLength = 0;
 	UINT64 operandStart = 0;
 	UINT64 operandLength = 0;
 
-	for (UINT64 i = 0; i < bufferSize; i++)
+	//The end of the buffer ends the line like a terminator does, and a comment runs from ';' to the end of the line.
+	for (UINT64 i = 0; i <= bufferSize; i++)
 	{
-		if (buffer[i] == 0)
+		if (i == bufferSize || buffer[i] == 0 || buffer[i] == L';')
 		{
 			if (state == 1)
 			{
@@ -245,148 +354,271 @@ EFI_STATUS VMIL_FromStringLine(UINT8* data, UINT64* position, UINT64 length, CHA
 		}
 	}
 
-	VMInstruction result;
+	//Lines with nothing but blanks and comments hold no instruction.
+	if (opcodeLength == 0) return EFI_NOT_FOUND;
 
-	EFI_STATUS status = VMIL_OpcodeFromString(&buffer[opcodeStart], opcodeLength, &result.Operation);
+	EFI_STATUS status = VMIL_OpcodeFromString(&buffer[opcodeStart], opcodeLength, &result->Operation);
 
 	if (EFI_ERROR(status)) return status;
 
-	if (result.Operation & IMMEDIATE)
+	result->Operand = 0;
+
+	if (result->Operation & IMMEDIATE)
 	{
 		if (operandLength == 0) return EFI_INVALID_PARAMETER;
 
-		status = VMIL_IntFromString(&buffer[operandStart], operandLength, &result.Operand);
+		status = VMIL_IntFromString(&buffer[operandStart], operandLength, &result->Operand);
 
 		if (EFI_ERROR(status)) return status;
 	}
 
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS VMIL_FromStringLine(UINT8* data, UINT64* position, UINT64 length, CHAR16* buffer, UINT64 bufferSize)
+{
+	if (*position >= length) return EFI_INVALID_PARAMETER;
+
+	VMInstruction result;
+
+	EFI_STATUS status = VMIL_ParseLine(buffer, bufferSize, &result);
+
+	if (EFI_ERROR(status)) return status;
+
 	return VMIL_FromInstruction(data, position, length, result);
 }
 
-EFI_STATUS VMIL_FromString(UINT8* data, UINT64* position, UINT64 length, CHAR16* buffer, UINT64 bufferSize, UINT64* errorStart, UINT64* errorLength)
+//Assemble every line of the source in the specified encoding, running the optimizer between parsing and emission.
+//handler is the position of the error handler in the code as written, or NULL if there is none,
+//and is updated to its position in the emitted code. Offsets in the source are always written for the wide
+//encoding, so a program the optimizer does not understand cannot be assembled compact.
+EFI_STATUS VMIL_FromString(UINT8* data, UINT64* position, UINT64 length, CHAR16* buffer, UINT64 bufferSize, UINT64* errorStart, UINT64* errorLength, UINT64* handler, VMEncoding encoding)
 {
-	UINT64 lineStart = 0;
+	UINT64 lines = 1;
 
 	for (UINT64 i = 0; i < bufferSize; i++)
 	{
-		if (buffer[i] == '\n' || buffer[i] == 0)
+		if (buffer[i] == '\n') lines++;
+	}
+
+	OptimizerInstruction* code = (OptimizerInstruction*)malloc(lines * sizeof(OptimizerInstruction)).Start;
+	if (code == NULL) return EFI_OUT_OF_RESOURCES;
+
+	UINTN count = 0;
+	UINT64 lineStart = 0;
+
+	//The last line does not need a terminator.
+	for (UINT64 i = 0; i <= bufferSize; i++)
+	{
+		if (i == bufferSize || buffer[i] == '\n' || buffer[i] == 0)
 		{
 			UINT64 lineLength = i - lineStart;
 
 			if (lineLength != 0)
 			{
-				EFI_STATUS status = VMIL_FromStringLine(data, position, length, &buffer[lineStart], lineLength);
+				VMInstruction inst;
+				EFI_STATUS status = VMIL_ParseLine(&buffer[lineStart], lineLength, &inst);
 
-				if (EFI_ERROR(status))
+				if (EFI_ERROR(status) && status != EFI_NOT_FOUND)
 				{
 					*errorStart = lineStart;
 					*errorLength = lineLength;
+					freeany(code);
 					return status;
 				}
+
+				if (!EFI_ERROR(status))
+				{
+					code[count].Operation = inst.Operation;
+					code[count].Operand = inst.Operand;
+					code[count].Source = lineStart;
+					code[count].SourceLength = lineLength;
+					count++;
+				}
 			}
 
 			lineStart = i + 1;
 		}
 	}
 
-	return EFI_SUCCESS;
+	//Programs the optimizer does not understand are emitted as written.
+	EFI_STATUS status = Optimizer_Run(code, count, handler, encoding);
+	if (status == EFI_OUT_OF_RESOURCES || (EFI_ERROR(status) && encoding == CompactEncoding))
+	{
+		*errorStart = 0;
+		*errorLength = 0;
+		freeany(code);
+		return status;
+	}
+
+	status = EFI_SUCCESS;
+
+	for (UINTN i = 0; i < count && !EFI_ERROR(status); i++)
+	{
+		if (code[i].Flags & OPTIMIZER_REMOVED) continue;
+
+		VMInstruction inst;
+		inst.Operation = code[i].Operation;
+		inst.Operand = code[i].Operand;
+
+		status = VMIL_Encode(data, position, length, inst, encoding, code[i].Size);
+
+		if (EFI_ERROR(status))
+		{
+			*errorStart = code[i].Source;
+			*errorLength = code[i].SourceLength;
+		}
+	}
+
+	freeany(code);
+	return status;
 }
 
-EFI_STATUS VMIL_Load(EFI_FILE* source, UINTN id, VM* result)
+//Largest single read issued while loading, so firmware is never asked for one huge transfer.
+#define VMIL_READ_CHUNK 0x100000
+
+//Size of the read-ahead buffer used to stream an image whose size the file system does not report.
+#define VMIL_READ_AHEAD 0x10000
+
+//Get the number of bytes left from the current position of a file, fails if the file system does not report its size.
+EFI_STATUS VMIL_Remaining(EFI_FILE* source, UINT64* result)
 {
-	EFI_STATUS status;
+	UINT64 info[1024 / sizeof(UINT64)];
+	UINTN size = sizeof(info);
+	UINT64 position;
 
-	UINTN size;
+	EFI_STATUS status = source->GetInfo(source, &gEfiFileInfoGuid, &size, info);
+	if (EFI_ERROR(status)) return status;
 
-	UINT64 length;
-	size = sizeof(length);
-	status = source->Read(source, &size, &length);
+	status = source->GetPosition(source, &position);
 	if (EFI_ERROR(status)) return status;
-	else if (size != sizeof(length)) return EFI_END_OF_FILE;
 
-	MemBlock mem = malloc(length);
-	if (mem.Size == 0) return EFI_OUT_OF_RESOURCES;
+	UINT64 fileSize = ((EFI_FILE_INFO*)info)->FileSize;
+	if (fileSize < position) return EFI_UNSUPPORTED;
 
-	UINT64 vars;
-	size = sizeof(vars);
-	status = source->Read(source, &size, &vars);
-	if (EFI_ERROR(status))
-	{
-		free(&mem);
-		return status;
-	}
-	else if (size != sizeof(vars))
-	{
-		free(&mem);
-		return EFI_END_OF_FILE;
-	}
-	else if ((vars * sizeof(UINT64)) > length)
-	{
-		free(&mem);
-		return EFI_BAD_BUFFER_SIZE;
-	}
+	*result = fileSize - position;
+	return EFI_SUCCESS;
+}
 
-	UINT64 error;
-	size = sizeof(error);
-	status = source->Read(source, &size, &error);
-	if (EFI_ERROR(status))
-	{
-		free(&mem);
-		return status;
-	}
-	else if (size != sizeof(error))
-	{
-		free(&mem);
-		return EFI_END_OF_FILE;
-	}
-	else if ((vars * sizeof(UINT64)) + error >= length)
+//Read the specified number of bytes straight into memory in reads of at most VMIL_READ_CHUNK bytes.
+EFI_STATUS VMIL_ReadBulk(EFI_FILE* source, UINT8* target, UINT64 length)
+{
+	while (length > 0)
 	{
-		free(&mem);
-		return EFI_BAD_BUFFER_SIZE;
-	}
+		UINTN size = length < VMIL_READ_CHUNK ? (UINTN)length : VMIL_READ_CHUNK;
 
-	UINT8* entry = (UINT8*)mem.Start + (vars * sizeof(UINT64));
+		EFI_STATUS status = source->Read(source, &size, target);
+		if (EFI_ERROR(status)) return status;
+		else if (size == 0) return EFI_END_OF_FILE;
 
-	if (entry < (UINT8*)mem.Start || ((UINT8*)mem.Start + length) <= entry)
-	{
-		free(&mem);
-		return EFI_BAD_BUFFER_SIZE;
+		target += size;
+		length -= size;
 	}
 
-	*result = New_VM(mem, id, 1, (UINT64*)mem.Start, vars, entry, entry + error);
+	return EFI_SUCCESS;
+}
+
+//Read the rest of a file of unknown size through a read-ahead buffer, fails if it holds more than capacity bytes.
+//The buffer is allocated from the scratch arena if one is specified.
+EFI_STATUS VMIL_ReadStream(EFI_FILE* source, UINT8* target, UINT64 capacity, Arena* scratch)
+{
+	MemBlock buffer = scratch != NULL ? Arena_Alloc(scratch, VMIL_READ_AHEAD, 0) : malloc(VMIL_READ_AHEAD);
+	if (buffer.Start == NULL) return EFI_OUT_OF_RESOURCES;
+
+	EFI_STATUS status;
 
-	UINT8* target = entry;
 	while (1)
 	{
-		if (target < (UINT8*)mem.Start || ((UINT8*)mem.Start + length) <= target)
+		UINTN size = VMIL_READ_AHEAD;
+		status = source->Read(source, &size, buffer.Start);
+		if (EFI_ERROR(status) || size == 0) break;
+
+		if (size > capacity)
 		{
-			free(&mem);
-			return EFI_BAD_BUFFER_SIZE;
+			status = EFI_BAD_BUFFER_SIZE;
+			break;
 		}
 
-		UINT8 value;
-		size = sizeof(value);
-		status = source->Read(source, &size, &value);
-		if (EFI_ERROR(status) || size != sizeof(value)) break;
+		copymem(target, buffer.Start, size);
+		target += size;
+		capacity -= size;
+	}
 
-		*target = value;
+	if (scratch == NULL) free(&buffer);
+	return status;
+}
 
-		target++;
+//Load an image in the format of Image.h, or a raw image, which is the length of the memory of the VM,
+//the number of variables and the offset of the error handler as UINT64s followed by wide code.
+//The code is read in bulk when the size of the file is known and streamed otherwise, temporary buffers come
+//from the scratch arena if one is specified.
+EFI_STATUS VMIL_Load(EFI_FILE* source, UINTN id, Arena* scratch, VM* result)
+{
+	EFI_STATUS status;
+
+	UINT64 header[3];
+	UINTN size = sizeof(header[0]);
+	status = source->Read(source, &size, header);
+	if (EFI_ERROR(status)) return status;
+	else if (size != sizeof(header[0])) return EFI_END_OF_FILE;
+
+	if (header[0] == VM_IMAGE_MAGIC) return VMImage_Load(source, id, result);
+
+	size = sizeof(header) - sizeof(header[0]);
+	status = source->Read(source, &size, &header[1]);
+	if (EFI_ERROR(status)) return status;
+	else if (size != sizeof(header) - sizeof(header[0])) return EFI_END_OF_FILE;
+
+	UINT64 length = header[0];
+	UINT64 vars = header[1];
+	UINT64 error = header[2];
+
+	if (vars > length / sizeof(UINT64) || error >= length - (vars * sizeof(UINT64))) return EFI_BAD_BUFFER_SIZE;
+
+	UINT64 capacity = length - (vars * sizeof(UINT64));
+	UINT64 remaining;
+
+	//A file that is known to hold too much code is rejected before its memory is allocated.
+	int known = !EFI_ERROR(VMIL_Remaining(source, &remaining));
+	if (known && remaining > capacity) return EFI_BAD_BUFFER_SIZE;
+
+	MemBlock mem = malloc(length);
+	if (mem.Size == 0) return EFI_OUT_OF_RESOURCES;
+
+	UINT8* entry = (UINT8*)mem.Start + (vars * sizeof(UINT64));
+
+	if (known) status = VMIL_ReadBulk(source, entry, remaining);
+	else status = VMIL_ReadStream(source, entry, capacity, scratch);
+
+	if (EFI_ERROR(status))
+	{
+		free(&mem);
+		return status;
 	}
 
+	*result = New_VM(mem, id, 1, (UINT64*)mem.Start, vars, entry, entry + error);
+
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS VMIL_ToString(UINT8* data, UINT64* position, UINT64 length, CHAR16* buffer, UINTN bufferSize)
+EFI_STATUS VMIL_ToString(UINT8* data, UINT64* position, UINT64 length, CHAR16* buffer, UINTN bufferSize, VMEncoding encoding)
 {
 	if (bufferSize < 32) return EFI_BAD_BUFFER_SIZE;
 
 	if (*position >= length) return EFI_INVALID_PARAMETER;
 
-	UINT8 op = data[*(position++)];
+	//Superinstructions are shown as the opcode they were fused from, the rest of the sequence follows unchanged.
+	UINT8 op = VM_BaseOpcode(data[(*position)++]);
 	UINT64 operand = 0;
 
-	if (op & IMMEDIATE)
+	if ((op & IMMEDIATE) && encoding == CompactEncoding)
+	{
+		UINTN width = VM_DecodeCompact(&data[*position], data + length, &operand);
+		if (width == 0) return EFI_INVALID_PARAMETER;
+
+		*position += width;
+	}
+	else if (op & IMMEDIATE)
 	{
 		if ((*position + 8) > length)
 		{
@@ -428,6 +660,12 @@ EFI_STATUS VMIL_ToString(UINT8* data, UINT64* position, UINT64 length, CHAR16* b
 		case STVAR:
 			SPrint(buffer, bufferSize, L"STVAR %d", operand);
 			return EFI_SUCCESS;
+		case LDIDXVAR:
+			SPrint(buffer, bufferSize, L"LDIDXVAR %d", operand);
+			return EFI_SUCCESS;
+		case STIDXVAR:
+			SPrint(buffer, bufferSize, L"STIDXVAR %d", operand);
+			return EFI_SUCCESS;
 		case ADD:
 			StrCpy(buffer, L"ADD");
 			return EFI_SUCCESS;
@@ -488,6 +726,66 @@ EFI_STATUS VMIL_ToString(UINT8* data, UINT64* position, UINT64 length, CHAR16* b
 		case JIF:
 			StrCpy(buffer, L"JIF");
 			return EFI_SUCCESS;
+		case SHL:
+			StrCpy(buffer, L"SHL");
+			return EFI_SUCCESS;
+		case SHR:
+			StrCpy(buffer, L"SHR");
+			return EFI_SUCCESS;
+		case CPYVAR:
+			StrCpy(buffer, L"CPYVAR");
+			return EFI_SUCCESS;
+		case FILLVAR:
+			StrCpy(buffer, L"FILLVAR");
+			return EFI_SUCCESS;
+		case CMPVAR:
+			StrCpy(buffer, L"CMPVAR");
+			return EFI_SUCCESS;
+		case SUMVAR:
+			StrCpy(buffer, L"SUMVAR");
+			return EFI_SUCCESS;
+		case XORVAR:
+			StrCpy(buffer, L"XORVAR");
+			return EFI_SUCCESS;
+		case VADD:
+			SPrint(buffer, bufferSize, L"VADD %d", operand);
+			return EFI_SUCCESS;
+		case VSUB:
+			SPrint(buffer, bufferSize, L"VSUB %d", operand);
+			return EFI_SUCCESS;
+		case VAND:
+			SPrint(buffer, bufferSize, L"VAND %d", operand);
+			return EFI_SUCCESS;
+		case VOR:
+			SPrint(buffer, bufferSize, L"VOR %d", operand);
+			return EFI_SUCCESS;
+		case VXOR:
+			SPrint(buffer, bufferSize, L"VXOR %d", operand);
+			return EFI_SUCCESS;
+		case VEQU:
+			SPrint(buffer, bufferSize, L"VEQU %d", operand);
+			return EFI_SUCCESS;
+		case VMIN:
+			SPrint(buffer, bufferSize, L"VMIN %d", operand);
+			return EFI_SUCCESS;
+		case VMAX:
+			SPrint(buffer, bufferSize, L"VMAX %d", operand);
+			return EFI_SUCCESS;
+		case CALL:
+			StrCpy(buffer, L"CALL");
+			return EFI_SUCCESS;
+		case RET:
+			StrCpy(buffer, L"RET");
+			return EFI_SUCCESS;
+		case ENTER:
+			SPrint(buffer, bufferSize, L"ENTER %d", operand);
+			return EFI_SUCCESS;
+		case LDLOC:
+			SPrint(buffer, bufferSize, L"LDLOC %d", operand);
+			return EFI_SUCCESS;
+		case STLOC:
+			SPrint(buffer, bufferSize, L"STLOC %d", operand);
+			return EFI_SUCCESS;
 	}
 
 	return EFI_LOAD_ERROR;
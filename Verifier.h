@@ -0,0 +1,563 @@
+#pragma once
+#include "VM.h"
+
+//Flags recorded by the verifier for every byte of code.
+#define VM_CODE_INSTRUCTION	0x01
+#define VM_CODE_OPERAND		0x02
+#define VM_CODE_LEADER		0x04
+#define VM_CODE_VISITED		0x08
+
+//Marks an offset whose top of stack is not a known constant.
+#define VM_VERIFY_UNKNOWN	0xFFFFFFFF
+
+//Returns the number of entries an opcode pops and pushes, or 0 if the opcode is unknown.
+int VM_StackEffect(UINT8 op, UINTN* pops, UINTN* pushes)
+{
+	switch (op)
+	{
+		case HLT:
+		case BRK:
+		case RET:
+		case ENTER:
+			*pops = 0;
+			*pushes = 0;
+			return 1;
+		case PUSH:
+		case LDSTACK:
+		case LDVAR:
+		case LDINDVAR:
+		case LDLOC:
+			*pops = 0;
+			*pushes = 1;
+			return 1;
+		case DUP:
+			*pops = 1;
+			*pushes = 2;
+			return 1;
+		case POP:
+		case STVAR:
+		case JMP:
+		case CALL:
+		case STLOC:
+			*pops = 1;
+			*pushes = 0;
+			return 1;
+		case NOT:
+		case LDIDXVAR:
+			*pops = 1;
+			*pushes = 1;
+			return 1;
+		case ADD:
+		case SUB:
+		case MUL:
+		case IMUL:
+		case DIV:
+		case IDIV:
+		case MOD:
+		case IMOD:
+		case AND:
+		case OR:
+		case XOR:
+		case SHL:
+		case SHR:
+		case EQU:
+		case NEQ:
+		case ABV:
+		case BEL:
+		case GTR:
+		case LES:
+			*pops = 2;
+			*pushes = 1;
+			return 1;
+		case JIF:
+		case STIDXVAR:
+			*pops = 2;
+			*pushes = 0;
+			return 1;
+		case SUMVAR:
+		case XORVAR:
+			*pops = 2;
+			*pushes = 1;
+			return 1;
+		case CPYVAR:
+		case FILLVAR:
+		case VADD:
+		case VSUB:
+		case VAND:
+		case VOR:
+		case VXOR:
+		case VEQU:
+		case VMIN:
+		case VMAX:
+			*pops = 3;
+			*pushes = 0;
+			return 1;
+		case CMPVAR:
+			*pops = 3;
+			*pushes = 1;
+			return 1;
+	}
+
+	return 0;
+}
+
+//Working state of the verifier, every array has an entry for every byte of code.
+//Functions holds the entry point of the function an instruction belongs to, the entry point of the
+//program counts as a function starting at 0. Locals holds the size of the frame at an instruction,
+//Returns the stack depth a function returns with, indexed by its entry point.
+typedef struct
+{
+	UINT32* Sources;
+	UINT32* Functions;
+	UINT32* Locals;
+	UINT32* Returns;
+	UINT32* Worklist;
+	UINTN Pending;
+} VMVerifyState;
+
+//Record the state flowing into an instruction, queueing it if it has not been seen in that state.
+EFI_STATUS VM_VerifyMerge(VMVerification* result, VMVerifyState* state, UINTN target, UINT32 depth, UINT32 source, UINT32 function, UINT32 locals)
+{
+	if (target >= result->CodeLength) return EFI_INVALID_PARAMETER;
+
+	if (!(result->Flags[target] & VM_CODE_VISITED))
+	{
+		result->Flags[target] |= VM_CODE_VISITED;
+		result->Depths[target] = depth;
+		state->Sources[target] = source;
+		state->Functions[target] = function;
+		state->Locals[target] = locals;
+		state->Worklist[state->Pending++] = (UINT32)target;
+		return EFI_SUCCESS;
+	}
+
+	if (result->Depths[target] != depth || state->Locals[target] != locals) return EFI_INVALID_PARAMETER;
+
+	//Code shared between functions would return to more than one kind of caller.
+	if (state->Functions[target] != function) return EFI_UNSUPPORTED;
+
+	if (state->Sources[target] != source && state->Sources[target] != VM_VERIFY_UNKNOWN)
+	{
+		state->Sources[target] = VM_VERIFY_UNKNOWN;
+		state->Worklist[state->Pending++] = (UINT32)target;
+	}
+
+	return EFI_SUCCESS;
+}
+
+//Record the stack depth a function returns with, which must be the same for every RET of the function,
+//and let every call to it that has been seen so far continue after the call.
+EFI_STATUS VM_VerifyReturn(VM* vm, VMVerification* result, VMVerifyState* state, UINT32 function, UINT32 depth)
+{
+	EFI_STATUS status;
+
+	if (state->Returns[function] == depth) return EFI_SUCCESS;
+	if (state->Returns[function] != VM_VERIFY_UNKNOWN) return EFI_INVALID_PARAMETER;
+
+	state->Returns[function] = depth;
+
+	for (UINTN i = 0; i < result->CodeLength; i++)
+	{
+		if (!(result->Flags[i] & VM_CODE_INSTRUCTION) || VM_BaseOpcode(vm->Start[i]) != CALL) continue;
+
+		//A call whose target stopped being constant is rejected when it is walked again.
+		UINT32 source = state->Sources[i];
+		if (source == VM_VERIFY_UNKNOWN || (INT64)(i + 1) + *((INT64*)&vm->Start[source + 1]) != (INT64)function) continue;
+
+		status = VM_VerifyMerge(result, state, i + 1, depth, VM_VERIFY_UNKNOWN, state->Functions[i], state->Locals[i]);
+		if (EFI_ERROR(status)) return status;
+
+		result->Flags[i + 1] |= VM_CODE_LEADER;
+	}
+
+	return EFI_SUCCESS;
+}
+
+//Walk every instruction reachable from the entry point, tracking the stack depth and which PUSH
+//produced the top of the stack so that the targets of PUSH/JMP, PUSH/JIF and PUSH/CALL pairs are known.
+//Every function is walked with its own frame, and the code after a call continues with the depth
+//the function returns with, so a function is always called at the same depth.
+EFI_STATUS VM_VerifyFlow(VM* vm, VMVerification* result, VMVerifyState* state)
+{
+	UINT8* code = vm->Start;
+	UINTN length = result->CodeLength;
+	EFI_STATUS status;
+
+	status = VM_VerifyMerge(result, state, 0, 0, VM_VERIFY_UNKNOWN, 0, 0);
+	if (EFI_ERROR(status)) return status;
+
+	result->Flags[0] |= VM_CODE_LEADER;
+
+	while (state->Pending > 0)
+	{
+		UINTN offset = state->Worklist[--state->Pending];
+		UINT8 op = VM_BaseOpcode(code[offset]);
+		UINT32 depth = result->Depths[offset];
+		UINT32 source = state->Sources[offset];
+		UINT32 function = state->Functions[offset];
+		UINT32 locals = state->Locals[offset];
+		UINTN pops;
+		UINTN pushes;
+
+		if (result->Flags[offset] & VM_CODE_OPERAND) return EFI_INVALID_PARAMETER;
+		if (!VM_StackEffect(op, &pops, &pushes)) return EFI_UNSUPPORTED;
+		if (depth < pops) return EFI_INVALID_PARAMETER;
+
+		UINTN size = 1;
+		UINT64 operand = 0;
+
+		if (op & IMMEDIATE)
+		{
+			//Mirrors the interpreter, which requires the operand to end before the last byte.
+			if (offset + 9 >= length) return EFI_INVALID_PARAMETER;
+
+			for (UINTN i = 1; i < 9; i++)
+			{
+				if (result->Flags[offset + i] & VM_CODE_INSTRUCTION) return EFI_INVALID_PARAMETER;
+				result->Flags[offset + i] |= VM_CODE_OPERAND;
+			}
+
+			operand = *((UINT64*)&code[offset + 1]);
+			size = 9;
+		}
+
+		result->Flags[offset] |= VM_CODE_INSTRUCTION;
+
+		if ((op == LDVAR || op == LDINDVAR || op == STVAR || op == LDIDXVAR || op == STIDXVAR) && operand >= vm->VarCount) return EFI_INVALID_PARAMETER;
+		if (VM_LaneOpcode(op) && operand != 2 && operand != 4) return EFI_INVALID_PARAMETER;
+		if ((op == LDLOC || op == STLOC) && operand >= locals) return EFI_INVALID_PARAMETER;
+
+		if (op == ENTER)
+		{
+			if (operand > VM_FRAME_LIMIT - locals) return EFI_INVALID_PARAMETER;
+			locals += (UINT32)operand;
+		}
+
+		UINT32 next = depth - (UINT32)pops + (UINT32)pushes;
+		if (next > result->MaxStack) result->MaxStack = next;
+
+		UINT32 nextSource = VM_VERIFY_UNKNOWN;
+		if (op == PUSH) nextSource = (UINT32)offset;
+		else if (op == DUP) nextSource = source;
+
+		if (op == HLT) continue;
+
+		if (op == RET)
+		{
+			status = VM_VerifyReturn(vm, result, state, function, depth);
+			if (EFI_ERROR(status)) return status;
+
+			continue;
+		}
+
+		if (op == JMP || op == JIF || op == CALL)
+		{
+			if (source == VM_VERIFY_UNKNOWN) return EFI_UNSUPPORTED;
+
+			INT64 target = (INT64)(offset + size) + *((INT64*)&code[source + 1]);
+			if (target < 0) return EFI_INVALID_PARAMETER;
+
+			//A call starts the function at its target with an empty frame.
+			if (op == CALL) status = VM_VerifyMerge(result, state, (UINTN)target, next, VM_VERIFY_UNKNOWN, (UINT32)target, 0);
+			else status = VM_VerifyMerge(result, state, (UINTN)target, next, VM_VERIFY_UNKNOWN, function, locals);
+			if (EFI_ERROR(status)) return status;
+
+			result->Flags[target] |= VM_CODE_LEADER;
+
+			if (op == JMP) continue;
+
+			//The code after a call is reached once a RET of the function has been walked.
+			if (op == CALL)
+			{
+				if (state->Returns[target] == VM_VERIFY_UNKNOWN) continue;
+				next = state->Returns[target];
+			}
+		}
+
+		status = VM_VerifyMerge(result, state, offset + size, next, nextSource, function, locals);
+		if (EFI_ERROR(status)) return status;
+
+		//Native code and IR hand block operations, calls and frame changes to the interpreter and resume after them.
+		if (op == JIF || op == BRK || op == CALL || op == ENTER || VM_BulkOpcode(op)) result->Flags[offset + size] |= VM_CODE_LEADER;
+	}
+
+	return EFI_SUCCESS;
+}
+
+//Split the verified code into basic blocks and record the deepest stack reached by each.
+EFI_STATUS VM_VerifyBlocks(VM* vm, VMVerification* result)
+{
+	UINTN count = 0;
+
+	for (UINTN i = 0; i < result->CodeLength; i++)
+	{
+		if ((result->Flags[i] & VM_CODE_INSTRUCTION) && (result->Flags[i] & VM_CODE_LEADER)) count++;
+	}
+
+	result->Blocks = (VMBlock*)malloc(count * sizeof(VMBlock)).Start;
+	if (result->Blocks == NULL) return EFI_OUT_OF_RESOURCES;
+
+	VMBlock* block = NULL;
+	result->BlockCount = 0;
+
+	for (UINTN i = 0; i < result->CodeLength; i++)
+	{
+		if (!(result->Flags[i] & VM_CODE_INSTRUCTION)) continue;
+
+		UINT8 op = VM_BaseOpcode(vm->Start[i]);
+		UINTN pops;
+		UINTN pushes;
+		VM_StackEffect(op, &pops, &pushes);
+
+		if (result->Flags[i] & VM_CODE_LEADER)
+		{
+			block = &result->Blocks[result->BlockCount++];
+			block->Start = (UINT32)i;
+			block->EntryDepth = result->Depths[i];
+			block->MaxDepth = result->Depths[i];
+		}
+
+		if (block == NULL) continue;
+
+		UINT32 depth = result->Depths[i] - (UINT32)pops + (UINT32)pushes;
+		if (depth > block->MaxDepth) block->MaxDepth = depth;
+
+		block->Length = (UINT32)(i + ((op & IMMEDIATE) ? 9 : 1) - block->Start);
+	}
+
+	return EFI_SUCCESS;
+}
+
+//Find the verified block starting at the specified offset, returns -1 if no block starts there.
+INTN VM_FindBlock(VMVerification* info, UINTN offset)
+{
+	UINTN low = 0;
+	UINTN high = info->BlockCount;
+
+	while (low < high)
+	{
+		UINTN middle = (low + high) / 2;
+
+		if (info->Blocks[middle].Start < offset) low = middle + 1;
+		else high = middle;
+	}
+
+	if (low >= info->BlockCount || info->Blocks[low].Start != offset) return -1;
+
+	return (INTN)low;
+}
+
+//Returns 1 if an opcode takes the offset of its target from the stack.
+inline int VM_BranchOpcode(UINT8 op)
+{
+	return op == JMP || op == JIF || op == CALL;
+}
+
+//Rewrite the compact code of a VM wide for the verified engines, in a new memory block behind a copy of
+//everything in front of the code. The PUSH right before every JMP, JIF and CALL has its offset moved to the wide positions, so every
+//branch has to follow such a PUSH and must not be a branch target itself. The block holding the compact code
+//is returned in compact, the VM is left unchanged if the code cannot be rewritten.
+EFI_STATUS VM_Widen(VM* vm, MemBlock* compact)
+{
+	UINT8* code = vm->Start;
+	UINT8* memStart = (UINT8*)vm->Memory.Start;
+	UINTN length = memStart + vm->Memory.Size - code;
+	UINTN front = code - memStart;
+	UINTN error = vm->Error - code;
+	UINTN offset = 0;
+	UINTN size = 0;
+
+	//Wide position of every compact offset that starts an instruction, and whether a branch targets it.
+	MemBlock scratch = malloc((length + 1) * (sizeof(UINT32) + 1));
+	if (scratch.Start == NULL) return EFI_OUT_OF_RESOURCES;
+
+	UINT32* positions = (UINT32*)scratch.Start;
+	UINT8* targets = (UINT8*)(positions + length + 1);
+
+	for (UINTN i = 0; i <= length; i++)
+	{
+		positions[i] = VM_VERIFY_UNKNOWN;
+		targets[i] = 0;
+	}
+
+	//An operand cut off by the end of the memory ends the code in front of it.
+	while (offset < length)
+	{
+		UINT64 operand;
+		UINTN width = (code[offset] & IMMEDIATE) ? VM_DecodeCompact(&code[offset + 1], code + length, &operand) : 0;
+		if ((code[offset] & IMMEDIATE) && width == 0) break;
+
+		positions[offset] = (UINT32)size;
+		size += width == 0 ? 1 : 9;
+		offset += 1 + width;
+	}
+
+	length = offset;
+	positions[length] = (UINT32)size;
+
+	EFI_STATUS status = error < length && positions[error] != VM_VERIFY_UNKNOWN ? EFI_SUCCESS : EFI_UNSUPPORTED;
+	MemBlock wide = { NULL, 0 };
+
+	if (!EFI_ERROR(status))
+	{
+		wide = malloc(front + size);
+		if (wide.Start == NULL) status = EFI_OUT_OF_RESOURCES;
+	}
+
+	UINT8* result = (UINT8*)wide.Start + front;
+	UINTN previous = length;
+
+	for (offset = 0; offset < length && !EFI_ERROR(status);)
+	{
+		UINT8 op = code[offset];
+		UINT64 operand = 0;
+		UINTN next = offset + 1;
+
+		if (op & IMMEDIATE) next += VM_DecodeCompact(&code[offset + 1], code + length, &operand);
+
+		if (op == PUSH && next < length && VM_BranchOpcode(code[next]))
+		{
+			INT64 target = (INT64)(next + 1) + (INT64)operand;
+
+			if (target < 0 || (UINTN)target > length || positions[target] == VM_VERIFY_UNKNOWN) status = EFI_UNSUPPORTED;
+			else operand = (UINT64)positions[target] - (positions[next] + 1);
+
+			if (!EFI_ERROR(status)) targets[target] = 1;
+		}
+
+		if (VM_BranchOpcode(op) && (previous == length || code[previous] != PUSH)) status = EFI_UNSUPPORTED;
+
+		result[positions[offset]] = op;
+		if (op & IMMEDIATE) *(UINT64*)&result[positions[offset] + 1] = operand;
+
+		previous = offset;
+		offset = next;
+	}
+
+	for (offset = 0; offset < length && !EFI_ERROR(status); offset++)
+	{
+		if (targets[offset] && positions[offset] != VM_VERIFY_UNKNOWN && VM_BranchOpcode(code[offset])) status = EFI_UNSUPPORTED;
+	}
+
+	if (!EFI_ERROR(status))
+	{
+		memcopy(wide, vm->Memory, front);
+
+		*compact = vm->Memory;
+		vm->Memory = wide;
+		vm->Variables = (UINT64*)((UINT8*)wide.Start + ((UINT8*)vm->Variables - memStart));
+		vm->Start = result;
+		vm->Current = result;
+		vm->Error = result + positions[error];
+		vm->Encoding = WideEncoding;
+	}
+	else if (wide.Start != NULL)
+	{
+		free(&wide);
+	}
+
+	free(&scratch);
+	return status;
+}
+
+//Verify the code of a VM once after loading and cache the result on it.
+//A verified program only contains known opcodes, only jumps to and calls constant targets on instruction
+//boundaries, never underflows the stack and has the same stack depth on every path into a block,
+//so the interpreter can run it without per-instruction checks. Rejected programs run checked.
+//Compact code is verified and run wide, it is only kept if the wide code is rejected.
+EFI_STATUS VM_Verify(VM* vm)
+{
+	if (vm->Verification.Status == Verified) return EFI_SUCCESS;
+	else if (vm->Verification.Status == Rejected) return EFI_UNSUPPORTED;
+
+	UINT8* memStart = (UINT8*)vm->Memory.Start;
+	UINT8* memEnd = memStart + vm->Memory.Size;
+
+	//Shared code is verified before it is shared, a VM that cleared its verification runs it checked.
+	if (vm->Code != NULL || vm->Start < memStart || vm->Start >= memEnd || vm->Current != vm->Start || vm->StackTop != 0 || vm->CallTop != 0)
+	{
+		vm->Verification.Status = Rejected;
+		return EFI_UNSUPPORTED;
+	}
+
+	VM compact = *vm;
+	compact.Memory.Start = NULL;
+
+	if (vm->Encoding == CompactEncoding)
+	{
+		EFI_STATUS widened = VM_Widen(vm, &compact.Memory);
+
+		if (EFI_ERROR(widened))
+		{
+			vm->Verification.Status = Rejected;
+			return widened;
+		}
+
+		memEnd = (UINT8*)vm->Memory.Start + vm->Memory.Size;
+	}
+
+	VMVerification result;
+	result.Status = Rejected;
+	result.MaxStack = 0;
+	result.CodeLength = memEnd - vm->Start;
+	result.Flags = (UINT8*)zmalloc(result.CodeLength).Start;
+	result.Depths = (UINT32*)malloc(result.CodeLength * sizeof(UINT32)).Start;
+	result.Blocks = NULL;
+	result.BlockCount = 0;
+
+	//Sources, functions, locals and returns, followed by a worklist that holds every offset at most twice.
+	MemBlock scratch = malloc(result.CodeLength * sizeof(UINT32) * 6);
+	EFI_STATUS status = EFI_OUT_OF_RESOURCES;
+
+	if (result.Flags != NULL && result.Depths != NULL && scratch.Start != NULL)
+	{
+		VMVerifyState state;
+		state.Sources = (UINT32*)scratch.Start;
+		state.Functions = state.Sources + result.CodeLength;
+		state.Locals = state.Functions + result.CodeLength;
+		state.Returns = state.Locals + result.CodeLength;
+		state.Worklist = state.Returns + result.CodeLength;
+		state.Pending = 0;
+
+		for (UINTN i = 0; i < result.CodeLength; i++)
+		{
+			state.Returns[i] = VM_VERIFY_UNKNOWN;
+		}
+
+		status = VM_VerifyFlow(vm, &result, &state);
+	}
+
+	if (!EFI_ERROR(status)) status = VM_VerifyBlocks(vm, &result);
+
+	if (!EFI_ERROR(status) && result.MaxStack > vm->StackLimit) status = EFI_BAD_BUFFER_SIZE;
+
+	if (!EFI_ERROR(status) && !VM_ReserveStack(vm, result.MaxStack)) status = EFI_OUT_OF_RESOURCES;
+
+	if (scratch.Start != NULL) free(&scratch);
+
+	vm->Verification = result;
+
+	if (EFI_ERROR(status))
+	{
+		VM_ClearVerification(vm);
+		vm->Verification.Status = Rejected;
+
+		if (compact.Memory.Start != NULL)
+		{
+			free(&vm->Memory);
+			vm->Memory = compact.Memory;
+			vm->Variables = compact.Variables;
+			vm->Start = compact.Start;
+			vm->Current = compact.Current;
+			vm->Error = compact.Error;
+			vm->Encoding = CompactEncoding;
+		}
+
+		return status;
+	}
+
+	if (compact.Memory.Start != NULL) free(&compact.Memory);
+
+	vm->Verification.Status = Verified;
+	return EFI_SUCCESS;
+}
@@ -0,0 +1,671 @@
+//Benchmark driver for the VM core, built for Linux against the EFI shim by the host target of the Makefile.
+//Every program is run on each engine and timed, the fastest of several runs is reported. Programs are
+//images in the format read by VMIL_Load, or VMIL sources ending in .vmil that are assembled on load.
+//Sources are assembled in both encodings, the compact engine runs the compact code on the checked interpreter.
+#include "Runtime.h"
+#include <stdio.h>
+#include <string.h>
+
+//Most results a source can declare.
+#define BENCH_EXPECTATIONS 16
+
+typedef enum
+{
+	BenchChecked,
+	BenchCompact,
+	BenchVerified,
+	BenchFused,
+	BenchIR,
+	BenchJIT,
+	BenchEngineCount
+} BenchEngine;
+
+static CONST CHAR16* BenchEngineNames[BenchEngineCount] = { L"checked", L"compact", L"verified", L"fused", L"ir", L"jit" };
+
+//Value a variable must hold when a source program halts, declared in it by a "; expect variable value" line.
+typedef struct
+{
+	UINT64 Variable;
+	UINT64 Value;
+} BenchExpectation;
+
+//Program loaded once and copied into a fresh VM for every run, the variables come first in Memory.
+//Compact holds the same program in the compact encoding, or nothing if it cannot be encoded compact.
+typedef struct
+{
+	MemBlock Memory;
+	UINT64 VarCount;
+	UINT64 Error;
+	VMEncoding Encoding;
+	MemBlock Compact;
+	UINT64 CompactError;
+	UINT64 StackLimit;
+	UINT64 Handler;
+	int HasHandler;
+	BenchExpectation Expectations[BENCH_EXPECTATIONS];
+	UINTN ExpectationCount;
+} BenchProgram;
+
+//Outcome of running a program to completion once, Passed is -1 if the program declares no results.
+typedef struct
+{
+	EFI_STATUS Status;
+	UINT64 Instructions;
+	UINT64 Nanoseconds;
+	UINT64 SetupAllocations;
+	UINT64 RunAllocations;
+	UINT64 Checksum;
+	int Passed;
+} BenchResult;
+
+//Options from the command line.
+typedef struct
+{
+	UINTN Runs;
+	UINTN Slice;
+	UINT64 Limit;
+	UINT64 Compact;
+	CONST char* Output;
+	int Engines[BenchEngineCount];
+} BenchOptions;
+
+//Parse a decimal number, returns 0 if the text is not one.
+static int Bench_ParseNumber(CONST char* text, UINT64* result)
+{
+	*result = 0;
+
+	if (*text == 0) return 0;
+
+	for (; *text != 0; text++)
+	{
+		if (*text < '0' || *text > '9') return 0;
+		*result = (*result * 10) + (UINT64)(*text - '0');
+	}
+
+	return 1;
+}
+
+//Parse a decimal number from a source line, skipping the blanks in front of it.
+//Returns the number of characters read, or 0 if there is no number.
+static UINTN Bench_ParseWide(CONST CHAR16* text, UINT64* result)
+{
+	UINTN i = 0;
+	UINTN start;
+
+	*result = 0;
+
+	while (text[i] == L' ' || text[i] == L'\t') i++;
+
+	for (start = i; text[i] >= L'0' && text[i] <= L'9'; i++)
+	{
+		*result = (*result * 10) + (UINT64)(text[i] - L'0');
+	}
+
+	return i == start ? 0 : i;
+}
+
+//Read a whole file into memory.
+static EFI_STATUS Bench_ReadFile(CONST char* path, MemBlock* result)
+{
+	EFI_FILE* file = Host_OpenFile(path, EFI_FILE_MODE_READ);
+	EFI_STATUS status = EFI_SUCCESS;
+	UINT64 size;
+
+	if (file == NULL) return EFI_NOT_FOUND;
+
+	file->SetPosition(file, 0xFFFFFFFFFFFFFFFF);
+	file->GetPosition(file, &size);
+	file->SetPosition(file, 0);
+
+	*result = malloc(size + 1);
+	if (result->Start == NULL) status = EFI_OUT_OF_RESOURCES;
+
+	if (!EFI_ERROR(status))
+	{
+		UINTN read = (UINTN)size;
+		status = file->Read(file, &read, result->Start);
+		if (!EFI_ERROR(status) && read != size) status = EFI_END_OF_FILE;
+	}
+
+	if (EFI_ERROR(status) && result->Start != NULL) free(result);
+
+	file->Close(file);
+	return status;
+}
+
+//Load an image in the format read by VMIL_Load.
+static EFI_STATUS Bench_LoadImage(CONST char* path, BenchProgram* program)
+{
+	EFI_FILE* file = Host_OpenFile(path, EFI_FILE_MODE_READ);
+	VM vm;
+
+	if (file == NULL) return EFI_NOT_FOUND;
+
+	EFI_STATUS status = VMIL_Load(file, 0, NULL, &vm);
+	file->Close(file);
+
+	if (EFI_ERROR(status)) return status;
+
+	program->Memory = memdup(&vm.Memory);
+	program->VarCount = vm.VarCount;
+	program->Error = vm.Error - vm.Start;
+	program->Encoding = vm.Encoding;
+	program->StackLimit = vm.StackLimit == VM_STACK_LIMIT ? 0 : vm.StackLimit;
+
+	if (vm.Encoding == CompactEncoding)
+	{
+		program->Compact = memdup(&vm.Memory);
+		program->CompactError = program->Error;
+	}
+
+	Dispose_VM(&vm);
+
+	return program->Memory.Start == NULL ? EFI_OUT_OF_RESOURCES : EFI_SUCCESS;
+}
+
+//Assemble a source behind room for its variables and append a HLT as its error handler, whose offset is stored in error.
+//A source that declares its own error handler at the offset in handler uses it instead, where the optimizer moved it.
+static EFI_STATUS Bench_Assemble(CHAR16* text, UINTN length, UINTN lines, UINT64 varCount, UINT64* handler, VMEncoding encoding, MemBlock* memory, UINT64* error, UINT64* errorStart, UINT64* errorLength)
+{
+	//No instruction is longer than an opcode and a compact operand, one more byte holds the error handler.
+	UINT64 variables = varCount * sizeof(UINT64);
+	UINT64 capacity = variables + (lines * (1 + VM_COMPACT_MAX)) + 1;
+	UINT64 position = variables;
+
+	*memory = zmalloc(capacity);
+	if (memory->Start == NULL) return EFI_OUT_OF_RESOURCES;
+
+	UINT64 moved = handler == NULL ? 0 : *handler;
+	EFI_STATUS status = VMIL_FromString((UINT8*)memory->Start, &position, capacity, text, length, errorStart, errorLength, handler == NULL ? NULL : &moved, encoding);
+
+	if (EFI_ERROR(status))
+	{
+		free(memory);
+		return status;
+	}
+
+	*error = handler == NULL ? position - variables : moved;
+	((UINT8*)memory->Start)[position++] = HLT;
+	memory->Size = position;
+	return EFI_SUCCESS;
+}
+
+//Assemble a VMIL source. Besides its instructions a source may declare the number of variables it uses with
+//a "; vars count" line, its stack limit with a "; stack depth" line, the offset of its own error handler with a
+//"; handler offset" line and its results with "; expect variable value" lines. A HLT is appended as the error
+//handler of sources that declare none.
+static EFI_STATUS Bench_LoadSource(CONST char* path, BenchProgram* program)
+{
+	MemBlock file;
+	EFI_STATUS status = Bench_ReadFile(path, &file);
+
+	if (EFI_ERROR(status)) return status;
+
+	UINT8* bytes = (UINT8*)file.Start;
+	UINTN length = file.Size - 1;
+	UINTN lines = 1;
+
+	//Sources are ASCII or UCS-2 with a byte order mark.
+	int wide = length >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE;
+	if (wide) length = (length - 2) / sizeof(CHAR16);
+
+	CHAR16* text = (CHAR16*)malloc((length + 1) * sizeof(CHAR16)).Start;
+
+	if (text == NULL)
+	{
+		free(&file);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	for (UINTN i = 0; i < length; i++)
+	{
+		text[i] = wide ? ((CHAR16*)(bytes + 2))[i] : (CHAR16)bytes[i];
+		if (text[i] == L'\n') lines++;
+	}
+
+	text[length] = 0;
+	free(&file);
+
+	//Directives live in comments, so the assembler skips them.
+	for (UINTN i = 0; i < length; i++)
+	{
+		UINT64 first;
+		UINT64 second;
+		UINTN read;
+
+		if (i > 0 && text[i - 1] != L'\n') continue;
+
+		if (StrnCmp(&text[i], L"; vars", 6) == 0 && Bench_ParseWide(&text[i + 6], &first) > 0)
+		{
+			program->VarCount = first;
+		}
+		else if (StrnCmp(&text[i], L"; stack", 7) == 0 && Bench_ParseWide(&text[i + 7], &first) > 0)
+		{
+			program->StackLimit = first;
+		}
+		else if (StrnCmp(&text[i], L"; handler", 9) == 0 && Bench_ParseWide(&text[i + 9], &first) > 0)
+		{
+			program->Handler = first;
+			program->HasHandler = 1;
+		}
+		else if (StrnCmp(&text[i], L"; expect", 8) == 0 && (read = Bench_ParseWide(&text[i + 8], &first)) > 0 &&
+			Bench_ParseWide(&text[i + 8 + read], &second) > 0 && program->ExpectationCount < BENCH_EXPECTATIONS)
+		{
+			program->Expectations[program->ExpectationCount].Variable = first;
+			program->Expectations[program->ExpectationCount].Value = second;
+			program->ExpectationCount++;
+		}
+	}
+
+	UINT64 errorStart = 0;
+	UINT64 errorLength = 0;
+
+	UINT64* handler = program->HasHandler ? &program->Handler : NULL;
+
+	status = Bench_Assemble(text, length, lines, program->VarCount, handler, WideEncoding, &program->Memory, &program->Error, &errorStart, &errorLength);
+
+	if (EFI_ERROR(status))
+	{
+		UINTN line = 1;
+		for (UINTN i = 0; i < errorStart; i++) line += text[i] == L'\n';
+
+		Print(L"%a:%d: %.*s: %r\n", path, line, errorLength, &text[errorStart], status);
+	}
+	else
+	{
+		Bench_Assemble(text, length, lines, program->VarCount, handler, CompactEncoding, &program->Compact, &program->CompactError, &errorStart, &errorLength);
+	}
+
+	freeany(text);
+	return status;
+}
+
+//Load an image or source, sources are recognised by their .vmil extension.
+static EFI_STATUS Bench_Load(CONST char* path, BenchProgram* program)
+{
+	UINTN length = strlen(path);
+
+	program->Memory.Start = NULL;
+	program->Memory.Size = 0;
+	program->VarCount = 0;
+	program->Error = 0;
+	program->Encoding = WideEncoding;
+	program->Compact.Start = NULL;
+	program->Compact.Size = 0;
+	program->CompactError = 0;
+	program->StackLimit = 0;
+	program->Handler = 0;
+	program->HasHandler = 0;
+	program->ExpectationCount = 0;
+
+	if (length > 5 && strcmp(path + length - 5, ".vmil") == 0) return Bench_LoadSource(path, program);
+
+	return Bench_LoadImage(path, program);
+}
+
+//FNV-1a hash of the variables of a VM, so engines can be checked against each other.
+//Addresses taken with LDINDVAR are hashed as offsets into the memory of the VM, which moves between runs.
+static UINT64 Bench_Checksum(VM* vm)
+{
+	UINT64 hash = 0xCBF29CE484222325;
+	UINT64 start = (UINT64)vm->Memory.Start;
+
+	for (UINTN i = 0; i < vm->VarCount; i++)
+	{
+		UINT64 value = vm->Variables[i];
+		if (value >= start && value < start + vm->Memory.Size) value -= start;
+
+		for (UINTN j = 0; j < sizeof(UINT64); j++)
+		{
+			hash = (hash ^ ((value >> (j * 8)) & 0xFF)) * 0x100000001B3;
+		}
+	}
+
+	return hash;
+}
+
+//Prepare a freshly loaded VM for an engine the way Runtime_Launch would.
+static EFI_STATUS Bench_Prepare(VM* vm, BenchEngine engine)
+{
+	if (engine == BenchChecked || engine == BenchCompact) return EFI_SUCCESS;
+
+	EFI_STATUS status = VM_Verify(vm);
+	if (EFI_ERROR(status) || engine == BenchVerified) return status;
+
+	VM_Fuse(vm);
+
+	if (engine == BenchIR) return IR_Translate(vm);
+	if (engine == BenchJIT) return JIT_Compile(vm);
+
+	return EFI_SUCCESS;
+}
+
+//Run a program on an engine in a fresh VM until it halts or the limit is reached, BRK resumes the program.
+static void Bench_Once(BenchProgram* program, BenchEngine engine, BenchOptions* options, BenchResult* result)
+{
+	UINT64 allocations = Host_AllocationCount();
+	VM vm;
+
+	result->Instructions = 0;
+	result->Nanoseconds = 0;
+	result->SetupAllocations = 0;
+	result->RunAllocations = 0;
+	result->Checksum = 0;
+	result->Passed = -1;
+
+	//The compact engine, and every engine with -c 1, starts from the compact code.
+	int compact = engine == BenchCompact || options->Compact;
+	MemBlock* image = compact ? &program->Compact : &program->Memory;
+
+	if (image->Start == NULL)
+	{
+		result->Status = EFI_UNSUPPORTED;
+		return;
+	}
+
+	MemBlock memory = memdup(image);
+
+	if (memory.Start == NULL)
+	{
+		result->Status = EFI_OUT_OF_RESOURCES;
+		return;
+	}
+
+	//Variables are not part of the image, start every run from the same state.
+	UINT8* entry = (UINT8*)memory.Start + (program->VarCount * sizeof(UINT64));
+	SetMem(memory.Start, program->VarCount * sizeof(UINT64), 0);
+
+	vm = New_VM(memory, 0, 1, (UINT64*)memory.Start, program->VarCount, entry, entry + (compact ? program->CompactError : program->Error));
+	vm.Encoding = compact ? CompactEncoding : program->Encoding;
+	if (program->StackLimit != 0) VM_SetStackLimit(&vm, program->StackLimit);
+
+	result->Status = Bench_Prepare(&vm, engine);
+
+	if (EFI_ERROR(result->Status))
+	{
+		Dispose_VM(&vm);
+		return;
+	}
+
+	result->SetupAllocations = Host_AllocationCount() - allocations;
+	allocations = Host_AllocationCount();
+
+	UINT64 start = Host_Now();
+
+	while (options->Limit == 0 || result->Instructions < options->Limit)
+	{
+		UINTN slice = options->Slice;
+		UINTN retired;
+		VMRunReason reason;
+
+		if (options->Limit != 0 && options->Limit - result->Instructions < slice) slice = (UINTN)(options->Limit - result->Instructions);
+
+		if (engine == BenchJIT) reason = JIT_Run(&vm, slice, &retired);
+		else if (engine == BenchIR) reason = IR_Run(&vm, slice, &retired);
+		else reason = VM_Run(&vm, slice, &retired);
+
+		result->Instructions += retired;
+
+		if (reason == Halted) break;
+		if (reason == Broke) vm.Status = Active;
+	}
+
+	result->Nanoseconds = Host_Now() - start;
+	result->RunAllocations = Host_AllocationCount() - allocations;
+	result->Checksum = Bench_Checksum(&vm);
+
+	if (program->ExpectationCount > 0) result->Passed = 1;
+
+	for (UINTN i = 0; i < program->ExpectationCount; i++)
+	{
+		BenchExpectation* expectation = &program->Expectations[i];
+		if (expectation->Variable >= vm.VarCount || vm.Variables[expectation->Variable] != expectation->Value) result->Passed = 0;
+	}
+
+	Dispose_VM(&vm);
+}
+
+//Write a program to a directory as an image in the format of Image.h, named after the program with an .img extension.
+//The image declares the stack limit of the program, otherwise the deepest stack the verifier finds, or none if
+//the verifier rejects the program.
+static EFI_STATUS Bench_Save(BenchProgram* program, CONST char* name, BenchOptions* options)
+{
+	MemBlock* image = options->Compact ? &program->Compact : &program->Memory;
+	UINT64 error = options->Compact ? program->CompactError : program->Error;
+	char path[4096];
+	UINTN length = strlen(name);
+	VM vm;
+
+	if (image->Start == NULL) return EFI_UNSUPPORTED;
+
+	if (length > 5 && strcmp(name + length - 5, ".vmil") == 0) length -= 5;
+	snprintf(path, sizeof(path), "%s/%.*s.img", options->Output, (int)length, name);
+
+	MemBlock memory = memdup(&program->Memory);
+	if (memory.Start == NULL) return EFI_OUT_OF_RESOURCES;
+
+	UINT8* entry = (UINT8*)memory.Start + (program->VarCount * sizeof(UINT64));
+	vm = New_VM(memory, 0, 1, (UINT64*)memory.Start, program->VarCount, entry, entry + program->Error);
+	vm.Encoding = program->Encoding;
+
+	UINT64 maxStack = EFI_ERROR(VM_Verify(&vm)) ? 0 : vm.Verification.MaxStack;
+	if (program->StackLimit != 0) maxStack = program->StackLimit;
+	Dispose_VM(&vm);
+
+	memory = memdup(image);
+	if (memory.Start == NULL) return EFI_OUT_OF_RESOURCES;
+
+	entry = (UINT8*)memory.Start + (program->VarCount * sizeof(UINT64));
+	vm = New_VM(memory, 0, 1, (UINT64*)memory.Start, program->VarCount, entry, entry + error);
+	vm.Encoding = options->Compact ? CompactEncoding : program->Encoding;
+
+	EFI_STATUS status = EFI_NOT_FOUND;
+	EFI_FILE* file = Host_OpenFile(path, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE);
+
+	if (file != NULL)
+	{
+		status = VMImage_Save(file, &vm, maxStack);
+		file->Close(file);
+	}
+
+	Dispose_VM(&vm);
+	return status;
+}
+
+//Print an amount scaled by 100 with two decimals.
+static void Bench_PrintFixed(UINT64 hundredths, int width)
+{
+	CHAR16 text[32];
+	SPrint(text, sizeof(text), L"%ld.%02ld", hundredths / 100, hundredths % 100);
+	Print(L"%*s", width, text);
+}
+
+//Benchmark one program on every selected engine.
+//Native code and IR only count the instructions they retire at block boundaries, so throughput is
+//always computed from the instruction count of the verified interpreter.
+static int Bench_Program(CONST char* path, BenchOptions* options)
+{
+	CONST char* name = strrchr(path, '/');
+	BenchProgram program;
+	BenchResult reference;
+	int failed = 0;
+
+	name = name == NULL ? path : name + 1;
+
+	EFI_STATUS status = Bench_Load(path, &program);
+
+	if (EFI_ERROR(status))
+	{
+		Print(L"%-16a %r\n", name, status);
+		return 1;
+	}
+
+	if (options->Output != NULL)
+	{
+		status = Bench_Save(&program, name, options);
+		if (EFI_ERROR(status)) Print(L"%-16a not saved: %r\n", name, status);
+	}
+
+	Bench_Once(&program, BenchVerified, options, &reference);
+	EFI_STATUS verified = reference.Status;
+	if (EFI_ERROR(verified)) Bench_Once(&program, BenchChecked, options, &reference);
+
+	if (EFI_ERROR(reference.Status))
+	{
+		Print(L"%-16a %r\n", name, reference.Status);
+		free(&program.Memory);
+		if (program.Compact.Start != NULL) free(&program.Compact);
+		return 1;
+	}
+
+	for (UINTN engine = 0; engine < BenchEngineCount; engine++)
+	{
+		BenchResult best = { EFI_NOT_STARTED, 0, 0, 0, 0, 0, -1 };
+
+		if (!options->Engines[engine]) continue;
+
+		for (UINTN run = 0; run < options->Runs; run++)
+		{
+			BenchResult result;
+			Bench_Once(&program, (BenchEngine)engine, options, &result);
+
+			if (EFI_ERROR(result.Status) || best.Status == EFI_NOT_STARTED || result.Nanoseconds < best.Nanoseconds) best = result;
+			if (EFI_ERROR(result.Status)) break;
+		}
+
+		Print(L"%-16a %-9s", name, BenchEngineNames[engine]);
+
+		if (EFI_ERROR(best.Status))
+		{
+			if (engine != BenchChecked && engine != BenchCompact && engine != BenchVerified && EFI_ERROR(verified)) Print(L" needs the verifier\n");
+			else if (engine == BenchVerified && EFI_ERROR(verified)) Print(L" rejected by the verifier\n");
+			else Print(L" %r\n", best.Status);
+			continue;
+		}
+
+		UINT64 nanoseconds = best.Nanoseconds == 0 ? 1 : best.Nanoseconds;
+
+		Print(L" %14ld", reference.Instructions);
+		Bench_PrintFixed(nanoseconds / 10000, 11);
+		Bench_PrintFixed(nanoseconds * 100 / (reference.Instructions == 0 ? 1 : reference.Instructions), 10);
+		Bench_PrintFixed(reference.Instructions * 100000 / nanoseconds, 11);
+		Print(L" %7ld %7ld  %016lx", best.SetupAllocations, best.RunAllocations, best.Checksum);
+
+		//A limit can stop engines at different points, so their variables are only compared on complete runs.
+		if (options->Limit == 0 && best.Checksum != reference.Checksum)
+		{
+			Print(L"  MISMATCH");
+			failed = 1;
+		}
+
+		if (options->Limit == 0 && best.Passed == 0)
+		{
+			Print(L"  WRONG RESULT");
+			failed = 1;
+		}
+
+		Print(L"\n");
+	}
+
+	free(&program.Memory);
+	if (program.Compact.Start != NULL) free(&program.Compact);
+	return failed;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	int programs = 0;
+	int failed = 0;
+	int selected = 0;
+
+	options.Runs = 5;
+	options.Slice = 1 << 20;
+	options.Limit = 0;
+	options.Compact = 0;
+	options.Output = NULL;
+
+	for (UINTN i = 0; i < BenchEngineCount; i++)
+	{
+		options.Engines[i] = 0;
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		UINT64 value;
+
+		if (argv[i][0] != '-')
+		{
+			programs++;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+		{
+			Print(L"Missing value for %a\n", argv[i]);
+			return 2;
+		}
+
+		if (strcmp(argv[i], "-e") == 0)
+		{
+			UINTN engine = 0;
+
+			for (; engine < BenchEngineCount; engine++)
+			{
+				CHAR16 wide[16];
+				SPrint(wide, sizeof(wide), L"%a", argv[i + 1]);
+				if (StrCmp(wide, BenchEngineNames[engine]) == 0) break;
+			}
+
+			if (engine == BenchEngineCount)
+			{
+				Print(L"Unknown engine %a\n", argv[i + 1]);
+				return 2;
+			}
+
+			options.Engines[engine] = 1;
+			selected = 1;
+		}
+		else if (strcmp(argv[i], "-o") == 0) options.Output = argv[i + 1];
+		else if (!Bench_ParseNumber(argv[i + 1], &value))
+		{
+			Print(L"Invalid value for %a\n", argv[i]);
+			return 2;
+		}
+		else if (strcmp(argv[i], "-r") == 0 && value > 0) options.Runs = (UINTN)value;
+		else if (strcmp(argv[i], "-s") == 0 && value > 0) options.Slice = (UINTN)value;
+		else if (strcmp(argv[i], "-l") == 0) options.Limit = value;
+		else if (strcmp(argv[i], "-c") == 0) options.Compact = value;
+		else
+		{
+			Print(L"Unknown option %a\n", argv[i]);
+			return 2;
+		}
+
+		i++;
+	}
+
+	if (programs == 0)
+	{
+		Print(L"Usage: %a [-e engine]... [-r runs] [-s slice] [-l limit] [-c 1] [-o directory] program...\n", argv[0]);
+		Print(L"Engines: checked, compact, verified, fused, ir, jit (all by default)\n");
+		Print(L"-c 1 starts every engine from the compact encoding, the verifier rewrites it wide\n");
+		Print(L"-o writes every program to the directory as an image, compact with -c 1\n");
+		return 2;
+	}
+
+	for (UINTN i = 0; i < BenchEngineCount; i++)
+	{
+		if (!selected) options.Engines[i] = 1;
+	}
+
+	Print(L"%-16a %-9a %14a %11a %10a %11a %7a %7a  %-16a\n", "Program", "Engine", "Instructions", "ms", "ns/instr", "Minstr/s", "Setup", "Allocs", "Variables");
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] == '-') i++;
+		else failed |= Bench_Program(argv[i], &options);
+	}
+
+	return failed;
+}
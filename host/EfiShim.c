@@ -0,0 +1,660 @@
+//Implements the EFI shim declared in efi.h/efilib.h with libc, so the VM core can run on Linux.
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//efi.h renames the malloc family for the core, the shim itself allocates with libc.
+#include "efi.h"
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+//Tag stored in the header of pool blocks that were mapped executable instead of taken from malloc.
+#define SHIM_EXECUTABLE 0x45584543
+
+static UINT64 AllocationCount = 0;
+static UINT64 FreeCount = 0;
+
+static EFI_STATUS EFIAPI Shim_AllocatePool(EFI_MEMORY_TYPE poolType, UINTN size, void** buffer)
+{
+	if (buffer == NULL) return EFI_INVALID_PARAMETER;
+
+	if (poolType == EfiLoaderCode || poolType == EfiBootServicesCode)
+	{
+		//Code pools are executable on real firmware, so map them that way here.
+		UINTN total = size + 16;
+		UINT8* map = mmap(NULL, total, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) return EFI_OUT_OF_RESOURCES;
+		*(UINTN*)map = total;
+		*(UINTN*)(map + 8) = SHIM_EXECUTABLE;
+		*buffer = map + 16;
+	}
+	else
+	{
+		UINT8* block = malloc(size + 16);
+		if (block == NULL) return EFI_OUT_OF_RESOURCES;
+		*(UINTN*)block = size;
+		*(UINTN*)(block + 8) = 0;
+		*buffer = block + 16;
+	}
+
+	AllocationCount++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI Shim_FreePool(void* buffer)
+{
+	if (buffer == NULL) return EFI_INVALID_PARAMETER;
+
+	UINT8* block = (UINT8*)buffer - 16;
+
+	if (*(UINTN*)(block + 8) == SHIM_EXECUTABLE) munmap(block, *(UINTN*)block);
+	else free(block);
+
+	FreeCount++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI Shim_AllocatePages(EFI_ALLOCATE_TYPE type, EFI_MEMORY_TYPE memoryType, UINTN pages, EFI_PHYSICAL_ADDRESS* memory)
+{
+	if ((type != AllocateAnyPages && type != AllocateAddress) || memory == NULL) return EFI_UNSUPPORTED;
+
+	int protection = PROT_READ | PROT_WRITE;
+	if (memoryType == EfiLoaderCode || memoryType == EfiBootServicesCode) protection |= PROT_EXEC;
+
+	if (type == AllocateAddress)
+	{
+		//The address is only a hint to kernels without MAP_FIXED_NOREPLACE, so a mapping anywhere else is undone.
+		void* wanted = (void*)(UINTN)*memory;
+		void* fixed = mmap(wanted, pages * EFI_PAGE_SIZE, protection, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+		if (fixed == MAP_FAILED) return EFI_NOT_FOUND;
+
+		if (fixed != wanted)
+		{
+			munmap(fixed, pages * EFI_PAGE_SIZE);
+			return EFI_NOT_FOUND;
+		}
+
+		AllocationCount++;
+		return EFI_SUCCESS;
+	}
+
+	void* map = mmap(NULL, pages * EFI_PAGE_SIZE, protection, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) return EFI_OUT_OF_RESOURCES;
+
+	*memory = (EFI_PHYSICAL_ADDRESS)(UINTN)map;
+	AllocationCount++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI Shim_FreePages(EFI_PHYSICAL_ADDRESS memory, UINTN pages)
+{
+	munmap((void*)(UINTN)memory, pages * EFI_PAGE_SIZE);
+	FreeCount++;
+	return EFI_SUCCESS;
+}
+
+static void EFIAPI Shim_CopyMem(void* destination, void* source, UINTN length)
+{
+	memmove(destination, source, length);
+}
+
+static void EFIAPI Shim_SetMem(void* buffer, UINTN size, UINT8 value)
+{
+	memset(buffer, value, size);
+}
+
+static EFI_BOOT_SERVICES BootServices =
+{
+	Shim_AllocatePages,
+	Shim_FreePages,
+	Shim_AllocatePool,
+	Shim_FreePool,
+	Shim_CopyMem,
+	Shim_SetMem
+};
+
+EFI_BOOT_SERVICES* BS = &BootServices;
+
+EFI_GUID GenericFileInfo = { 0x09576E92, 0x6D3F, 0x11D2, { 0x8E, 0x39, 0x00, 0xA0, 0xC9, 0x69, 0x72, 0x3B } };
+
+UINT64 Host_AllocationCount(void)
+{
+	return AllocationCount;
+}
+
+UINT64 Host_FreeCount(void)
+{
+	return FreeCount;
+}
+
+UINT64 Host_Now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (UINT64)now.tv_sec * 1000000000ull + (UINT64)now.tv_nsec;
+}
+
+//
+// #Strings#
+//
+
+void StrCpy(CHAR16* dest, CONST CHAR16* src)
+{
+	while ((*dest++ = *src++) != 0);
+}
+
+void StrnCpy(CHAR16* dest, CONST CHAR16* src, UINTN len)
+{
+	UINTN i = 0;
+	for (; i < len && src[i] != 0; i++) dest[i] = src[i];
+	for (; i < len; i++) dest[i] = 0;
+}
+
+UINTN StrLen(CONST CHAR16* s1)
+{
+	UINTN i = 0;
+	while (s1[i] != 0) i++;
+	return i;
+}
+
+UINTN StrnLen(CONST CHAR16* s1, UINTN len)
+{
+	UINTN i = 0;
+	while (i < len && s1[i] != 0) i++;
+	return i;
+}
+
+INTN StrCmp(CONST CHAR16* s1, CONST CHAR16* s2)
+{
+	while (*s1 != 0 && *s1 == *s2)
+	{
+		s1++;
+		s2++;
+	}
+
+	return (INTN)*s1 - (INTN)*s2;
+}
+
+INTN StrnCmp(CONST CHAR16* s1, CONST CHAR16* s2, UINTN len)
+{
+	while (len > 0)
+	{
+		if (*s1 != *s2) return (INTN)*s1 - (INTN)*s2;
+		if (*s1 == 0) return 0;
+
+		s1++;
+		s2++;
+		len--;
+	}
+
+	return 0;
+}
+
+void CopyMem(void* dest, CONST void* src, UINTN len)
+{
+	memmove(dest, src, len);
+}
+
+void SetMem(void* buffer, UINTN size, UINT8 value)
+{
+	memset(buffer, value, size);
+}
+
+void ZeroMem(void* buffer, UINTN size)
+{
+	memset(buffer, 0, size);
+}
+
+INTN CompareMem(CONST void* dest, CONST void* src, UINTN len)
+{
+	return memcmp(dest, src, len);
+}
+
+//
+// #Formatting#
+//
+
+typedef struct
+{
+	CHAR16* Buffer;
+	UINTN Size;
+	UINTN Length;
+} FormatTarget;
+
+static void Format_Put(FormatTarget* target, CHAR16 c)
+{
+	if (target->Buffer == NULL) putchar(c < 128 ? (int)c : '?');
+	else if (target->Length + 1 < target->Size) target->Buffer[target->Length] = c;
+
+	target->Length++;
+}
+
+static const char* StatusName(EFI_STATUS status)
+{
+	switch (status)
+	{
+		case EFI_SUCCESS: return "Success";
+		case EFI_LOAD_ERROR: return "Load Error";
+		case EFI_INVALID_PARAMETER: return "Invalid Parameter";
+		case EFI_UNSUPPORTED: return "Unsupported";
+		case EFI_BAD_BUFFER_SIZE: return "Bad Buffer Size";
+		case EFI_BUFFER_TOO_SMALL: return "Buffer Too Small";
+		case EFI_DEVICE_ERROR: return "Device Error";
+		case EFI_OUT_OF_RESOURCES: return "Out of Resources";
+		case EFI_VOLUME_CORRUPTED: return "Volume Corrupt";
+		case EFI_VOLUME_FULL: return "Volume Full";
+		case EFI_NOT_FOUND: return "Not Found";
+		case EFI_ACCESS_DENIED: return "Access Denied";
+		case EFI_NOT_STARTED: return "Not started";
+		case EFI_ABORTED: return "Aborted";
+		case EFI_INCOMPATIBLE_VERSION: return "Incompatible Version";
+		case EFI_CRC_ERROR: return "CRC Error";
+		case EFI_END_OF_FILE: return "End of File";
+		default: return "Unknown Error";
+	}
+}
+
+static void Format(FormatTarget* target, CONST CHAR16* fmt, va_list args)
+{
+	char scratch[64];
+
+	for (; *fmt != 0; fmt++)
+	{
+		if (*fmt != L'%')
+		{
+			if (*fmt == L'\n' && target->Buffer == NULL) Format_Put(target, L'\r');
+			Format_Put(target, *fmt);
+			continue;
+		}
+
+		fmt++;
+
+		int leftAlign = 0;
+		int zeroPad = 0;
+		int width = 0;
+		int precision = -1;
+
+		for (; *fmt == L'-' || *fmt == L'0'; fmt++)
+		{
+			if (*fmt == L'-') leftAlign = 1;
+			else zeroPad = 1;
+		}
+
+		if (*fmt == L'*')
+		{
+			width = va_arg(args, int);
+			fmt++;
+		}
+		else
+		{
+			for (; *fmt >= L'0' && *fmt <= L'9'; fmt++) width = (width * 10) + (*fmt - L'0');
+		}
+
+		if (*fmt == L'.')
+		{
+			fmt++;
+			precision = 0;
+
+			if (*fmt == L'*')
+			{
+				precision = (int)va_arg(args, UINTN);
+				fmt++;
+			}
+			else
+			{
+				for (; *fmt >= L'0' && *fmt <= L'9'; fmt++) precision = (precision * 10) + (*fmt - L'0');
+			}
+		}
+
+		if (*fmt == L'l') fmt++;
+
+		const char* narrow = NULL;
+		CONST CHAR16* wide = NULL;
+		int length = 0;
+
+		switch (*fmt)
+		{
+			case L'd':
+				length = snprintf(scratch, sizeof(scratch), "%lld", (long long)va_arg(args, INT64));
+				narrow = scratch;
+				break;
+			case L'u':
+				length = snprintf(scratch, sizeof(scratch), "%llu", (unsigned long long)va_arg(args, UINT64));
+				narrow = scratch;
+				break;
+			case L'x':
+				length = snprintf(scratch, sizeof(scratch), "%llx", (unsigned long long)va_arg(args, UINT64));
+				narrow = scratch;
+				break;
+			case L'X':
+				length = snprintf(scratch, sizeof(scratch), "%llX", (unsigned long long)va_arg(args, UINT64));
+				narrow = scratch;
+				break;
+			case L'c':
+				scratch[0] = (char)va_arg(args, int);
+				scratch[1] = 0;
+				length = 1;
+				narrow = scratch;
+				break;
+			case L'a':
+				narrow = va_arg(args, const char*);
+				length = (int)strlen(narrow);
+				break;
+			case L's':
+				wide = va_arg(args, CONST CHAR16*);
+				length = (int)StrLen(wide);
+				break;
+			case L'r':
+				narrow = StatusName(va_arg(args, EFI_STATUS));
+				length = (int)strlen(narrow);
+				break;
+			case L'%':
+				Format_Put(target, L'%');
+				continue;
+			case L'N':
+			case L'H':
+			case L'E':
+			case L'B':
+			case L'V':
+				continue;
+			default:
+				Format_Put(target, L'%');
+				Format_Put(target, *fmt);
+				continue;
+		}
+
+		if (precision >= 0 && (narrow != NULL || wide != NULL) && (*fmt == L's' || *fmt == L'a') && length > precision) length = precision;
+
+		int padding = width > length ? width - length : 0;
+
+		if (!leftAlign) for (int i = 0; i < padding; i++) Format_Put(target, zeroPad ? L'0' : L' ');
+
+		for (int i = 0; i < length; i++)
+		{
+			Format_Put(target, narrow != NULL ? (CHAR16)(UINT8)narrow[i] : wide[i]);
+		}
+
+		if (leftAlign) for (int i = 0; i < padding; i++) Format_Put(target, L' ');
+	}
+}
+
+UINTN Print(CONST CHAR16* fmt, ...)
+{
+	FormatTarget target = { NULL, 0, 0 };
+
+	va_list args;
+	va_start(args, fmt);
+	Format(&target, fmt, args);
+	va_end(args);
+
+	fflush(stdout);
+	return target.Length;
+}
+
+UINTN SPrint(CHAR16* str, UINTN strSize, CONST CHAR16* fmt, ...)
+{
+	FormatTarget target = { str, strSize / sizeof(CHAR16), 0 };
+
+	va_list args;
+	va_start(args, fmt);
+	Format(&target, fmt, args);
+	va_end(args);
+
+	if (target.Size > 0) str[target.Length < target.Size ? target.Length : target.Size - 1] = 0;
+
+	return target.Length;
+}
+
+//
+// #Files#
+//
+
+typedef struct
+{
+	EFI_FILE Protocol;
+	FILE* Stream;
+	DIR* Directory;
+	char Path[4096];
+} HostFile;
+
+static EFI_STATUS EFIAPI HostFile_Open(EFI_FILE* file, EFI_FILE** newHandle, CHAR16* fileName, UINT64 openMode, UINT64 attributes);
+
+static EFI_STATUS EFIAPI HostFile_Close(EFI_FILE* file)
+{
+	HostFile* self = (HostFile*)file;
+
+	if (self->Stream != NULL) fclose(self->Stream);
+	if (self->Directory != NULL) closedir(self->Directory);
+
+	free(self);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI HostFile_Delete(EFI_FILE* file)
+{
+	HostFile* self = (HostFile*)file;
+	char path[4096];
+
+	strcpy(path, self->Path);
+	HostFile_Close(file);
+
+	return remove(path) == 0 ? EFI_SUCCESS : EFI_ACCESS_DENIED;
+}
+
+static void HostFile_FillInfo(CONST char* path, CONST char* name, EFI_FILE_INFO* info, UINTN nameLength)
+{
+	struct stat st;
+	memset(info, 0, sizeof(EFI_FILE_INFO));
+
+	if (stat(path, &st) == 0)
+	{
+		info->FileSize = (UINT64)st.st_size;
+		info->PhysicalSize = (UINT64)st.st_size;
+		if (S_ISDIR(st.st_mode)) info->Attribute |= EFI_FILE_DIRECTORY;
+	}
+
+	for (UINTN i = 0; i <= nameLength; i++) info->FileName[i] = (CHAR16)(UINT8)name[i];
+
+	info->Size = sizeof(EFI_FILE_INFO) + (nameLength * sizeof(CHAR16));
+}
+
+static EFI_STATUS EFIAPI HostFile_Read(EFI_FILE* file, UINTN* bufferSize, void* buffer)
+{
+	HostFile* self = (HostFile*)file;
+
+	if (self->Directory != NULL)
+	{
+		struct dirent* entry = readdir(self->Directory);
+
+		if (entry == NULL)
+		{
+			*bufferSize = 0;
+			return EFI_SUCCESS;
+		}
+
+		UINTN nameLength = strlen(entry->d_name);
+		UINTN needed = sizeof(EFI_FILE_INFO) + (nameLength * sizeof(CHAR16));
+
+		if (*bufferSize < needed)
+		{
+			*bufferSize = needed;
+			seekdir(self->Directory, telldir(self->Directory) - 1);
+			return EFI_BUFFER_TOO_SMALL;
+		}
+
+		char path[8192];
+		snprintf(path, sizeof(path), "%s/%s", self->Path, entry->d_name);
+		HostFile_FillInfo(path, entry->d_name, (EFI_FILE_INFO*)buffer, nameLength);
+
+		*bufferSize = needed;
+		return EFI_SUCCESS;
+	}
+
+	*bufferSize = fread(buffer, 1, *bufferSize, self->Stream);
+
+	return ferror(self->Stream) ? EFI_DEVICE_ERROR : EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI HostFile_Write(EFI_FILE* file, UINTN* bufferSize, void* buffer)
+{
+	HostFile* self = (HostFile*)file;
+
+	if (self->Stream == NULL) return EFI_UNSUPPORTED;
+
+	*bufferSize = fwrite(buffer, 1, *bufferSize, self->Stream);
+
+	return ferror(self->Stream) ? EFI_DEVICE_ERROR : EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI HostFile_GetPosition(EFI_FILE* file, UINT64* position)
+{
+	HostFile* self = (HostFile*)file;
+
+	if (self->Stream == NULL) return EFI_UNSUPPORTED;
+
+	*position = (UINT64)ftell(self->Stream);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI HostFile_SetPosition(EFI_FILE* file, UINT64 position)
+{
+	HostFile* self = (HostFile*)file;
+
+	if (self->Directory != NULL)
+	{
+		if (position != 0) return EFI_UNSUPPORTED;
+		rewinddir(self->Directory);
+		return EFI_SUCCESS;
+	}
+
+	if (position == 0xFFFFFFFFFFFFFFFFull) fseek(self->Stream, 0, SEEK_END);
+	else fseek(self->Stream, (long)position, SEEK_SET);
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI HostFile_GetInfo(EFI_FILE* file, EFI_GUID* informationType, UINTN* bufferSize, void* buffer)
+{
+	HostFile* self = (HostFile*)file;
+
+	if (memcmp(informationType, &GenericFileInfo, sizeof(EFI_GUID)) != 0) return EFI_UNSUPPORTED;
+
+	CONST char* name = strrchr(self->Path, '/');
+	name = name == NULL ? self->Path : name + 1;
+
+	UINTN nameLength = strlen(name);
+	UINTN needed = sizeof(EFI_FILE_INFO) + (nameLength * sizeof(CHAR16));
+
+	if (*bufferSize < needed)
+	{
+		*bufferSize = needed;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	HostFile_FillInfo(self->Path, name, (EFI_FILE_INFO*)buffer, nameLength);
+	*bufferSize = needed;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI HostFile_SetInfo(EFI_FILE* file, EFI_GUID* informationType, UINTN bufferSize, void* buffer)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI HostFile_Flush(EFI_FILE* file)
+{
+	HostFile* self = (HostFile*)file;
+
+	if (self->Stream != NULL) fflush(self->Stream);
+
+	return EFI_SUCCESS;
+}
+
+static HostFile* HostFile_New(CONST char* path)
+{
+	HostFile* self = calloc(1, sizeof(HostFile));
+
+	self->Protocol.Revision = 0x00010000;
+	self->Protocol.Open = HostFile_Open;
+	self->Protocol.Close = HostFile_Close;
+	self->Protocol.Delete = HostFile_Delete;
+	self->Protocol.Read = HostFile_Read;
+	self->Protocol.Write = HostFile_Write;
+	self->Protocol.GetPosition = HostFile_GetPosition;
+	self->Protocol.SetPosition = HostFile_SetPosition;
+	self->Protocol.GetInfo = HostFile_GetInfo;
+	self->Protocol.SetInfo = HostFile_SetInfo;
+	self->Protocol.Flush = HostFile_Flush;
+
+	snprintf(self->Path, sizeof(self->Path), "%s", path);
+
+	return self;
+}
+
+EFI_FILE* Host_OpenDirectory(CONST char* path)
+{
+	DIR* directory = opendir(path);
+
+	if (directory == NULL) return NULL;
+
+	HostFile* self = HostFile_New(path);
+	self->Directory = directory;
+
+	return &self->Protocol;
+}
+
+EFI_FILE* Host_OpenFile(CONST char* path, UINT64 mode)
+{
+	struct stat st;
+
+	if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) return Host_OpenDirectory(path);
+
+	FILE* stream;
+
+	if (mode & EFI_FILE_MODE_CREATE) stream = fopen(path, "w+b");
+	else if (mode & EFI_FILE_MODE_WRITE) stream = fopen(path, "r+b");
+	else stream = fopen(path, "rb");
+
+	if (stream == NULL) return NULL;
+
+	HostFile* self = HostFile_New(path);
+	self->Stream = stream;
+
+	return &self->Protocol;
+}
+
+static EFI_STATUS EFIAPI HostFile_Open(EFI_FILE* file, EFI_FILE** newHandle, CHAR16* fileName, UINT64 openMode, UINT64 attributes)
+{
+	HostFile* self = (HostFile*)file;
+	char path[8192];
+	UINTN length = strlen(self->Path);
+
+	if (length + StrLen(fileName) + 2 > sizeof(path)) return EFI_INVALID_PARAMETER;
+
+	memcpy(path, self->Path, length);
+	path[length++] = '/';
+
+	for (UINTN i = 0; fileName[i] != 0; i++) path[length++] = fileName[i] == L'\\' ? '/' : (char)fileName[i];
+
+	path[length] = 0;
+
+	EFI_FILE* result = Host_OpenFile(path, openMode);
+
+	if (result == NULL) return EFI_NOT_FOUND;
+
+	*newHandle = result;
+	return EFI_SUCCESS;
+}
@@ -0,0 +1,158 @@
+#pragma once
+//Minimal subset of the EFI definitions, used to build the VM core as a hosted Linux program.
+#include <stdint.h>
+#include <stddef.h>
+
+//The core defines its own malloc family, so rename it to keep libc's allocator intact.
+#define malloc Host_malloc
+#define calloc Host_calloc
+#define realloc Host_realloc
+#define free Host_free
+
+#define EFIAPI
+#define IN
+#define OUT
+#define OPTIONAL
+#define CONST const
+#define TRUE 1
+#define FALSE 0
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int8_t INT8;
+typedef int16_t INT16;
+typedef int32_t INT32;
+typedef int64_t INT64;
+typedef uintptr_t UINTN;
+typedef intptr_t INTN;
+typedef unsigned short CHAR16;
+typedef char CHAR8;
+typedef UINT8 BOOLEAN;
+typedef void VOID;
+typedef UINTN EFI_STATUS;
+typedef void* EFI_HANDLE;
+typedef void* EFI_EVENT;
+typedef UINT64 EFI_PHYSICAL_ADDRESS;
+
+typedef struct
+{
+	UINT32 Data1;
+	UINT16 Data2;
+	UINT16 Data3;
+	UINT8 Data4[8];
+} EFI_GUID;
+
+#define EFIERR(a) ((EFI_STATUS)(((UINTN)1 << (sizeof(UINTN) * 8 - 1)) | (a)))
+#define EFI_ERROR(a) (((INTN)(a)) < 0)
+
+#define EFI_SUCCESS 0
+#define EFI_LOAD_ERROR EFIERR(1)
+#define EFI_INVALID_PARAMETER EFIERR(2)
+#define EFI_UNSUPPORTED EFIERR(3)
+#define EFI_BAD_BUFFER_SIZE EFIERR(4)
+#define EFI_BUFFER_TOO_SMALL EFIERR(5)
+#define EFI_NOT_READY EFIERR(6)
+#define EFI_DEVICE_ERROR EFIERR(7)
+#define EFI_WRITE_PROTECTED EFIERR(8)
+#define EFI_OUT_OF_RESOURCES EFIERR(9)
+#define EFI_VOLUME_CORRUPTED EFIERR(10)
+#define EFI_VOLUME_FULL EFIERR(11)
+#define EFI_NOT_FOUND EFIERR(14)
+#define EFI_ACCESS_DENIED EFIERR(15)
+#define EFI_NOT_STARTED EFIERR(19)
+#define EFI_ABORTED EFIERR(21)
+#define EFI_INCOMPATIBLE_VERSION EFIERR(25)
+#define EFI_CRC_ERROR EFIERR(27)
+#define EFI_END_OF_FILE EFIERR(31)
+
+typedef enum
+{
+	EfiReservedMemoryType,
+	EfiLoaderCode,
+	EfiLoaderData,
+	EfiBootServicesCode,
+	EfiBootServicesData
+} EFI_MEMORY_TYPE;
+
+typedef enum
+{
+	AllocateAnyPages,
+	AllocateMaxAddress,
+	AllocateAddress
+} EFI_ALLOCATE_TYPE;
+
+#define EFI_PAGE_SIZE 4096
+#define EFI_SIZE_TO_PAGES(a) (((a) >> 12) + (((a) & 0xFFF) ? 1 : 0))
+#define EFI_PAGES_TO_SIZE(a) ((a) << 12)
+
+typedef struct
+{
+	EFI_STATUS (EFIAPI *AllocatePages)(EFI_ALLOCATE_TYPE type, EFI_MEMORY_TYPE memoryType, UINTN pages, EFI_PHYSICAL_ADDRESS* memory);
+	EFI_STATUS (EFIAPI *FreePages)(EFI_PHYSICAL_ADDRESS memory, UINTN pages);
+	EFI_STATUS (EFIAPI *AllocatePool)(EFI_MEMORY_TYPE poolType, UINTN size, void** buffer);
+	EFI_STATUS (EFIAPI *FreePool)(void* buffer);
+	void (EFIAPI *CopyMem)(void* destination, void* source, UINTN length);
+	void (EFIAPI *SetMem)(void* buffer, UINTN size, UINT8 value);
+} EFI_BOOT_SERVICES;
+
+extern EFI_BOOT_SERVICES* BS;
+
+#define uefi_call_wrapper(func, va_num, ...) func(__VA_ARGS__)
+
+typedef struct
+{
+	UINT16 Year;
+	UINT8 Month;
+	UINT8 Day;
+	UINT8 Hour;
+	UINT8 Minute;
+	UINT8 Second;
+	UINT8 Pad1;
+	UINT32 Nanosecond;
+	INT16 TimeZone;
+	UINT8 Daylight;
+	UINT8 Pad2;
+} EFI_TIME;
+
+#define EFI_FILE_MODE_READ 0x0000000000000001
+#define EFI_FILE_MODE_WRITE 0x0000000000000002
+#define EFI_FILE_MODE_CREATE 0x8000000000000000
+
+#define EFI_FILE_READ_ONLY 0x0000000000000001
+#define EFI_FILE_HIDDEN 0x0000000000000002
+#define EFI_FILE_SYSTEM 0x0000000000000004
+#define EFI_FILE_RESERVED 0x0000000000000008
+#define EFI_FILE_DIRECTORY 0x0000000000000010
+#define EFI_FILE_ARCHIVE 0x0000000000000020
+
+typedef struct
+{
+	UINT64 Size;
+	UINT64 FileSize;
+	UINT64 PhysicalSize;
+	EFI_TIME CreateTime;
+	EFI_TIME LastAccessTime;
+	EFI_TIME ModificationTime;
+	UINT64 Attribute;
+	CHAR16 FileName[1];
+} EFI_FILE_INFO;
+
+extern EFI_GUID GenericFileInfo;
+#define gEfiFileInfoGuid GenericFileInfo
+
+typedef struct _EFI_FILE_HANDLE
+{
+	UINT64 Revision;
+	EFI_STATUS (EFIAPI *Open)(struct _EFI_FILE_HANDLE* file, struct _EFI_FILE_HANDLE** newHandle, CHAR16* fileName, UINT64 openMode, UINT64 attributes);
+	EFI_STATUS (EFIAPI *Close)(struct _EFI_FILE_HANDLE* file);
+	EFI_STATUS (EFIAPI *Delete)(struct _EFI_FILE_HANDLE* file);
+	EFI_STATUS (EFIAPI *Read)(struct _EFI_FILE_HANDLE* file, UINTN* bufferSize, void* buffer);
+	EFI_STATUS (EFIAPI *Write)(struct _EFI_FILE_HANDLE* file, UINTN* bufferSize, void* buffer);
+	EFI_STATUS (EFIAPI *GetPosition)(struct _EFI_FILE_HANDLE* file, UINT64* position);
+	EFI_STATUS (EFIAPI *SetPosition)(struct _EFI_FILE_HANDLE* file, UINT64 position);
+	EFI_STATUS (EFIAPI *GetInfo)(struct _EFI_FILE_HANDLE* file, EFI_GUID* informationType, UINTN* bufferSize, void* buffer);
+	EFI_STATUS (EFIAPI *SetInfo)(struct _EFI_FILE_HANDLE* file, EFI_GUID* informationType, UINTN bufferSize, void* buffer);
+	EFI_STATUS (EFIAPI *Flush)(struct _EFI_FILE_HANDLE* file);
+} EFI_FILE_PROTOCOL, EFI_FILE, *EFI_FILE_HANDLE;
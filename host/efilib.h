@@ -0,0 +1,33 @@
+#pragma once
+//Minimal subset of the gnu-efi library functions, implemented on top of libc by EfiShim.c.
+#include <efi.h>
+
+UINTN Print(CONST CHAR16* fmt, ...);
+UINTN SPrint(CHAR16* str, UINTN strSize, CONST CHAR16* fmt, ...);
+
+void StrCpy(CHAR16* dest, CONST CHAR16* src);
+void StrnCpy(CHAR16* dest, CONST CHAR16* src, UINTN len);
+UINTN StrLen(CONST CHAR16* s1);
+UINTN StrnLen(CONST CHAR16* s1, UINTN len);
+INTN StrCmp(CONST CHAR16* s1, CONST CHAR16* s2);
+INTN StrnCmp(CONST CHAR16* s1, CONST CHAR16* s2, UINTN len);
+
+void CopyMem(void* dest, CONST void* src, UINTN len);
+void SetMem(void* buffer, UINTN size, UINT8 value);
+void ZeroMem(void* buffer, UINTN size);
+INTN CompareMem(CONST void* dest, CONST void* src, UINTN len);
+
+//Opens a host file as an EFI_FILE, or returns NULL if it does not exist.
+EFI_FILE* Host_OpenFile(CONST char* path, UINT64 mode);
+
+//Opens a host directory as an EFI_FILE whose children can be opened by name.
+EFI_FILE* Host_OpenDirectory(CONST char* path);
+
+//Returns a monotonic timestamp in nanoseconds.
+UINT64 Host_Now(void);
+
+//Returns the number of AllocatePool/AllocatePages calls made so far.
+UINT64 Host_AllocationCount(void);
+
+//Returns the number of FreePool/FreePages calls made so far.
+UINT64 Host_FreeCount(void);
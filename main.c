@@ -19,12 +19,17 @@ void PrintEntry(EFI_FILE* directory, EFI_FILE_INFO* entry, int indentation)
 	{
 		EFI_FILE* self = OpenEntry(directory, entry);
 
-		ArrayList entries = GetEntries(self);
+		//The listing of every level lives in an arena that is dropped once the level is printed.
+		Arena arena = New_Arena(0);
+		ArrayList entries = GetEntries(self, &arena);
 
 		for (UINTN i = 0; i < entries.Length; i++)
 		{
 			PrintEntry(self, (EFI_FILE_INFO*)ArrayList_Get(entries, i), indentation + 1);
 		}
+
+		Dispose_ArrayList(&entries);
+		Dispose_Arena(&arena);
 	}
 }
 
@@ -36,7 +41,8 @@ void EnterEnvironment(Environment* e)
 {
 	TextEditor_Run(e);
 
-	ArrayList entries = GetEntries(e->RootDirectory);
+	Arena arena = New_Arena(0);
+	ArrayList entries = GetEntries(e->RootDirectory, &arena);
 	EFI_FILE_INFO* kernel = 0;
 
 	for (UINTN i = 0; i < entries.Length; i++)
@@ -62,6 +68,9 @@ void EnterEnvironment(Environment* e)
 
 	if (kernel == 0)
 	{
+		Dispose_ArrayList(&entries);
+		Dispose_Arena(&arena);
+
 		Print(L"Kernel was not found.\n");
 		Print(L"Press any key to continue...");
 		WaitForKey(e);
@@ -72,6 +81,10 @@ void EnterEnvironment(Environment* e)
 
 	EFI_STATUS status = Runtime_Launch(&rt, e->RootDirectory, kernel);
 
+	//The kernel is loaded, the listing it was found in is no longer needed.
+	Dispose_ArrayList(&entries);
+	Dispose_Arena(&arena);
+
 	Print(L"\nPress any key to continue...\n");
 	WaitForKey(e);
 
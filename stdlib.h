@@ -9,6 +9,319 @@ typedef struct
 	UINTN Size;
 } MemBlock;
 
+//Copy, move, fill and compare primitives. Up to 32 bytes are handled with a few loads and stores that may
+//overlap each other, longer runs with a loop of 16 byte vectors, which is SSE2 on x64. Wider vectors are left
+//out because firmware does not always enable AVX state, so the VM and everything else that vectorizes uses
+//MemVector as well. On x64, long forward copies use rep movsb when the processor has fast string moves (ERMSB).
+//Without GCC-compatible vectors the loops move one word at a time.
+#if defined(__GNUC__) && !defined(MEM_SCALAR)
+#define MEM_VECTOR 1
+typedef UINT64 MemVector __attribute__((vector_size(16)));
+#else
+#define MEM_VECTOR 0
+#endif
+
+#if MEM_VECTOR && defined(__x86_64__)
+#define MEM_STRING 1
+#else
+#define MEM_STRING 0
+#endif
+
+//Bytes from which a forward copy uses rep movsb, below it the vector loop is faster.
+#define MEM_STRING_THRESHOLD 2048
+
+#if MEM_VECTOR
+//Pointers may have any alignment, so loads and stores go through memcpy, which compiles to unaligned moves.
+inline UINT64 Mem_Load64(const UINT8* source)
+{
+	UINT64 result;
+	__builtin_memcpy(&result, source, sizeof(result));
+	return result;
+}
+
+inline void Mem_Store64(UINT8* dest, UINT64 value)
+{
+	__builtin_memcpy(dest, &value, sizeof(value));
+}
+
+inline UINT32 Mem_Load32(const UINT8* source)
+{
+	UINT32 result;
+	__builtin_memcpy(&result, source, sizeof(result));
+	return result;
+}
+
+inline void Mem_Store32(UINT8* dest, UINT32 value)
+{
+	__builtin_memcpy(dest, &value, sizeof(value));
+}
+
+inline MemVector Mem_LoadVector(const UINT8* source)
+{
+	MemVector result;
+	__builtin_memcpy(&result, source, sizeof(result));
+	return result;
+}
+
+inline void Mem_StoreVector(UINT8* dest, MemVector value)
+{
+	__builtin_memcpy(dest, &value, sizeof(value));
+}
+#endif
+
+#if MEM_STRING
+//Whether the processor has fast string moves, -1 until CPUID was asked.
+int Mem_FastStrings = -1;
+
+int Mem_HasFastStrings()
+{
+	if (Mem_FastStrings < 0)
+	{
+		UINT32 a = 0, b, c = 0, d;
+		__asm__ volatile("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+
+		Mem_FastStrings = 0;
+
+		if (a >= 7)
+		{
+			a = 7;
+			c = 0;
+			__asm__ volatile("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+			Mem_FastStrings = (b >> 9) & 1;
+		}
+	}
+
+	return Mem_FastStrings;
+}
+#endif
+
+//Copy up to 32 bytes. Everything is loaded before anything is stored, so the ranges may overlap.
+void Mem_CopySmall(UINT8* dest, const UINT8* source, UINTN size)
+{
+#if MEM_VECTOR
+	if (size >= 16)
+	{
+		MemVector head = Mem_LoadVector(source);
+		MemVector tail = Mem_LoadVector(source + size - 16);
+		Mem_StoreVector(dest, head);
+		Mem_StoreVector(dest + size - 16, tail);
+	}
+	else if (size >= 8)
+	{
+		UINT64 head = Mem_Load64(source);
+		UINT64 tail = Mem_Load64(source + size - 8);
+		Mem_Store64(dest, head);
+		Mem_Store64(dest + size - 8, tail);
+	}
+	else if (size >= 4)
+	{
+		UINT32 head = Mem_Load32(source);
+		UINT32 tail = Mem_Load32(source + size - 4);
+		Mem_Store32(dest, head);
+		Mem_Store32(dest + size - 4, tail);
+	}
+	else if (size > 0)
+	{
+		UINT8 first = source[0];
+		UINT8 middle = source[size / 2];
+		UINT8 last = source[size - 1];
+		dest[0] = first;
+		dest[size / 2] = middle;
+		dest[size - 1] = last;
+	}
+#else
+	UINT8 buffer[32];
+
+	for (UINTN i = 0; i < size; i++) buffer[i] = source[i];
+	for (UINTN i = 0; i < size; i++) dest[i] = buffer[i];
+#endif
+}
+
+//Copy more than 32 bytes front to back, dest may overlap the source if it is below it.
+void Mem_CopyForward(UINT8* dest, const UINT8* source, UINTN size)
+{
+#if MEM_STRING
+	if (size >= MEM_STRING_THRESHOLD && Mem_HasFastStrings())
+	{
+		__asm__ volatile("rep movsb" : "+D"(dest), "+S"(source), "+c"(size) : : "memory");
+		return;
+	}
+#endif
+
+#if MEM_VECTOR
+	//The last vector is loaded first, the loop may already have overwritten it when the ranges overlap.
+	MemVector tail = Mem_LoadVector(source + size - 16);
+	UINTN i = 0;
+
+	for (; i + 64 <= size; i += 64)
+	{
+		MemVector a = Mem_LoadVector(source + i);
+		MemVector b = Mem_LoadVector(source + i + 16);
+		MemVector c = Mem_LoadVector(source + i + 32);
+		MemVector d = Mem_LoadVector(source + i + 48);
+		Mem_StoreVector(dest + i, a);
+		Mem_StoreVector(dest + i + 16, b);
+		Mem_StoreVector(dest + i + 32, c);
+		Mem_StoreVector(dest + i + 48, d);
+	}
+
+	for (; i + 16 <= size; i += 16)
+	{
+		Mem_StoreVector(dest + i, Mem_LoadVector(source + i));
+	}
+
+	Mem_StoreVector(dest + size - 16, tail);
+#else
+	UINTN i = 0;
+
+	//Words can only be used when both sides reach a word boundary at the same time.
+	if ((((UINTN)dest ^ (UINTN)source) & (sizeof(UINTN) - 1)) == 0)
+	{
+		for (; ((UINTN)(dest + i) & (sizeof(UINTN) - 1)) != 0; i++) dest[i] = source[i];
+
+		for (; i + sizeof(UINTN) <= size; i += sizeof(UINTN))
+		{
+			*(UINTN*)(dest + i) = *(const UINTN*)(source + i);
+		}
+	}
+
+	for (; i < size; i++) dest[i] = source[i];
+#endif
+}
+
+//Copy more than 32 bytes back to front, dest may overlap the source if it is above it.
+void Mem_CopyBackward(UINT8* dest, const UINT8* source, UINTN size)
+{
+#if MEM_VECTOR
+	MemVector head = Mem_LoadVector(source);
+	UINTN i = size;
+
+	for (; i >= 64; i -= 64)
+	{
+		MemVector a = Mem_LoadVector(source + i - 16);
+		MemVector b = Mem_LoadVector(source + i - 32);
+		MemVector c = Mem_LoadVector(source + i - 48);
+		MemVector d = Mem_LoadVector(source + i - 64);
+		Mem_StoreVector(dest + i - 16, a);
+		Mem_StoreVector(dest + i - 32, b);
+		Mem_StoreVector(dest + i - 48, c);
+		Mem_StoreVector(dest + i - 64, d);
+	}
+
+	for (; i >= 16; i -= 16)
+	{
+		Mem_StoreVector(dest + i - 16, Mem_LoadVector(source + i - 16));
+	}
+
+	Mem_StoreVector(dest, head);
+#else
+	UINTN i = size;
+
+	if ((((UINTN)dest ^ (UINTN)source) & (sizeof(UINTN) - 1)) == 0)
+	{
+		for (; ((UINTN)(dest + i) & (sizeof(UINTN) - 1)) != 0; i--) dest[i - 1] = source[i - 1];
+
+		for (; i >= sizeof(UINTN); i -= sizeof(UINTN))
+		{
+			*(UINTN*)(dest + i - sizeof(UINTN)) = *(const UINTN*)(source + i - sizeof(UINTN));
+		}
+	}
+
+	for (; i > 0; i--) dest[i - 1] = source[i - 1];
+#endif
+}
+
+//Copy bytes between ranges that do not overlap.
+void copymem(void* dest, const void* source, UINTN size)
+{
+	if (size <= 32) Mem_CopySmall((UINT8*)dest, (const UINT8*)source, size);
+	else Mem_CopyForward((UINT8*)dest, (const UINT8*)source, size);
+}
+
+//Copy bytes between ranges that may overlap.
+void movemem(void* dest, const void* source, UINTN size)
+{
+	UINT8* to = (UINT8*)dest;
+	const UINT8* from = (const UINT8*)source;
+
+	if (to == from) return;
+
+	if (size <= 32) Mem_CopySmall(to, from, size);
+	else if ((UINTN)(to - from) >= size) Mem_CopyForward(to, from, size);
+	else Mem_CopyBackward(to, from, size);
+}
+
+//Set every byte of a range to a value.
+void fillmem(void* dest, UINT8 value, UINTN size)
+{
+	UINT8* to = (UINT8*)dest;
+	UINT64 word = value * 0x0101010101010101ULL;
+
+#if MEM_VECTOR
+	if (size >= 16)
+	{
+		MemVector vector = { word, word };
+		UINTN i = 0;
+
+		for (; i + 64 <= size; i += 64)
+		{
+			Mem_StoreVector(to + i, vector);
+			Mem_StoreVector(to + i + 16, vector);
+			Mem_StoreVector(to + i + 32, vector);
+			Mem_StoreVector(to + i + 48, vector);
+		}
+
+		for (; i + 16 <= size; i += 16) Mem_StoreVector(to + i, vector);
+
+		Mem_StoreVector(to + size - 16, vector);
+	}
+	else if (size >= 8)
+	{
+		Mem_Store64(to, word);
+		Mem_Store64(to + size - 8, word);
+	}
+	else
+	{
+		for (UINTN i = 0; i < size; i++) to[i] = value;
+	}
+#else
+	UINTN i = 0;
+
+	for (; i < size && ((UINTN)(to + i) & (sizeof(UINTN) - 1)) != 0; i++) to[i] = value;
+	for (; i + sizeof(UINTN) <= size; i += sizeof(UINTN)) *(UINTN*)(to + i) = (UINTN)word;
+	for (; i < size; i++) to[i] = value;
+#endif
+}
+
+//Compare two ranges byte by byte, returns a negative number, 0 or a positive number like memcmp.
+INTN comparemem(const void* first, const void* second, UINTN size)
+{
+	const UINT8* a = (const UINT8*)first;
+	const UINT8* b = (const UINT8*)second;
+	UINTN i = 0;
+
+#if MEM_VECTOR
+	//Whole vectors are skipped while they are equal, the bytes of the first one that is not find the result.
+	for (; i + 16 <= size; i += 16)
+	{
+		MemVector difference = Mem_LoadVector(a + i) ^ Mem_LoadVector(b + i);
+		if ((difference[0] | difference[1]) != 0) break;
+	}
+
+	for (; i + 8 <= size; i += 8)
+	{
+		if (Mem_Load64(a + i) != Mem_Load64(b + i)) break;
+	}
+#endif
+
+	for (; i < size; i++)
+	{
+		if (a[i] != b[i]) return (INTN)a[i] - (INTN)b[i];
+	}
+
+	return 0;
+}
+
 //Allocates a block of memory with the specified size.
 MemBlock malloc(UINTN size)
 {
@@ -39,11 +352,30 @@ MemBlock malloc(UINTN size)
 	return result;
 }
 
+//Allocates a block of executable memory with the specified size.
+MemBlock codealloc(UINTN size)
+{
+	MemBlock result;
+	result.Start = NULL;
+	result.Size = 0;
+
+	if (size == 0) return result;
+
+	void* handle;
+	EFI_STATUS status = uefi_call_wrapper(BS->AllocatePool, 3, EfiLoaderCode, size, &handle);
+	if (!EFI_ERROR(status))
+	{
+		result.Start = handle;
+		result.Size = size;
+	}
+	return result;
+}
+
 //Allocates a block of memory for the specified number of items of the specified size.
 MemBlock calloc(UINTN num, UINTN size)
 {
 	MemBlock result = malloc(num * size);
-	uefi_call_wrapper(BS->SetMem, 3, result.Start, result.Size, 0);
+	fillmem(result.Start, 0, result.Size);
 	return result;
 }
 
@@ -51,12 +383,7 @@ MemBlock calloc(UINTN num, UINTN size)
 MemBlock zmalloc(UINTN size)
 {
 	MemBlock result = malloc(size);
-
-	for (UINTN i = 0; i < result.Size; i++)
-	{
-		((UINT8*)result.Start)[i] = 0;
-	}
-
+	fillmem(result.Start, 0, result.Size);
 	return result;
 }
 
@@ -74,19 +401,17 @@ void freeany(void* ptr)
 	uefi_call_wrapper(BS->FreePool, 1, ptr);
 }
 
+//Copies the specified number of bytes from one block of memory to another.
 void memcopy(MemBlock dest, MemBlock src, UINTN size)
 {
-	for (UINTN i = 0; i < size; i++)
-	{
-		((UINT8*)dest.Start)[i] = ((UINT8*)src.Start)[i];
-	}
+	copymem(dest.Start, src.Start, size);
 }
 
 //Resizes the specified block of memory.
 MemBlock realloc(MemBlock* block, UINTN size)
 {
 	MemBlock result = malloc(size);
-	memcopy(result, (*block), block->Size < size ? block->Size : size);
+	if (result.Start != NULL) copymem(result.Start, block->Start, block->Size < size ? block->Size : size);
 	free(block);
 	return result;
 }
@@ -95,6 +420,6 @@ MemBlock realloc(MemBlock* block, UINTN size)
 MemBlock memdup(MemBlock* block)
 {
 	MemBlock result = malloc(block->Size);
-	memcopy(result, (*block), block->Size);
+	if (result.Start != NULL) copymem(result.Start, block->Start, block->Size);
 	return result;
 }
\ No newline at end of file